@@ -23,6 +23,8 @@ static char *ngx_set_cpu_affinity(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_set_worker_pool_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 
 
 static ngx_conf_enum_t  ngx_debug_points[] = {
@@ -125,6 +127,13 @@ static ngx_command_t  ngx_core_commands[] = {
       offsetof(ngx_core_conf_t, rlimit_sigpending),
       NULL },
 
+    { ngx_string("worker_pool_cache"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE12,
+      ngx_set_worker_pool_cache,
+      0,
+      0,
+      NULL },
+
     { ngx_string("working_directory"),
       NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -961,6 +970,9 @@ ngx_core_module_create_conf(ngx_cycle_t *cycle)
     ccf->rlimit_core = NGX_CONF_UNSET;
     ccf->rlimit_sigpending = NGX_CONF_UNSET;
 
+    ccf->pool_cache = NGX_CONF_UNSET_SIZE;
+    ccf->pool_cache_idle = NGX_CONF_UNSET_MSEC;
+
     ccf->user = (ngx_uid_t) NGX_CONF_UNSET_UINT;
     ccf->group = (ngx_gid_t) NGX_CONF_UNSET_UINT;
 
@@ -991,6 +1003,9 @@ ngx_core_module_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ccf->worker_processes, 1);
     ngx_conf_init_value(ccf->debug_points, 0);
 
+    ngx_conf_init_size_value(ccf->pool_cache, 0);
+    ngx_conf_init_msec_value(ccf->pool_cache_idle, 10000);
+
 #if (NGX_HAVE_CPU_AFFINITY)
 
     if (ccf->cpu_affinity_n
@@ -1366,3 +1381,60 @@ ngx_set_worker_processes(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static char *
+ngx_set_worker_pool_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_core_conf_t  *ccf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_msec_t   idle;
+
+    if (ccf->pool_cache != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+
+        if (cf->args->nelts != 2) {
+            return "has invalid number of arguments";
+        }
+
+        ccf->pool_cache = 0;
+        return NGX_CONF_OK;
+    }
+
+    ccf->pool_cache = ngx_parse_size(&value[1]);
+    if (ccf->pool_cache == (size_t) NGX_ERROR || ccf->pool_cache == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[2].data, "idle=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.len = value[2].len - 5;
+    s.data = value[2].data + 5;
+
+    idle = ngx_parse_time(&s, 0);
+    if (idle == (ngx_msec_t) NGX_ERROR || idle == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid idle time \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    ccf->pool_cache_idle = idle;
+
+    return NGX_CONF_OK;
+}
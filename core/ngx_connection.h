@@ -52,6 +52,8 @@ struct ngx_listening_s {
     ngx_listening_t    *previous;               /* 上一个listen socket */
     ngx_connection_t   *connection;             /* 监听的连接 */
 
+    ngx_uint_t          worker;                 /* reuseport时所属的worker编号 */
+
     /* 状态标志 */
     unsigned            open:1;                 /* sock是否已打开 */
     unsigned            remain:1;               /* sock是否保持 */
@@ -70,6 +72,11 @@ struct ngx_listening_s {
 #endif
     unsigned            keepalive:2;            /* 监听是否保持 */
 
+#if (NGX_HAVE_REUSEPORT)
+    unsigned            reuseport:1;            /* 每个worker一个独立的监听socket */
+    unsigned            add_reuseport:1;        /* 给继承的socket添加SO_REUSEPORT */
+#endif
+
 #if (NGX_HAVE_DEFERRED_ACCEPT)                  /* 操作系统TCP层支持TCP_DEFER_ACCEPT */
     unsigned            deferred_accept:1;      /* 是否延迟accept */
     unsigned            delete_deferred:1;      /* 删除延迟accept */
@@ -178,6 +185,10 @@ struct ngx_connection_s {
     ngx_buf_t          *busy_sendfile;
 #endif
 
+#if (NGX_THREAD_POOL)
+    ngx_thread_task_t  *sendfile_task;   /* 在线程池中执行sendfile的任务 */
+#endif
+
 #if (NGX_THREADS)
     ngx_atomic_t        lock;
 #endif
@@ -186,6 +197,7 @@ struct ngx_connection_s {
 /* 添加监听地址到cycle->listening，返回一个ngx_listening_t */
 ngx_listening_t *ngx_create_listening(ngx_conf_t *cf, void *sockaddr,
     socklen_t socklen);
+ngx_int_t ngx_clone_listening(ngx_conf_t *cf, ngx_listening_t *ls);
 ngx_int_t ngx_set_inherited_sockets(ngx_cycle_t *cycle);
 /* 开始监听，调用bind()和listen() */
 ngx_int_t ngx_open_listening_sockets(ngx_cycle_t *cycle);
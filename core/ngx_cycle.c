@@ -14,6 +14,8 @@ static void ngx_destroy_cycle_pools(ngx_conf_t *conf);
 static ngx_int_t ngx_cmp_sockaddr(struct sockaddr *sa1, struct sockaddr *sa2);
 static ngx_int_t ngx_init_zone_pool(ngx_cycle_t *cycle,
     ngx_shm_zone_t *shm_zone);
+static ngx_int_t ngx_copy_zone(ngx_cycle_t *cycle, ngx_shm_zone_t *shm_zone,
+    ngx_shm_zone_t *oshm_zone);
 static ngx_int_t ngx_test_lockfile(u_char *file, ngx_log_t *log);
 static void ngx_clean_old_cycles(ngx_event_t *ev);
 
@@ -50,7 +52,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
     ngx_conf_t           conf;
     ngx_pool_t          *pool;
     ngx_cycle_t         *cycle, **old;
-    ngx_shm_zone_t      *shm_zone, *oshm_zone;
+    ngx_shm_zone_t      *shm_zone, *oshm_zone, *ozone;
     ngx_list_part_t     *part, *opart;
     ngx_open_file_t     *file;
     ngx_listening_t     *ls, *nls;
@@ -433,6 +435,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
 
         shm_zone[i].shm.log = cycle->log;
 
+        ozone = NULL;
+
         opart = &old_cycle->shared_memory.part;
         oshm_zone = opart->elts;
 
@@ -460,7 +464,8 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             }
 
             if (shm_zone[i].tag == oshm_zone[n].tag
-                && shm_zone[i].shm.size == oshm_zone[n].shm.size)
+                && shm_zone[i].shm.size == oshm_zone[n].shm.size
+                && !shm_zone[i].noreuse)
             {
                 shm_zone[i].shm.addr = oshm_zone[n].shm.addr;
 
@@ -473,7 +478,17 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                 goto shm_zone_found;
             }
 
-            ngx_shm_free(&oshm_zone[n].shm);
+            /*
+             * the old zone is freed after the new cycle is set up,
+             * the old workers keep using it until they exit
+             */
+
+            if (shm_zone[i].tag == oshm_zone[n].tag
+                && shm_zone[i].copy
+                && !shm_zone[i].noreuse)
+            {
+                ozone = &oshm_zone[n];
+            }
 
             break;
         }
@@ -490,6 +505,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             goto failed;
         }
 
+        if (ozone && ngx_copy_zone(cycle, &shm_zone[i], ozone) != NGX_OK) {
+            goto failed;
+        }
+
     shm_zone_found:
 
         continue;
@@ -512,6 +531,10 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                     continue;
                 }
 
+                if (ls[i].remain) {
+                    continue;
+                }
+
                 if (ngx_cmp_sockaddr(nls[n].sockaddr, ls[i].sockaddr) == NGX_OK)
                 {
                     nls[n].fd = ls[i].fd;
@@ -522,6 +545,12 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                         nls[n].listen = 1;
                     }
 
+#if (NGX_HAVE_REUSEPORT)
+                    if (nls[n].reuseport && !ls[i].reuseport) {
+                        nls[n].add_reuseport = 1;
+                    }
+#endif
+
 #if (NGX_HAVE_DEFERRED_ACCEPT && defined SO_ACCEPTFILTER)
 
                     /*
@@ -655,7 +684,11 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
                                oshm_zone[i].shm.name.len)
                 == 0)
             {
-                goto live_shm_zone;
+                if (oshm_zone[i].shm.addr == shm_zone[n].shm.addr) {
+                    goto live_shm_zone;
+                }
+
+                break;
             }
         }
 
@@ -980,6 +1013,26 @@ ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
 }
 
 
+static ngx_int_t
+ngx_copy_zone(ngx_cycle_t *cycle, ngx_shm_zone_t *zn, ngx_shm_zone_t *ozn)
+{
+    ngx_int_t  rc;
+
+    rc = zn->copy(zn, ozn);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "shared zone \"%V\" was resized from %uz to %uz%s",
+                  &zn->shm.name, ozn->shm.size, zn->shm.size,
+                  rc == NGX_OK ? "" : ", not all entries were kept");
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_create_pidfile(ngx_str_t *name, ngx_log_t *log)
 {
@@ -1319,6 +1372,8 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->shm.exists = 0;
     shm_zone->init = NULL;
     shm_zone->tag = tag;
+    shm_zone->copy = NULL;
+    shm_zone->noreuse = 0;
 
     return shm_zone;
 }
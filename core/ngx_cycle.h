@@ -25,12 +25,16 @@
 typedef struct ngx_shm_zone_s  ngx_shm_zone_t;
 
 typedef ngx_int_t (*ngx_shm_zone_init_pt) (ngx_shm_zone_t *zone, void *data);
+typedef ngx_int_t (*ngx_shm_zone_copy_pt) (ngx_shm_zone_t *zone,
+    ngx_shm_zone_t *ozone);
 
 struct ngx_shm_zone_s {
     void                     *data;     /* e.g. 在函数 ngx_http_file_cache_set_slot（） 被设置成 ngx_http_file_cache_t */
     ngx_shm_t                 shm;      /* 共享内存属性 */
     ngx_shm_zone_init_pt      init;     /* e.g. 在函数 ngx_http_file_cache_set_slot（） 被设置成  ngx_http_file_cache_init() */
     void                     *tag;      /* 使用共享内存的模块名称（内存地址） */
+    ngx_shm_zone_copy_pt      copy;     /* reload 时大小改变，把旧共享内存的内容复制到新的共享内存 */
+    ngx_uint_t                noreuse;  /* unsigned noreuse:1; reload 时不复用旧的共享内存 */
 };
 
 
@@ -101,6 +105,9 @@ typedef struct {
      ngx_array_t              env;                  /* 运行上下文 */
      char                   **environment;          /* 环境变量 */
 
+     size_t                   pool_cache;           /* 指令worker_pool_cache设置的每个进程内存块缓存上限，0表示不缓存 */
+     ngx_msec_t               pool_cache_idle;      /* 缓存块空闲多久后释放 */
+
 #if (NGX_THREADS)
      ngx_int_t                worker_threads;       /* 工作线程数 */
      size_t                   thread_stack_size;    /* 线程栈大小 */
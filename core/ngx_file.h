@@ -27,6 +27,14 @@ struct ngx_file_s {
     ngx_event_aio_t           *aio;         /* 文件AIO */
 #endif
 
+#if (NGX_THREAD_POOL)
+    ngx_int_t                (*thread_handler)(ngx_thread_task_t *task,
+                                               ngx_file_t *file);
+                                            /* 投递线程池任务的回调 */
+    void                      *thread_ctx;  /* 回调的上下文 */
+    ngx_thread_task_t         *thread_task; /* 读文件用的线程池任务 */
+#endif
+
     unsigned                   valid_info:1;/* 是否验证了元数据 */
     unsigned                   directio:1;  /* 是否开启了directio */
 };
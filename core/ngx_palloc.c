@@ -9,8 +9,46 @@
 #include <ngx_core.h>
 
 
+#define NGX_POOL_CACHE_MIN_SHIFT  7
+#define NGX_POOL_CACHE_MAX_SHIFT  17
+#define NGX_POOL_CACHE_MAX_SIZE   (1 << NGX_POOL_CACHE_MAX_SHIFT)
+#define NGX_POOL_CACHE_SLOTS                                                  \
+    (NGX_POOL_CACHE_MAX_SHIFT - NGX_POOL_CACHE_MIN_SHIFT + 1)
+
+
+typedef struct ngx_cached_block_s  ngx_cached_block_t;
+
+struct ngx_cached_block_s {
+    ngx_cached_block_t       *next;
+};
+
+
+typedef struct {
+    ngx_cached_block_t       *block;
+    ngx_uint_t                number;
+    ngx_uint_t                low;
+} ngx_cached_block_slot_t;
+
+
+typedef struct {
+    ngx_cached_block_slot_t   slots[NGX_POOL_CACHE_SLOTS];
+    size_t                    max;
+    ngx_msec_t                idle;
+    ngx_msec_t                trimmed;
+} ngx_pool_cache_t;
+
+
 static void *ngx_palloc_block(ngx_pool_t *pool, size_t size);
 static void *ngx_palloc_large(ngx_pool_t *pool, size_t size);
+static ngx_cached_block_slot_t *ngx_pool_cache_slot(size_t *size);
+static void *ngx_get_cached_block(size_t *size, ngx_log_t *log);
+static void ngx_free_cached_block(void *p, size_t size);
+
+
+static ngx_pool_cache_t  ngx_pool_cache;
+
+ngx_pool_cache_stat_t    ngx_pool_cache_stat;
+
 
 /* ܳΪsizeСngx_pool */
 ngx_pool_t *
@@ -18,7 +56,7 @@ ngx_create_pool(size_t size, ngx_log_t *log)
 {
     ngx_pool_t  *p;
 
-    p = ngx_memalign(NGX_POOL_ALIGNMENT, size, log);
+    p = ngx_get_cached_block(&size, log);
     if (p == NULL) {
         return NULL;
     }
@@ -63,7 +101,7 @@ ngx_destroy_pool(ngx_pool_t *pool)
         ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0, "free: %p", l->alloc);
 
         if (l->alloc) {
-            ngx_free(l->alloc); /* ͷŴڴ */
+            ngx_free_cached_block(l->alloc, l->size); /* ͷŴڴ */
         }
     }
 
@@ -86,7 +124,8 @@ ngx_destroy_pool(ngx_pool_t *pool)
 #endif
 
     for (p = pool, n = pool->d.next; /* void */; p = n, n = n->d.next) {
-        ngx_free(p);    /* ͷһڴ */
+        /* ͷһڴ */
+        ngx_free_cached_block(p, p->d.end - (u_char *) p);
 
         if (n == NULL) {
             break;
@@ -103,7 +142,7 @@ ngx_reset_pool(ngx_pool_t *pool)
 
     for (l = pool->large; l; l = l->next) {
         if (l->alloc) {
-            ngx_free(l->alloc);
+            ngx_free_cached_block(l->alloc, l->size);
         }
     }
 
@@ -184,7 +223,7 @@ ngx_palloc_block(ngx_pool_t *pool, size_t size)
 
     psize = (size_t) (pool->d.end - (u_char *) pool);
 
-    m = ngx_memalign(NGX_POOL_ALIGNMENT, psize, pool->log);
+    m = ngx_get_cached_block(&psize, pool->log);
     if (m == NULL) {
         return NULL;
     }
@@ -222,7 +261,14 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     ngx_uint_t         n;
     ngx_pool_large_t  *large;
 
-    p = ngx_alloc(size, pool->log);
+    if (ngx_pool_cache.max && size <= NGX_POOL_CACHE_MAX_SIZE) {
+        p = ngx_get_cached_block(&size, pool->log);
+
+    } else {
+        p = ngx_alloc(size, pool->log);
+        size = 0;
+    }
+
     if (p == NULL) {
         return NULL;
     }
@@ -232,6 +278,7 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
     for (large = pool->large; large; large = large->next) {
         if (large->alloc == NULL) {
             large->alloc = p;
+            large->size = size;
             return p;
         }
 
@@ -242,11 +289,12 @@ ngx_palloc_large(ngx_pool_t *pool, size_t size)
 
     large = ngx_palloc(pool, sizeof(ngx_pool_large_t));
     if (large == NULL) {
-        ngx_free(p);
+        ngx_free_cached_block(p, size);
         return NULL;
     }
 
     large->alloc = p;
+    large->size = size;
     large->next = pool->large;
     pool->large = large;
 
@@ -272,6 +320,7 @@ ngx_pmemalign(ngx_pool_t *pool, size_t size, size_t alignment)
     }
 
     large->alloc = p;
+    large->size = 0;
     large->next = pool->large;
     pool->large = large;
 
@@ -288,7 +337,7 @@ ngx_pfree(ngx_pool_t *pool, void *p)
         if (p == l->alloc) {
             ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, pool->log, 0,
                            "free: %p", l->alloc);
-            ngx_free(l->alloc);
+            ngx_free_cached_block(l->alloc, l->size);
             l->alloc = NULL;
 
             return NGX_OK;
@@ -406,30 +455,142 @@ ngx_pool_delete_file(void *data)
 }
 
 
-#if 0
+void
+ngx_pool_cache_init(size_t max, ngx_msec_t idle)
+{
+    ngx_pool_cache.max = max;
+    ngx_pool_cache.idle = idle;
+    ngx_pool_cache.trimmed = ngx_current_msec;
+}
 
-static void *
-ngx_get_cached_block(size_t size)
+
+void
+ngx_pool_cache_trim(ngx_uint_t all, ngx_log_t *log)
 {
-    void                     *p;
+    size_t                    size, freed;
+    ngx_uint_t                i, n;
+    ngx_cached_block_t       *b;
     ngx_cached_block_slot_t  *slot;
 
-    if (ngx_cycle->cache == NULL) {
+    if (!all && ngx_current_msec - ngx_pool_cache.trimmed
+                < ngx_pool_cache.idle)
+    {
+        return;
+    }
+
+    ngx_pool_cache.trimmed = ngx_current_msec;
+
+    if (all) {
+        ngx_pool_cache.max = 0;
+    }
+
+    freed = 0;
+
+    /*
+     * the blocks that stayed unused since the previous trim,
+     * i.e. the low water mark of the slot, are returned to malloc()
+     */
+
+    for (i = 0; i < NGX_POOL_CACHE_SLOTS; i++) {
+        slot = &ngx_pool_cache.slots[i];
+        size = (size_t) 1 << (i + NGX_POOL_CACHE_MIN_SHIFT);
+
+        for (n = all ? slot->number : slot->low; n; n--) {
+            b = slot->block;
+            slot->block = b->next;
+            slot->number--;
+
+            ngx_free(b);
+            freed += size;
+        }
+
+        slot->low = slot->number;
+    }
+
+    ngx_pool_cache_stat.size -= freed;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, log, 0,
+                   "pool cache trim: %uz freed, %uz retained",
+                   freed, ngx_pool_cache_stat.size);
+}
+
+
+static ngx_cached_block_slot_t *
+ngx_pool_cache_slot(size_t *size)
+{
+    size_t      s;
+    ngx_uint_t  shift;
+
+    if (ngx_pool_cache.max == 0 || *size > NGX_POOL_CACHE_MAX_SIZE) {
         return NULL;
     }
 
-    slot = &ngx_cycle->cache[(size + ngx_pagesize - 1) / ngx_pagesize];
+    s = (size_t) 1 << NGX_POOL_CACHE_MIN_SHIFT;
+
+    for (shift = 0; s < *size; shift++) {
+        s <<= 1;
+    }
+
+    *size = s;
+
+    return &ngx_pool_cache.slots[shift];
+}
+
+
+static void *
+ngx_get_cached_block(size_t *size, ngx_log_t *log)
+{
+    ngx_cached_block_t       *b;
+    ngx_cached_block_slot_t  *slot;
+
+    slot = ngx_pool_cache_slot(size);
 
-    slot->tries++;
+    if (slot == NULL) {
+        return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
+    }
 
     if (slot->number) {
-        p = slot->block;
-        slot->block = slot->block->next;
-        slot->number--;
-        return p;
+        b = slot->block;
+        slot->block = b->next;
+
+        if (--slot->number < slot->low) {
+            slot->low = slot->number;
+        }
+
+        ngx_pool_cache_stat.size -= *size;
+        ngx_pool_cache_stat.hits++;
+
+        return b;
     }
 
-    return NULL;
+    ngx_pool_cache_stat.misses++;
+
+    return ngx_memalign(NGX_POOL_ALIGNMENT, *size, log);
 }
 
-#endif
+
+static void
+ngx_free_cached_block(void *p, size_t size)
+{
+    size_t                    s;
+    ngx_cached_block_t       *b;
+    ngx_cached_block_slot_t  *slot;
+
+    s = size;
+    slot = ngx_pool_cache_slot(&s);
+
+    if (slot == NULL
+        || s != size
+        || ngx_pool_cache_stat.size + size > ngx_pool_cache.max)
+    {
+        ngx_free(p);
+        return;
+    }
+
+    b = p;
+    b->next = slot->block;
+    slot->block = b;
+    slot->number++;
+
+    ngx_pool_cache_stat.size += size;
+}
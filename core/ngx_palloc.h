@@ -44,6 +44,7 @@ typedef struct ngx_pool_large_s  ngx_pool_large_t;
 struct ngx_pool_large_s {
     ngx_pool_large_t     *next;     /* ָ */
     void                 *alloc;    /* ָĴڴ */
+    size_t                size;     /* 黺еĴС0ʾ */
 };
 
 /* ڴصݿϢ */
@@ -72,6 +73,13 @@ typedef struct {
     ngx_log_t            *log;      /* ־ */
 } ngx_pool_cleanup_file_t;
 
+/* ÿ̵ڴ黺ͳ */
+typedef struct {
+    ngx_uint_t            hits;     /* ӻȡõĿ */
+    ngx_uint_t            misses;   /* ûпÿĴ */
+    size_t                size;     /* бֽ */
+} ngx_pool_cache_stat_t;
+
 
 void *ngx_alloc(size_t size, ngx_log_t *log);   /* ָСڴ */
 void *ngx_calloc(size_t size, ngx_log_t *log);  /* ָСڴ沢 */
@@ -92,5 +100,11 @@ void ngx_pool_run_cleanup_file(ngx_pool_t *p, ngx_fd_t fd);             /* 
 void ngx_pool_cleanup_file(void *data);                                 /* װngx_close_file, رdata */
 void ngx_pool_delete_file(void *data);                                  /* ɾdatangx_delete_filengx_close_file */
 
+void ngx_pool_cache_init(size_t max, ngx_msec_t idle);                  /* ڴ黺 */
+void ngx_pool_cache_trim(ngx_uint_t all, ngx_log_t *log);               /* ͷſеĻ */
+
+
+extern ngx_pool_cache_stat_t  ngx_pool_cache_stat;
+
 
 #endif /* _NGX_PALLOC_H_INCLUDED_ */
@@ -12,13 +12,22 @@
 #if (NGX_HAVE_ATOMIC_OPS)
 
 
-static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx);
+/* a waiter that has slept so many times asks for the lock to be handed off */
+#define NGX_SHMTX_HANDOFF  2
+
+
+static void ngx_shmtx_locked(ngx_shmtx_t *mtx, ngx_uint_t spun,
+    ngx_uint_t spins, ngx_uint_t sleeps, ngx_atomic_uint_t start);
+static void ngx_shmtx_wakeup(ngx_shmtx_t *mtx, ngx_uint_t all);
+static ngx_atomic_uint_t ngx_shmtx_usec(void);
 
 
 ngx_int_t
 ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 {
     mtx->lock = &addr->lock;
+    mtx->avg = &addr->spin;
+    mtx->stat = &addr->stat;
 
     if (mtx->spin == (ngx_uint_t) -1) {
         return NGX_OK;
@@ -26,7 +35,13 @@ ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 
     mtx->spin = 2048;
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+    mtx->wait = &addr->wait;
+    mtx->handoff = &addr->handoff;
+    mtx->futex = &addr->futex;
+
+#elif (NGX_HAVE_POSIX_SEM)
 
     mtx->wait = &addr->wait;
 
@@ -46,7 +61,7 @@ ngx_shmtx_create(ngx_shmtx_t *mtx, ngx_shmtx_sh_t *addr, u_char *name)
 void
 ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 {
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_POSIX_SEM && !NGX_HAVE_FUTEX)
 
     if (mtx->semaphore) {
         if (sem_destroy(&mtx->sem) == -1) {
@@ -62,46 +77,146 @@ ngx_shmtx_destroy(ngx_shmtx_t *mtx)
 ngx_uint_t
 ngx_shmtx_trylock(ngx_shmtx_t *mtx)
 {
-    return (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid));
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        mtx->stat->acquisitions++;
+        return 1;
+    }
+
+    return 0;
 }
 
 
 void
 ngx_shmtx_lock(ngx_shmtx_t *mtx)
 {
-    ngx_uint_t         i, n;
+    ngx_uint_t         i, n, spun, limit, spins, sleeps;
+    ngx_atomic_uint_t  start;
+#if (NGX_HAVE_FUTEX)
+    uint32_t           futex;
+    ngx_err_t          err;
+    ngx_uint_t         handoff;
+#endif
 
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx lock");
 
+    if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+        mtx->stat->acquisitions++;
+        return;
+    }
+
+    start = ngx_shmtx_usec();
+    spins = 0;
+    sleeps = 0;
+
+#if (NGX_HAVE_FUTEX)
+    handoff = 0;
+#endif
+
     for ( ;; ) {
 
-        if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+#if (NGX_HAVE_FUTEX)
+
+        if (*mtx->lock == (ngx_atomic_uint_t) ngx_pid) {
+
+            /* the lock has been handed off to us by its previous owner */
+
+            *mtx->handoff = 0;
+            ngx_shmtx_locked(mtx, 0, spins, sleeps, start);
             return;
         }
 
+#endif
+
+        if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
+            goto locked;
+        }
+
         if (ngx_ncpu > 1) {
 
-            for (n = 1; n < mtx->spin; n <<= 1) {
+            /*
+             * spin up to twice as long as it usually takes to get the lock,
+             * the average is kept by ngx_shmtx_locked()
+             */
+
+            limit = 2 * *mtx->avg + 16;
+
+            if (limit > mtx->spin) {
+                limit = mtx->spin;
+            }
+
+            spins++;
+
+            for (n = 1, spun = 0; spun < limit; n <<= 1) {
 
                 for (i = 0; i < n; i++) {
                     ngx_cpu_pause();
                 }
 
+                spun += n;
+
                 if (*mtx->lock == 0
                     && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
                 {
+#if (NGX_HAVE_FUTEX)
+                    if (handoff) {
+                        *mtx->handoff = 0;
+                    }
+#endif
+                    ngx_shmtx_locked(mtx, spun, spins, sleeps, start);
                     return;
                 }
             }
         }
 
-#if (NGX_HAVE_POSIX_SEM)
+#if (NGX_HAVE_FUTEX)
+
+        futex = *mtx->futex;
+
+        (void) ngx_atomic_fetch_add(mtx->wait, 1);
+
+        if ((*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid))
+            || *mtx->lock == (ngx_atomic_uint_t) ngx_pid)
+        {
+            (void) ngx_atomic_fetch_add(mtx->wait, -1);
+            goto locked;
+        }
+
+        if (!handoff && sleeps >= NGX_SHMTX_HANDOFF) {
+            handoff = ngx_atomic_cmp_set(mtx->handoff, 0, ngx_pid);
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "shmtx wait %uA%s", *mtx->wait,
+                       handoff ? " handoff" : "");
+
+        if (syscall(SYS_futex, mtx->futex, FUTEX_WAIT, futex, NULL, NULL, 0)
+            == -1)
+        {
+            err = ngx_errno;
+
+            if (err != NGX_EAGAIN && err != NGX_EINTR) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                              "futex(FUTEX_WAIT) failed while waiting "
+                              "on shmtx");
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(mtx->wait, -1);
+
+        sleeps++;
+
+        ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "shmtx awoke");
+
+        continue;
+
+#elif (NGX_HAVE_POSIX_SEM)
 
         if (mtx->semaphore) {
             (void) ngx_atomic_fetch_add(mtx->wait, 1);
 
             if (*mtx->lock == 0 && ngx_atomic_cmp_set(mtx->lock, 0, ngx_pid)) {
-                return;
+                goto locked;
             }
 
             ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
@@ -119,6 +234,8 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
                 }
             }
 
+            sleeps++;
+
             ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
                            "shmtx awoke");
 
@@ -128,6 +245,61 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 #endif
 
         ngx_sched_yield();
+
+        sleeps++;
+    }
+
+locked:
+
+#if (NGX_HAVE_FUTEX)
+    if (handoff) {
+        *mtx->handoff = 0;
+    }
+#endif
+
+    ngx_shmtx_locked(mtx, 0, spins, sleeps, start);
+}
+
+
+static void
+ngx_shmtx_locked(ngx_shmtx_t *mtx, ngx_uint_t spun, ngx_uint_t spins,
+    ngx_uint_t sleeps, ngx_atomic_uint_t start)
+{
+    ngx_atomic_uint_t   wait;
+    ngx_shmtx_stat_t   *stat;
+
+    /* the lock is held, so the statistics are updated without atomics */
+
+    stat = mtx->stat;
+
+    stat->acquisitions++;
+    stat->spins += spins;
+    stat->sleeps += sleeps;
+
+    wait = ngx_shmtx_usec() - start;
+
+    stat->wait += wait;
+
+    if (wait > stat->max_wait) {
+        stat->max_wait = wait;
+    }
+
+    /*
+     * the exponential average of the spinning that was enough to get
+     * the lock; it decays when spinning does not help and the lock
+     * is held longer than it is worth to spin
+     */
+
+    if (spun) {
+        if (spun > *mtx->avg) {
+            *mtx->avg += (spun - *mtx->avg) / 8;
+
+        } else {
+            *mtx->avg -= (*mtx->avg - spun) / 8;
+        }
+
+    } else if (spins) {
+        *mtx->avg -= *mtx->avg / 8;
     }
 }
 
@@ -135,12 +307,36 @@ ngx_shmtx_lock(ngx_shmtx_t *mtx)
 void
 ngx_shmtx_unlock(ngx_shmtx_t *mtx)
 {
+#if (NGX_HAVE_FUTEX)
+    ngx_atomic_uint_t  pid;
+#endif
+
     if (mtx->spin != (ngx_uint_t) -1) {
         ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0, "shmtx unlock");
     }
 
+#if (NGX_HAVE_FUTEX)
+
+    if (mtx->handoff) {
+        pid = *mtx->handoff;
+
+        if (pid && pid != (ngx_atomic_uint_t) ngx_pid) {
+            mtx->stat->handoffs++;
+
+            if (ngx_atomic_cmp_set(mtx->lock, ngx_pid, pid)) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                               "shmtx handoff to %P", (ngx_pid_t) pid);
+
+                ngx_shmtx_wakeup(mtx, 1);
+                return;
+            }
+        }
+    }
+
+#endif
+
     if (ngx_atomic_cmp_set(mtx->lock, ngx_pid, 0)) {
-        ngx_shmtx_wakeup(mtx);
+        ngx_shmtx_wakeup(mtx, 0);
     }
 }
 
@@ -151,8 +347,14 @@ ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid)
     ngx_log_debug0(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
                    "shmtx forced unlock");
 
+#if (NGX_HAVE_FUTEX)
+    if (mtx->handoff) {
+        (void) ngx_atomic_cmp_set(mtx->handoff, pid, 0);
+    }
+#endif
+
     if (ngx_atomic_cmp_set(mtx->lock, pid, 0)) {
-        ngx_shmtx_wakeup(mtx);
+        ngx_shmtx_wakeup(mtx, 1);
         return 1;
     }
 
@@ -160,8 +362,38 @@ ngx_shmtx_force_unlock(ngx_shmtx_t *mtx, ngx_pid_t pid)
 }
 
 
+#if (NGX_HAVE_FUTEX)
+
 static void
-ngx_shmtx_wakeup(ngx_shmtx_t *mtx)
+ngx_shmtx_wakeup(ngx_shmtx_t *mtx, ngx_uint_t all)
+{
+    if (mtx->wait == NULL || *mtx->wait == 0) {
+        return;
+    }
+
+    (void) __sync_fetch_and_add(mtx->futex, 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "shmtx wake %uA", *mtx->wait);
+
+    /*
+     * on a handoff all waiters are woken up as it is not known
+     * which of them is the new owner
+     */
+
+    if (syscall(SYS_futex, mtx->futex, FUTEX_WAKE, all ? INT_MAX : 1,
+                NULL, NULL, 0)
+        == -1)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "futex(FUTEX_WAKE) failed while wake shmtx");
+    }
+}
+
+#else
+
+static void
+ngx_shmtx_wakeup(ngx_shmtx_t *mtx, ngx_uint_t all)
 {
 #if (NGX_HAVE_POSIX_SEM)
     ngx_atomic_uint_t  wait;
@@ -194,6 +426,19 @@ ngx_shmtx_wakeup(ngx_shmtx_t *mtx)
 #endif
 }
 
+#endif
+
+
+static ngx_atomic_uint_t
+ngx_shmtx_usec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_atomic_uint_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 
 #else
 
@@ -14,26 +14,48 @@
 
 
 typedef struct {
-    ngx_atomic_t   lock;
-#if (NGX_HAVE_POSIX_SEM)
-    ngx_atomic_t   wait;
+    ngx_atomic_uint_t   acquisitions;
+    ngx_atomic_uint_t   spins;
+    ngx_atomic_uint_t   sleeps;
+    ngx_atomic_uint_t   handoffs;
+    ngx_atomic_uint_t   wait;         /* 等待锁的总时间，微秒 */
+    ngx_atomic_uint_t   max_wait;
+} ngx_shmtx_stat_t;
+
+
+typedef struct {
+    ngx_atomic_t        lock;
+#if (NGX_HAVE_FUTEX || NGX_HAVE_POSIX_SEM)
+    ngx_atomic_t        wait;
+#endif
+#if (NGX_HAVE_FUTEX)
+    ngx_atomic_t        handoff;      /* 等待过久、要求直接移交锁的进程pid */
+    uint32_t            futex;
 #endif
+    ngx_atomic_uint_t   spin;         /* 获得锁前平均自旋的次数 */
+    ngx_shmtx_stat_t    stat;
 } ngx_shmtx_sh_t;
 
 
 typedef struct {
 #if (NGX_HAVE_ATOMIC_OPS)
-    ngx_atomic_t  *lock;        /* 指向存放在共享内存里面的lock的地址 */
-#if (NGX_HAVE_POSIX_SEM)
-    ngx_atomic_t  *wait;
-    ngx_uint_t     semaphore;
-    sem_t          sem;
+    ngx_atomic_t       *lock;         /* 指向存放在共享内存里面的lock的地址 */
+#if (NGX_HAVE_FUTEX)
+    ngx_atomic_t       *wait;
+    ngx_atomic_t       *handoff;
+    uint32_t           *futex;
+#elif (NGX_HAVE_POSIX_SEM)
+    ngx_atomic_t       *wait;
+    ngx_uint_t          semaphore;
+    sem_t               sem;
 #endif
+    ngx_atomic_uint_t  *avg;
+    ngx_shmtx_stat_t   *stat;
 #else
-    ngx_fd_t       fd;          /* 文件锁，进程间共享文件描述符 */
-    u_char        *name;        /* 进程间共享文件名 */
+    ngx_fd_t            fd;           /* 文件锁，进程间共享文件描述符 */
+    u_char             *name;         /* 进程间共享文件名 */
 #endif
-    ngx_uint_t     spin;        /* 自旋锁时，可由它来控制自旋时间 */
+    ngx_uint_t          spin;         /* 自旋锁时，可由它来控制自旋时间 */
 } ngx_shmtx_t;
 
 
@@ -60,6 +60,9 @@ static ngx_slab_page_t *ngx_slab_alloc_pages(ngx_slab_pool_t *pool,
     ngx_uint_t pages);
 static void ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages);
+static void ngx_slab_insert_free(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
+    ngx_uint_t pages);
+static ngx_uint_t ngx_slab_free_bin(ngx_uint_t pages);
 static void ngx_slab_error(ngx_slab_pool_t *pool, ngx_uint_t level,
     char *text);
 
@@ -112,19 +115,24 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 
     p += n * sizeof(ngx_slab_page_t);   /* 跳过上面那些slab page */
 
+    pool->stats = (ngx_slab_stat_t *) p;
+    ngx_memzero(pool->stats, n * sizeof(ngx_slab_stat_t));
+
+    p += n * sizeof(ngx_slab_stat_t);
+
+    size = pool->end - p;
+
     pages = (ngx_uint_t) (size / (ngx_pagesize + sizeof(ngx_slab_page_t)));
 
     ngx_memzero(p, pages * sizeof(ngx_slab_page_t));
 
     pool->pages = (ngx_slab_page_t *) p;    /* pool->pages指向slab page的头 */
 
-    pool->free.prev = 0;
-    pool->free.next = (ngx_slab_page_t *) p;
-
-    /* 更新第一个slab page的状态，这儿slab成员记录了整个缓存区的页数目 */
-    pool->pages->slab = pages;
-    pool->pages->next = &pool->free;
-    pool->pages->prev = (uintptr_t) &pool->free;
+    for (i = 0; i < NGX_SLAB_FREE_BINS; i++) {
+        pool->free[i].slab = 0;
+        pool->free[i].next = &pool->free[i];
+        pool->free[i].prev = 0;
+    }
 
     /* 实际缓存区(页)的开头，对齐 */
     pool->start = (u_char *)
@@ -134,9 +142,15 @@ ngx_slab_init(ngx_slab_pool_t *pool)
     m = pages - (pool->end - pool->start) / ngx_pagesize;
     if (m > 0) {    /* 根据实际缓存区的开始和结尾再次更新内存页的数目 */
         pages -= m;
-        pool->pages->slab = pages;
     }
 
+    /* 整个缓存区作为一段连续的空闲页放入空闲链表 */
+    ngx_slab_insert_free(pool, pool->pages, pages);
+
+    pool->last = pool->pages + pages;
+    pool->pfree = pages;
+    pool->fails = 0;
+
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
 }
@@ -206,6 +220,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
     ngx_log_debug2(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0,
                    "slab alloc: %uz slot: %ui", size, slot);
 
+    pool->stats[slot].reqs++;
+
     slots = (ngx_slab_page_t *) ((u_char *) pool + sizeof(ngx_slab_pool_t));
     page = slots[slot].next;
 
@@ -245,7 +261,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                                      if (bitmap[n] != NGX_SLAB_BUSY) {
                                          p = (uintptr_t) bitmap + i;
 
-                                         goto done;
+                                         goto found;
                                      }
                                 }
                                 /* chunk所在的slab已经不再有空闲chunk，
@@ -261,7 +277,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
 
                             p = (uintptr_t) bitmap + i;
 
-                            goto done;
+                            goto found;
                         }
                     }
                 }
@@ -296,7 +312,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;
                         p += (uintptr_t) pool->start;
 
-                        goto done;
+                        goto found;
                     }
                 }
 
@@ -339,7 +355,7 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                         p += i << shift;    /* 页内chunk偏移， 移动到当前slab page未使用的编号为i的chunk */
                         p += (uintptr_t) pool->start;
 
-                        goto done;
+                        goto found;
                     }
                 }
 
@@ -379,6 +395,8 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
                 bitmap[i] = 0;
             }
 
+            pool->stats[slot].total += (ngx_pagesize >> shift) - n;
+
             page->slab = shift;
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_SMALL;
@@ -388,10 +406,12 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = ((page - pool->pages) << ngx_pagesize_shift) + s * n;
             p += (uintptr_t) pool->start;
 
-            goto done;
+            goto found;
 
         } else if (shift == ngx_slab_exact_shift) {
 
+            pool->stats[slot].total += 8 * sizeof(uintptr_t);
+
             page->slab = 1;
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_EXACT;
@@ -401,10 +421,12 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = (page - pool->pages) << ngx_pagesize_shift;
             p += (uintptr_t) pool->start;
 
-            goto done;
+            goto found;
 
         } else { /* shift > ngx_slab_exact_shift */
 
+            pool->stats[slot].total += ngx_pagesize >> shift;
+
             page->slab = ((uintptr_t) 1 << NGX_SLAB_MAP_SHIFT) | shift;
             page->next = &slots[slot];
             page->prev = (uintptr_t) &slots[slot] | NGX_SLAB_BIG;
@@ -414,12 +436,20 @@ ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size)
             p = (page - pool->pages) << ngx_pagesize_shift;
             p += (uintptr_t) pool->start;
 
-            goto done;
+            goto found;
         }
     }
 
+    pool->stats[slot].fails++;
+
     p = 0;
 
+    goto done;
+
+found:
+
+    pool->stats[slot].used++;
+
 done:
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab alloc: %p", p);
@@ -450,7 +480,7 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 {
     size_t            size;
     uintptr_t         slab, m, *bitmap;
-    ngx_uint_t        n, type, slot, shift, map;
+    ngx_uint_t        i, n, type, slot, shift, map;
     ngx_slab_page_t  *slots, *page;
 
     ngx_log_debug1(NGX_LOG_DEBUG_ALLOC, ngx_cycle->log, 0, "slab free: %p", p);
@@ -482,11 +512,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         bitmap = (uintptr_t *) ((uintptr_t) p & ~(ngx_pagesize - 1));
 
         if (bitmap[n] & m) {
+            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -497,6 +527,8 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             bitmap[n] &= ~m;
 
+            pool->stats[slot].used--;
+
             n = (1 << (ngx_pagesize_shift - shift)) / 8 / (1 << shift);
 
             if (n == 0) {
@@ -509,14 +541,16 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             map = (1 << (ngx_pagesize_shift - shift)) / (sizeof(uintptr_t) * 8);
 
-            for (n = 1; n < map; n++) {
-                if (bitmap[n]) {
+            for (i = 1; i < map; i++) {
+                if (bitmap[i]) {
                     goto done;
                 }
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= (ngx_pagesize >> shift) - n;
+
             goto done;
         }
 
@@ -533,10 +567,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
         }
 
         if (slab & m) {
+            slot = ngx_slab_exact_shift - pool->min_shift;
+
             if (slab == NGX_SLAB_BUSY) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = ngx_slab_exact_shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -547,12 +582,16 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             page->slab &= ~m;
 
+            pool->stats[slot].used--;
+
             if (page->slab) {
                 goto done;
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= 8 * sizeof(uintptr_t);
+
             goto done;
         }
 
@@ -571,11 +610,11 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
                               + NGX_SLAB_MAP_SHIFT);
 
         if (slab & m) {
+            slot = shift - pool->min_shift;
 
             if (page->next == NULL) {
                 slots = (ngx_slab_page_t *)
                                    ((u_char *) pool + sizeof(ngx_slab_pool_t));
-                slot = shift - pool->min_shift;
 
                 page->next = slots[slot].next;
                 slots[slot].next = page;
@@ -586,12 +625,16 @@ ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p)
 
             page->slab &= ~m;
 
+            pool->stats[slot].used--;
+
             if (page->slab & NGX_SLAB_MAP_MASK) {
                 goto done;
             }
 
             ngx_slab_free_pages(pool, page, 1);
 
+            pool->stats[slot].total -= ngx_pagesize >> shift;
+
             goto done;
         }
 
@@ -653,53 +696,152 @@ fail:
 }
 
 
-static ngx_slab_page_t *
-ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
+/*
+ * splits the free pages of the pool into n nested pools,
+ * each of them has its own mutex
+ */
+
+ngx_int_t
+ngx_slab_split(ngx_slab_pool_t *pool, ngx_slab_pool_t **pools, ngx_uint_t n)
 {
-    ngx_slab_page_t  *page, *p;
+#if (NGX_HAVE_ATOMIC_OPS)
 
-    for (page = pool->free.next; page != &pool->free; page = page->next) {
+    size_t            size;
+    ngx_uint_t        i, b, pages, fit;
+    ngx_slab_page_t  *page;
+    ngx_slab_pool_t  *sp;
+
+    ngx_shmtx_lock(&pool->mutex);
 
-        if (page->slab >= pages) {
+    /* the free pages may be split into several runs */
 
-            if (page->slab > pages) {
-                page[pages].slab = page->slab - pages;
-                page[pages].next = page->next;
-                page[pages].prev = page->prev;
+    for (pages = pool->pfree / n; pages >= 8; pages--) {
 
-                p = (ngx_slab_page_t *) page->prev;
-                p->next = &page[pages];
-                page->next->prev = (uintptr_t) &page[pages];
+        fit = 0;
 
-            } else {
-                p = (ngx_slab_page_t *) page->prev;
-                p->next = page->next;
-                page->next->prev = page->prev;
+        for (b = 0; b < NGX_SLAB_FREE_BINS; b++) {
+            for (page = pool->free[b].next;
+                 page != &pool->free[b];
+                 page = page->next)
+            {
+                fit += page->slab / pages;
             }
+        }
 
-            page->slab = pages | NGX_SLAB_PAGE_START;
-            page->next = NULL;
-            page->prev = NGX_SLAB_PAGE;
+        if (fit >= n) {
+            break;
+        }
+    }
 
-            if (--pages == 0) {
-                return page;
-            }
+    if (pages < 8) {
+        ngx_shmtx_unlock(&pool->mutex);
+        return NGX_ERROR;
+    }
 
-            /* 如果分配的页数N>1，更新后面page slab的slab成员为NGX_SLAB_PAGE_BUSY */
-            for (p = page + 1; pages; pages--) {
-                p->slab = NGX_SLAB_PAGE_BUSY;
-                p->next = NULL;
-                p->prev = NGX_SLAB_PAGE;
-                p++;
-            }
+    size = pages << ngx_pagesize_shift;
 
-            return page;
+    for (i = 0; i < n; i++) {
+
+        sp = ngx_slab_alloc_locked(pool, size);
+        if (sp == NULL) {
+            ngx_shmtx_unlock(&pool->mutex);
+            return NGX_ERROR;
+        }
+
+        sp->end = (u_char *) sp + size;
+        sp->min_shift = pool->min_shift;
+        sp->addr = sp;
+
+        if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+            ngx_shmtx_unlock(&pool->mutex);
+            return NGX_ERROR;
         }
+
+        ngx_slab_init(sp);
+
+        sp->log_ctx = pool->log_ctx;
+
+        /* the nested pools are linked for ngx_unlock_mutexes() */
+
+        sp->nested = NULL;
+        sp->next = pool->nested;
+        pool->nested = sp;
+
+        pools[i] = sp;
     }
 
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return NGX_OK;
+
+#else
+
+    /* the file based mutexes can not be created in the nested pools */
+
+    return NGX_ERROR;
+
+#endif
+}
+
+
+static ngx_slab_page_t *
+ngx_slab_alloc_pages(ngx_slab_pool_t *pool, ngx_uint_t pages)
+{
+    ngx_uint_t        bin;
+    ngx_slab_page_t  *page, *p;
+
+    /*
+     * only the first bin may have runs shorter than needed,
+     * the first run of any next bin is long enough
+     */
+
+    for (bin = ngx_slab_free_bin(pages); bin < NGX_SLAB_FREE_BINS; bin++) {
+
+        for (page = pool->free[bin].next;
+             page != &pool->free[bin];
+             page = page->next)
+        {
+            if (page->slab >= pages) {
+                goto found;
+            }
+        }
+    }
+
+    pool->fails++;
+
     ngx_slab_error(pool, NGX_LOG_CRIT, "ngx_slab_alloc() failed: no memory");
 
     return NULL;
+
+found:
+
+    p = (ngx_slab_page_t *) page->prev;
+    p->next = page->next;
+    page->next->prev = page->prev;
+
+    if (page->slab > pages) {
+        ngx_slab_insert_free(pool, &page[pages], page->slab - pages);
+    }
+
+    pool->pfree -= pages;
+
+    page->slab = pages | NGX_SLAB_PAGE_START;
+    page->next = NULL;
+    page->prev = NGX_SLAB_PAGE;
+
+    if (--pages == 0) {
+        return page;
+    }
+
+    /* 如果分配的页数N>1，更新后面page slab的slab成员为NGX_SLAB_PAGE_BUSY */
+    for (p = page + 1; pages; pages--) {
+        p->slab = NGX_SLAB_PAGE_BUSY;
+        p->next = NULL;
+        p->prev = NGX_SLAB_PAGE;
+        p++;
+    }
+
+    return page;
 }
 
 
@@ -707,12 +849,12 @@ static void
 ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
     ngx_uint_t pages)
 {
-    ngx_slab_page_t  *prev;
+    ngx_slab_page_t  *prev, *join;
 
-    page->slab = pages--;
+    pool->pfree += pages;
 
-    if (pages) {
-        ngx_memzero(&page[1], pages * sizeof(ngx_slab_page_t));
+    if (pages > 1) {
+        ngx_memzero(&page[1], (pages - 1) * sizeof(ngx_slab_page_t));
     }
 
     if (page->next) {
@@ -721,12 +863,118 @@ ngx_slab_free_pages(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
         page->next->prev = page->prev;
     }
 
-    page->prev = (uintptr_t) &pool->free;
-    page->next = pool->free.next;
+    /*
+     * the head of a free run is linked in a free list, and the last page
+     * of a run longer than one page points to the head, so the adjacent
+     * free runs can be coalesced
+     */
+
+    join = page + pages;
+
+    if (join < pool->last
+        && (join->prev & NGX_SLAB_PAGE_MASK) == NGX_SLAB_PAGE
+        && join->next != NULL)
+    {
+        prev = (ngx_slab_page_t *) join->prev;
+        prev->next = join->next;
+        join->next->prev = join->prev;
+
+        pages += join->slab;
+
+        join->slab = NGX_SLAB_PAGE_FREE;
+        join->next = NULL;
+        join->prev = NGX_SLAB_PAGE;
+    }
+
+    if (page > pool->pages) {
+        join = page - 1;
+
+        if ((join->prev & NGX_SLAB_PAGE_MASK) == NGX_SLAB_PAGE) {
+
+            if (join->slab == NGX_SLAB_PAGE_FREE && join->prev) {
+                join = (ngx_slab_page_t *) join->prev;
+            }
+
+            if (join->next != NULL) {
+                prev = (ngx_slab_page_t *) join->prev;
+                prev->next = join->next;
+                join->next->prev = join->prev;
+
+                pages += join->slab;
 
+                page->slab = NGX_SLAB_PAGE_FREE;
+                page->next = NULL;
+                page->prev = NGX_SLAB_PAGE;
+
+                page = join;
+            }
+        }
+    }
+
+    ngx_slab_insert_free(pool, page, pages);
+}
+
+
+static void
+ngx_slab_insert_free(ngx_slab_pool_t *pool, ngx_slab_page_t *page,
+    ngx_uint_t pages)
+{
+    ngx_slab_page_t  *free;
+
+    free = &pool->free[ngx_slab_free_bin(pages)];
+
+    page->slab = pages;
+    page->prev = (uintptr_t) free;
+    page->next = free->next;
     page->next->prev = (uintptr_t) page;
 
-    pool->free.next = page;
+    free->next = page;
+
+    if (pages > 1) {
+        page[pages - 1].slab = NGX_SLAB_PAGE_FREE;
+        page[pages - 1].next = NULL;
+        page[pages - 1].prev = (uintptr_t) page;
+    }
+}
+
+
+static ngx_uint_t
+ngx_slab_free_bin(ngx_uint_t pages)
+{
+    ngx_uint_t  bin;
+
+    for (bin = 0; pages >>= 1; bin++) { /* void */ }
+
+    return (bin < NGX_SLAB_FREE_BINS) ? bin : NGX_SLAB_FREE_BINS - 1;
+}
+
+
+ngx_uint_t
+ngx_slab_largest_free_locked(ngx_slab_pool_t *pool)
+{
+    ngx_int_t         bin;
+    ngx_uint_t        largest;
+    ngx_slab_page_t  *page;
+
+    for (bin = NGX_SLAB_FREE_BINS - 1; bin >= 0; bin--) {
+
+        largest = 0;
+
+        for (page = pool->free[bin].next;
+             page != &pool->free[bin];
+             page = page->next)
+        {
+            if (page->slab > largest) {
+                largest = page->slab;
+            }
+        }
+
+        if (largest) {
+            return largest;
+        }
+    }
+
+    return 0;
 }
 
 
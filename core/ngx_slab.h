@@ -31,14 +31,35 @@ struct ngx_slab_page_s {
 };
 
 
-typedef struct {    /* 内存缓存池 */
+#define NGX_SLAB_FREE_BINS  24
+
+
+typedef struct {
+    ngx_uint_t        total;        /* slot的页中chunk的总数 */
+    ngx_uint_t        used;         /* 已分配的chunk数 */
+
+    ngx_uint_t        reqs;
+    ngx_uint_t        fails;
+} ngx_slab_stat_t;
+
+
+typedef struct ngx_slab_pool_s  ngx_slab_pool_t;
+
+struct ngx_slab_pool_s {    /* 内存缓存池 */
     ngx_shmtx_sh_t    lock;         /* mutex的锁 */
 
     size_t            min_size;     /* 内存缓存obj最小的大小，一般是1个byte */
     size_t            min_shift;    /* 最小slot的chunk对应的幂值，默认为3*/
 
     ngx_slab_page_t  *pages;        /* slab的管理结构体数组首地址 */
-    ngx_slab_page_t   free;         /* 可用slab page的开头,从free.next开始分配 */
+    ngx_slab_page_t  *last;         /* slab的管理结构体数组的结尾 */
+
+    /* 按连续空闲页数分级的空闲链表，第i级的页数在[2^i, 2^(i+1))之间 */
+    ngx_slab_page_t   free[NGX_SLAB_FREE_BINS];
+
+    ngx_slab_stat_t  *stats;        /* 每个slot的统计 */
+    ngx_uint_t        pfree;        /* 空闲页数 */
+    ngx_uint_t        fails;        /* 分配失败的次数 */
 
     u_char           *start;        /* 实际slab存储对象空间的开头  */
     u_char           *end;          /* 整个slab pool空间的结尾 */
@@ -50,7 +71,10 @@ typedef struct {    /* 内存缓存池 */
 
     void             *data;         /* 用户数据 */
     void             *addr;         /* 指向ngx_slab_pool_t的开头 */
-} ngx_slab_pool_t;
+
+    ngx_slab_pool_t  *nested;       /* ngx_slab_split()嵌套池的链表 */
+    ngx_slab_pool_t  *next;         /* 同一父池的下一个嵌套池 */
+};
 
 
 void ngx_slab_init(ngx_slab_pool_t *pool);
@@ -58,6 +82,9 @@ void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
 void ngx_slab_free(ngx_slab_pool_t *pool, void *p);
 void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+ngx_uint_t ngx_slab_largest_free_locked(ngx_slab_pool_t *pool);
+ngx_int_t ngx_slab_split(ngx_slab_pool_t *pool, ngx_slab_pool_t **pools,
+    ngx_uint_t n);
 
 
 #endif /* _NGX_SLAB_H_INCLUDED_ */
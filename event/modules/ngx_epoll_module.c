@@ -68,12 +68,13 @@ int epoll_wait(int epfd, struct epoll_event *events, int nevents, int timeout)
     return -1;
 }
 
+#define SYS_eventfd       323
+
 #if (NGX_HAVE_FILE_AIO)
 
 #define SYS_io_setup      245
 #define SYS_io_destroy    246
 #define SYS_io_getevents  247
-#define SYS_eventfd       323
 
 typedef u_int  aio_context_t;
 
@@ -95,7 +96,26 @@ typedef struct {
 } ngx_epoll_conf_t;
 
 
+/*
+ * The interest list changes are not passed to the kernel at once,
+ * the connections are queued in the change list and their epoll state
+ * is reconciled before the next epoll_wait().  Only a descriptor which
+ * is not in the epoll yet is added at once, so that a failure to add
+ * it is returned to the caller.
+ */
+
+typedef struct {
+    uint32_t    events;     /* the events registered in the epoll */
+    uint32_t    flags;      /* the flags of the last change */
+    ngx_uint_t  change;     /* the position in the change list plus one */
+} ngx_epoll_conn_t;
+
+
 static ngx_int_t ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_epoll_notify_init(ngx_log_t *log);
+static void ngx_epoll_notify_handler(ngx_event_t *ev);
+#endif
 static void ngx_epoll_done(ngx_cycle_t *cycle);
 static ngx_int_t ngx_epoll_add_event(ngx_event_t *ev, ngx_int_t event,
     ngx_uint_t flags);
@@ -104,6 +124,17 @@ static ngx_int_t ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event,
 static ngx_int_t ngx_epoll_add_connection(ngx_connection_t *c);
 static ngx_int_t ngx_epoll_del_connection(ngx_connection_t *c,
     ngx_uint_t flags);
+static ngx_epoll_conn_t *ngx_epoll_get_conn(ngx_connection_t *c);
+static ngx_int_t ngx_epoll_post_change(ngx_connection_t *c,
+    ngx_epoll_conn_t *ec);
+static void ngx_epoll_drop_change(ngx_epoll_conn_t *ec);
+static ngx_int_t ngx_epoll_commit_change(ngx_connection_t *c,
+    ngx_epoll_conn_t *ec);
+static ngx_int_t ngx_epoll_process_changes(ngx_cycle_t *cycle,
+    ngx_uint_t nowait);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_epoll_notify(ngx_event_handler_pt handler);
+#endif
 static ngx_int_t ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
     ngx_uint_t flags);
 
@@ -118,6 +149,22 @@ static int                  ep = -1;
 static struct epoll_event  *event_list;
 static ngx_uint_t           nevents;
 
+static ngx_epoll_conn_t    *conn_list;
+static ngx_connection_t   **change_list;
+static ngx_uint_t           nchanges;
+static ngx_uint_t           max_changes;
+
+#if (NGX_STAT_STUB)
+static ngx_atomic_int_t     nctl;
+static ngx_atomic_int_t     nctl_requested;
+#endif
+
+#if (NGX_HAVE_EVENTFD)
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+static ngx_connection_t     notify_conn;
+#endif
+
 #if (NGX_HAVE_FILE_AIO)
 
 int                         ngx_eventfd = -1;
@@ -162,7 +209,12 @@ ngx_event_module_t  ngx_epoll_module_ctx = {
         ngx_epoll_del_event,             /* disable an event */
         ngx_epoll_add_connection,        /* add an connection */
         ngx_epoll_del_connection,        /* delete an connection */
-        NULL,                            /* process the changes */
+#if (NGX_HAVE_EVENTFD)
+        ngx_epoll_notify,                /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_epoll_process_changes,       /* process the changes */
         ngx_epoll_process_events,        /* process the events */
         ngx_epoll_init,                  /* init the events */
         ngx_epoll_done,                  /* done the events */
@@ -305,6 +357,12 @@ ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer)
             return NGX_ERROR;
         }
 
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_epoll_notify_init(cycle->log) != NGX_OK) {
+            ngx_epoll_module_ctx.actions.notify = NULL;
+        }
+#endif
+
 #if (NGX_HAVE_FILE_AIO)
 
         ngx_epoll_aio_init(cycle, epcf);
@@ -326,6 +384,33 @@ ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer)
 
     nevents = epcf->events;
 
+    if (max_changes < cycle->connection_n) {
+        if (conn_list) {
+            ngx_free(conn_list);
+        }
+
+        if (change_list) {
+            ngx_free(change_list);
+        }
+
+        conn_list = ngx_alloc(sizeof(ngx_epoll_conn_t) * cycle->connection_n,
+                              cycle->log);
+        if (conn_list == NULL) {
+            return NGX_ERROR;
+        }
+
+        change_list = ngx_alloc(sizeof(ngx_connection_t *)
+                                * cycle->connection_n, cycle->log);
+        if (change_list == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memzero(conn_list, sizeof(ngx_epoll_conn_t) * cycle->connection_n);
+
+    nchanges = 0;
+    max_changes = cycle->connection_n;
+
     ngx_io = ngx_os_io;
 
     ngx_event_actions = ngx_epoll_module_ctx.actions;
@@ -342,6 +427,88 @@ ngx_epoll_init(ngx_cycle_t *cycle, ngx_msec_t timer)
 }
 
 
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_epoll_notify_init(ngx_log_t *log)
+{
+    struct epoll_event  ee;
+
+    notify_fd = syscall(SYS_eventfd, 0);
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_epoll_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    ee.events = EPOLLIN|EPOLLET;
+    ee.data.ptr = &notify_conn;
+
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, notify_fd, &ee) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno,
+                      "epoll_ctl(EPOLL_CTL_ADD, eventfd) failed");
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                            "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_epoll_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    /*
+     * the eventfd is edge-triggered, so the counter is read only
+     * once in a while to prevent its overflow
+     */
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
 static void
 ngx_epoll_done(ngx_cycle_t *cycle)
 {
@@ -352,6 +519,19 @@ ngx_epoll_done(ngx_cycle_t *cycle)
 
     ep = -1;
 
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
 #if (NGX_HAVE_FILE_AIO)
 
     if (ngx_eventfd != -1) {
@@ -377,6 +557,14 @@ ngx_epoll_done(ngx_cycle_t *cycle)
 
     event_list = NULL;
     nevents = 0;
+
+    ngx_free(conn_list);
+    ngx_free(change_list);
+
+    conn_list = NULL;
+    change_list = NULL;
+    nchanges = 0;
+    max_changes = 0;
 }
 
 
@@ -387,10 +575,38 @@ ngx_epoll_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
     uint32_t             events, prev;
     ngx_event_t         *e;
     ngx_connection_t    *c;
+    ngx_epoll_conn_t    *ec;
     struct epoll_event   ee;
 
     c = ev->data;
 
+    ec = ngx_epoll_get_conn(c);
+
+    if (ec) {
+        ev->active = 1;
+        ec->flags = (uint32_t) flags;
+
+        if (ec->events) {
+            return ngx_epoll_post_change(c, ec);
+        }
+
+        /*
+         * a descriptor not in the epoll yet is added at once,
+         * so the caller learns if epoll_ctl() rejects it
+         */
+
+#if (NGX_STAT_STUB)
+        nctl_requested++;
+#endif
+
+        if (ngx_epoll_commit_change(c, ec) != NGX_OK) {
+            ev->active = 0;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
     events = (uint32_t) event;
 
     if (event == NGX_READ_EVENT) {
@@ -445,8 +661,13 @@ ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
     uint32_t             prev;
     ngx_event_t         *e;
     ngx_connection_t    *c;
+    ngx_epoll_conn_t    *ec;
     struct epoll_event   ee;
 
+    c = ev->data;
+
+    ec = ngx_epoll_get_conn(c);
+
     /*
      * when the file descriptor is closed, the epoll automatically deletes
      * it from its queue, so we do not need to delete explicitly the event
@@ -455,10 +676,34 @@ ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
 
     if (flags & NGX_CLOSE_EVENT) {
         ev->active = 0;
+
+        if (ec) {
+            ngx_epoll_drop_change(ec);
+            ec->events = 0;
+        }
+
         return NGX_OK;
     }
 
-    c = ev->data;
+    if (ec) {
+        ev->active = 0;
+        ec->flags = (uint32_t) flags;
+
+        if (c->read->active || c->write->active) {
+            return ngx_epoll_post_change(c, ec);
+        }
+
+        /*
+         * the descriptor may be closed without a notification after
+         * all its events were deleted, so the change is applied at once
+         */
+
+#if (NGX_STAT_STUB)
+        nctl_requested++;
+#endif
+
+        return ngx_epoll_commit_change(c, ec);
+    }
 
     if (event == NGX_READ_EVENT) {
         e = c->write;
@@ -499,7 +744,32 @@ ngx_epoll_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
 static ngx_int_t
 ngx_epoll_add_connection(ngx_connection_t *c)
 {
-    struct epoll_event  ee;
+    ngx_epoll_conn_t    *ec;
+    struct epoll_event   ee;
+
+    ec = ngx_epoll_get_conn(c);
+
+    if (ec) {
+        c->read->active = 1;
+        c->write->active = 1;
+        ec->flags = EPOLLET;
+
+        if (ec->events) {
+            return ngx_epoll_post_change(c, ec);
+        }
+
+#if (NGX_STAT_STUB)
+        nctl_requested++;
+#endif
+
+        if (ngx_epoll_commit_change(c, ec) != NGX_OK) {
+            c->read->active = 0;
+            c->write->active = 0;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
 
     ee.events = EPOLLIN|EPOLLOUT|EPOLLET;
     ee.data.ptr = (void *) ((uintptr_t) c | c->read->instance);
@@ -524,8 +794,11 @@ static ngx_int_t
 ngx_epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags)
 {
     int                 op;
+    ngx_epoll_conn_t   *ec;
     struct epoll_event  ee;
 
+    ec = ngx_epoll_get_conn(c);
+
     /*
      * when the file descriptor is closed the epoll automatically deletes
      * it from its queue so we do not need to delete explicitly the event
@@ -535,9 +808,26 @@ ngx_epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags)
     if (flags & NGX_CLOSE_EVENT) {
         c->read->active = 0;
         c->write->active = 0;
+
+        if (ec) {
+            ngx_epoll_drop_change(ec);
+            ec->events = 0;
+        }
+
         return NGX_OK;
     }
 
+    if (ec) {
+        c->read->active = 0;
+        c->write->active = 0;
+
+#if (NGX_STAT_STUB)
+        nctl_requested++;
+#endif
+
+        return ngx_epoll_commit_change(c, ec);
+    }
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "epoll del connection: fd:%d", c->fd);
 
@@ -558,6 +848,234 @@ ngx_epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags)
 }
 
 
+static ngx_epoll_conn_t *
+ngx_epoll_get_conn(ngx_connection_t *c)
+{
+    ngx_uint_t  n;
+
+    if (ngx_cycle->connections == NULL || c < ngx_cycle->connections) {
+        return NULL;
+    }
+
+    n = c - ngx_cycle->connections;
+
+    if (n >= max_changes) {
+        return NULL;
+    }
+
+    return &conn_list[n];
+}
+
+
+static ngx_int_t
+ngx_epoll_post_change(ngx_connection_t *c, ngx_epoll_conn_t *ec)
+{
+#if (NGX_STAT_STUB)
+    nctl_requested++;
+#endif
+
+    if (ec->change) {
+        return NGX_OK;
+    }
+
+    if (nchanges == max_changes) {
+        (void) ngx_epoll_process_changes((ngx_cycle_t *) ngx_cycle, 0);
+    }
+
+    change_list[nchanges++] = c;
+    ec->change = nchanges;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_epoll_drop_change(ngx_epoll_conn_t *ec)
+{
+    if (ec->change) {
+        change_list[ec->change - 1] = NULL;
+        ec->change = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_epoll_commit_change(ngx_connection_t *c, ngx_epoll_conn_t *ec)
+{
+    int                  op;
+    uint32_t             events;
+    ngx_err_t            err;
+    struct epoll_event   ee;
+
+    ngx_epoll_drop_change(ec);
+
+    events = 0;
+
+    if (c->read->active) {
+        events |= EPOLLIN;
+    }
+
+    if (c->write->active) {
+        events |= EPOLLOUT;
+    }
+
+    if (events) {
+        events |= ec->flags;
+    }
+
+    if (events == ec->events) {
+        return NGX_OK;
+    }
+
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+
+    } else if (ec->events == 0) {
+        op = EPOLL_CTL_ADD;
+
+    } else if ((events | ec->events) & NGX_EXCLUSIVE_EVENT) {
+
+        /* EPOLLEXCLUSIVE can not be modified, the descriptor is added anew */
+
+        ee.events = 0;
+        ee.data.ptr = NULL;
+
+        if (epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, &ee) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                          "epoll_ctl(%d, %d) failed", EPOLL_CTL_DEL, c->fd);
+            return NGX_ERROR;
+        }
+
+#if (NGX_STAT_STUB)
+        nctl++;
+#endif
+
+        ec->events = 0;
+        op = EPOLL_CTL_ADD;
+
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    ee.events = events;
+    ee.data.ptr = events ? (void *) ((uintptr_t) c | c->read->instance)
+                         : NULL;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "epoll change: fd:%d op:%d ev:%08XD",
+                   c->fd, op, ee.events);
+
+#if (NGX_STAT_STUB)
+    nctl++;
+#endif
+
+    if (epoll_ctl(ep, op, c->fd, &ee) == -1) {
+        err = ngx_errno;
+
+        /*
+         * the descriptor might be closed and reused behind our back,
+         * so the registered state is stale
+         */
+
+        if (op == EPOLL_CTL_MOD && err == NGX_ENOENT) {
+            op = EPOLL_CTL_ADD;
+
+        } else if (op == EPOLL_CTL_ADD && err == NGX_EEXIST) {
+            op = EPOLL_CTL_MOD;
+
+        } else if (op == EPOLL_CTL_DEL && err == NGX_ENOENT) {
+            ec->events = 0;
+            return NGX_OK;
+
+        } else {
+            goto failed;
+        }
+
+        if (epoll_ctl(ep, op, c->fd, &ee) == -1) {
+            err = ngx_errno;
+            goto failed;
+        }
+
+#if (NGX_STAT_STUB)
+        nctl++;
+#endif
+    }
+
+    ec->events = events;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ALERT, c->log, err,
+                  "epoll_ctl(%d, %d) failed", op, c->fd);
+
+    ec->events = 0;
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_epoll_process_changes(ngx_cycle_t *cycle, ngx_uint_t nowait)
+{
+    ngx_uint_t         i, n;
+    ngx_connection_t  *c;
+
+    n = nchanges;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "epoll changes: %ui", n);
+
+    for (i = 0; i < n; i++) {
+        c = change_list[i];
+
+        if (c == NULL) {
+            continue;
+        }
+
+        (void) ngx_epoll_commit_change(c, ngx_epoll_get_conn(c));
+    }
+
+    nchanges = 0;
+
+#if (NGX_STAT_STUB)
+
+    if (nctl_requested) {
+        (void) ngx_atomic_fetch_add(ngx_stat_event_ctl, nctl);
+        (void) ngx_atomic_fetch_add(ngx_stat_event_ctl_saved,
+                                    nctl_requested - nctl);
+        nctl = 0;
+        nctl_requested = 0;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_epoll_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
 {
@@ -574,6 +1092,10 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "epoll timer: %M", timer);
 
+    if (nchanges) {
+        (void) ngx_epoll_process_changes(cycle, 0);
+    }
+
     /* 得到发生的事件表event_list */
     events = epoll_wait(ep, event_list, (int) nevents, timer);
 
@@ -710,6 +1232,11 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
                 wev->ready = 1;
             }
 
+#if (NGX_THREAD_POOL)
+            /* a write event arrived while a sendfile() task was running */
+            wev->complete = 1;
+#endif
+
             if (flags & NGX_POST_EVENTS) {
                 ngx_locked_post_event(wev, &ngx_posted_events);
 
@@ -0,0 +1,1227 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/*
+ * The io_uring is used as a readiness notification mechanism: a connection
+ * has at most one poll request in the ring, a multishot one for the clear
+ * events and a single shot one rearmed after each completion for the level
+ * events.  The poll requests are added, updated, and removed in batches:
+ * the changes are queued in the submission ring and are passed to the kernel
+ * by the same io_uring_enter() that waits for the completions.
+ *
+ * The file AIO reads are posted to the same ring.
+ */
+
+
+#define NGX_URING_AIO  2
+
+
+typedef struct {
+    ngx_uint_t  entries;
+} ngx_uring_conf_t;
+
+
+typedef struct {
+    uint32_t    events;     /* the events of the poll request in the ring */
+    uint32_t    flags;      /* the flags of the first change */
+    ngx_uint_t  change;     /* the position in the change list plus one */
+    unsigned    armed:1;
+} ngx_uring_conn_t;
+
+
+static ngx_int_t ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_uring_setup(ngx_cycle_t *cycle, ngx_uring_conf_t *urcf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify_init(ngx_log_t *log);
+static void ngx_uring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_uring_done(ngx_cycle_t *cycle);
+static ngx_int_t ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_uring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_uring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+static ngx_uring_conn_t *ngx_uring_get_conn(ngx_connection_t *c);
+static ngx_int_t ngx_uring_post_change(ngx_connection_t *c,
+    ngx_uring_conn_t *ec);
+static void ngx_uring_drop_change(ngx_uring_conn_t *ec);
+static ngx_int_t ngx_uring_commit_change(ngx_connection_t *c,
+    ngx_uring_conn_t *ec);
+static ngx_int_t ngx_uring_process_changes(ngx_cycle_t *cycle,
+    ngx_uint_t nowait);
+static struct io_uring_sqe *ngx_uring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_uring_poll_add(ngx_connection_t *c, uint32_t events,
+    ngx_uint_t multishot);
+static ngx_int_t ngx_uring_poll_update(ngx_connection_t *c, uint32_t events,
+    ngx_uint_t multishot);
+static ngx_int_t ngx_uring_poll_remove(ngx_connection_t *c);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_uring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags);
+static void ngx_uring_process_poll(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+
+static void *ngx_uring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static int                    ring = -1;
+
+static u_char                *sq_ring;
+static size_t                 sq_ring_size;
+static u_char                *cq_ring;
+static size_t                 cq_ring_size;
+static struct io_uring_sqe   *sqes;
+static size_t                 sqes_size;
+
+static uint32_t              *sq_head;
+static uint32_t              *sq_tail;
+static uint32_t              *sq_array;
+static uint32_t               sq_mask;
+static uint32_t               sq_entries;
+static uint32_t               sq_local_tail;
+
+static uint32_t              *cq_head;
+static uint32_t              *cq_tail;
+static uint32_t               cq_mask;
+static struct io_uring_cqe   *cqes;
+
+static ngx_uring_conn_t      *conn_list;
+static ngx_connection_t     **change_list;
+static ngx_uint_t             nchanges;
+static ngx_uint_t             max_changes;
+
+#if (NGX_HAVE_EVENTFD)
+static int                    notify_fd = -1;
+static ngx_event_t            notify_event;
+static ngx_connection_t       notify_conn;
+#endif
+
+static ngx_str_t      uring_name = ngx_string("uring");
+
+static ngx_command_t  ngx_uring_commands[] = {
+
+    { ngx_string("uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_uring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+ngx_event_module_t  ngx_uring_module_ctx = {
+    &uring_name,
+    ngx_uring_create_conf,               /* create configuration */
+    ngx_uring_init_conf,                 /* init configuration */
+
+    {
+        ngx_uring_add_event,             /* add an event */
+        ngx_uring_del_event,             /* delete an event */
+        ngx_uring_add_event,             /* enable an event */
+        ngx_uring_del_event,             /* disable an event */
+        ngx_uring_add_connection,        /* add an connection */
+        ngx_uring_del_connection,        /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_uring_notify,                /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_uring_process_changes,       /* process the changes */
+        ngx_uring_process_events,        /* process the events */
+        ngx_uring_init,                  /* init the events */
+        ngx_uring_done,                  /* done the events */
+    }
+};
+
+ngx_module_t  ngx_uring_module = {
+    NGX_MODULE_V1,
+    &ngx_uring_module_ctx,               /* module context */
+    ngx_uring_commands,                  /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls,
+ * the liburing is not required.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_uring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_event_get_conf(cycle->conf_ctx, ngx_uring_module);
+
+    if (ring == -1) {
+        if (ngx_uring_setup(cycle, urcf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_uring_notify_init(cycle->log) != NGX_OK) {
+            ngx_uring_module_ctx.actions.notify = NULL;
+        }
+#endif
+    }
+
+    if (max_changes < cycle->connection_n) {
+        if (conn_list) {
+            ngx_free(conn_list);
+        }
+
+        if (change_list) {
+            ngx_free(change_list);
+        }
+
+        conn_list = ngx_alloc(sizeof(ngx_uring_conn_t) * cycle->connection_n,
+                              cycle->log);
+        if (conn_list == NULL) {
+            return NGX_ERROR;
+        }
+
+        change_list = ngx_alloc(sizeof(ngx_connection_t *)
+                                * cycle->connection_n, cycle->log);
+        if (change_list == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memzero(conn_list, sizeof(ngx_uring_conn_t) * cycle->connection_n);
+
+    nchanges = 0;
+    max_changes = cycle->connection_n;
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_uring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_URING_EVENT;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_setup(ngx_cycle_t *cycle, ngx_uring_conf_t *urcf)
+{
+    struct io_uring_params  p;
+
+    ngx_memzero(&p, sizeof(struct io_uring_params));
+
+    /*
+     * every connection may have a multishot poll request,
+     * so the completion ring is sized to the connections
+     */
+
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP;
+    p.cq_entries = ngx_max(2 * urcf->entries, cycle->connection_n);
+
+    ring = io_uring_setup(urcf->entries, &p);
+
+    if (ring == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)
+        || !(p.features & IORING_FEAT_NODROP)
+        || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring features %08XD are not supported, "
+                      "at least Linux 5.13 is required", p.features);
+        goto failed;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (cq_ring_size > sq_ring_size) {
+        sq_ring_size = cq_ring_size;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+
+    if (sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        sq_ring = NULL;
+        goto failed;
+    }
+
+    cq_ring = sq_ring;
+    cq_ring_size = sq_ring_size;
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        sqes = NULL;
+        goto failed;
+    }
+
+    sq_head = (uint32_t *) (sq_ring + p.sq_off.head);
+    sq_tail = (uint32_t *) (sq_ring + p.sq_off.tail);
+    sq_array = (uint32_t *) (sq_ring + p.sq_off.array);
+    sq_mask = *(uint32_t *) (sq_ring + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_local_tail = *sq_tail;
+
+    cq_head = (uint32_t *) (cq_ring + p.cq_off.head);
+    cq_tail = (uint32_t *) (cq_ring + p.cq_off.tail);
+    cq_mask = *(uint32_t *) (cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq_ring + p.cq_off.cqes);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring, p.sq_entries, p.cq_entries);
+
+    return NGX_OK;
+
+failed:
+
+    if (sq_ring) {
+        (void) munmap(sq_ring, sq_ring_size);
+        sq_ring = NULL;
+    }
+
+    if (close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify_init(ngx_log_t *log)
+{
+    notify_fd = syscall(SYS_eventfd, 0);
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_uring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_uring_poll_add(&notify_conn, POLLIN, 1) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    /*
+     * the eventfd is polled by a multishot request, so the counter
+     * is read only once in a while to prevent its overflow
+     */
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_uring_done(ngx_cycle_t *cycle)
+{
+    /* the pending requests are cancelled when the ring is closed */
+
+    if (close(ring) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring = -1;
+
+    if (sqes) {
+        (void) munmap(sqes, sqes_size);
+        sqes = NULL;
+    }
+
+    if (sq_ring) {
+        (void) munmap(sq_ring, sq_ring_size);
+        sq_ring = NULL;
+        cq_ring = NULL;
+    }
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
+    ngx_free(conn_list);
+    ngx_free(change_list);
+
+    conn_list = NULL;
+    change_list = NULL;
+    nchanges = 0;
+    max_changes = 0;
+}
+
+
+static ngx_int_t
+ngx_uring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+    ngx_uring_conn_t  *ec;
+
+    c = ev->data;
+
+    ec = ngx_uring_get_conn(c);
+
+    if (ec == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "io_uring add event: unknown connection fd:%d", c->fd);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring add event: fd:%d ev:%i fl:%08XD",
+                   c->fd, event, (uint32_t) flags);
+
+    ev->active = 1;
+
+    if (!ec->armed && ec->change == 0) {
+        ec->flags = (uint32_t) flags;
+    }
+
+    return ngx_uring_post_change(c, ec);
+}
+
+
+static ngx_int_t
+ngx_uring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    ngx_connection_t  *c;
+    ngx_uring_conn_t  *ec;
+
+    c = ev->data;
+
+    ec = ngx_uring_get_conn(c);
+
+    if (ec == NULL) {
+        ev->active = 0;
+        return NGX_OK;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                   "io_uring del event: fd:%d ev:%i fl:%08XD",
+                   c->fd, event, (uint32_t) flags);
+
+    /*
+     * unlike the epoll, a pending poll request holds a reference
+     * to the file, so the request is removed before the file is closed
+     */
+
+    if (flags & NGX_CLOSE_EVENT) {
+        ev->active = 0;
+
+        if (c->read->active || c->write->active) {
+            return ngx_uring_post_change(c, ec);
+        }
+
+        ngx_uring_drop_change(ec);
+
+        if (ec->armed) {
+            ec->armed = 0;
+            ec->events = 0;
+
+            return ngx_uring_poll_remove(c);
+        }
+
+        return NGX_OK;
+    }
+
+    ev->active = 0;
+
+    return ngx_uring_post_change(c, ec);
+}
+
+
+static ngx_int_t
+ngx_uring_add_connection(ngx_connection_t *c)
+{
+    ngx_uring_conn_t  *ec;
+
+    ec = ngx_uring_get_conn(c);
+
+    if (ec == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                      "io_uring add connection: unknown connection fd:%d",
+                      c->fd);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring add connection: fd:%d", c->fd);
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    if (!ec->armed && ec->change == 0) {
+        ec->flags = NGX_CLEAR_EVENT;
+    }
+
+    return ngx_uring_post_change(c, ec);
+}
+
+
+static ngx_int_t
+ngx_uring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    ngx_uring_conn_t  *ec;
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    ec = ngx_uring_get_conn(c);
+
+    if (ec == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring del connection: fd:%d", c->fd);
+
+    ngx_uring_drop_change(ec);
+
+    if (!ec->armed) {
+        return NGX_OK;
+    }
+
+    ec->armed = 0;
+    ec->events = 0;
+
+    return ngx_uring_poll_remove(c);
+}
+
+
+static ngx_uring_conn_t *
+ngx_uring_get_conn(ngx_connection_t *c)
+{
+    ngx_uint_t  n;
+
+    if (ngx_cycle->connections == NULL || c < ngx_cycle->connections) {
+        return NULL;
+    }
+
+    n = c - ngx_cycle->connections;
+
+    if (n >= max_changes) {
+        return NULL;
+    }
+
+    return &conn_list[n];
+}
+
+
+static ngx_int_t
+ngx_uring_post_change(ngx_connection_t *c, ngx_uring_conn_t *ec)
+{
+    if (ec->change) {
+        return NGX_OK;
+    }
+
+    if (nchanges == max_changes) {
+        (void) ngx_uring_process_changes((ngx_cycle_t *) ngx_cycle, 0);
+    }
+
+    change_list[nchanges++] = c;
+    ec->change = nchanges;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_drop_change(ngx_uring_conn_t *ec)
+{
+    if (ec->change) {
+        change_list[ec->change - 1] = NULL;
+        ec->change = 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_uring_commit_change(ngx_connection_t *c, ngx_uring_conn_t *ec)
+{
+    uint32_t    events;
+    ngx_uint_t  multishot;
+
+    ngx_uring_drop_change(ec);
+
+    events = 0;
+
+    if (c->read->active) {
+        events |= POLLIN;
+    }
+
+    if (c->write->active) {
+        events |= POLLOUT;
+    }
+
+    multishot = (ec->flags & NGX_CLEAR_EVENT) ? 1 : 0;
+
+    if (!ec->armed) {
+        if (events == 0) {
+            return NGX_OK;
+        }
+
+        if (ngx_uring_poll_add(c, events, multishot) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ec->armed = 1;
+        ec->events = events;
+
+        return NGX_OK;
+    }
+
+    if (events == ec->events) {
+        return NGX_OK;
+    }
+
+    /*
+     * the request is updated in place rather than removed, so there is
+     * always at most one poll request of the connection in the ring;
+     * the request without events still reports the errors only
+     */
+
+    if (ngx_uring_poll_update(c, events, multishot) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ec->events = events;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_process_changes(ngx_cycle_t *cycle, ngx_uint_t nowait)
+{
+    int                n;
+    ngx_uint_t         i, changes;
+    ngx_connection_t  *c;
+
+    changes = nchanges;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring changes: %ui", changes);
+
+    for (i = 0; i < changes; i++) {
+        c = change_list[i];
+
+        if (c == NULL) {
+            continue;
+        }
+
+        (void) ngx_uring_commit_change(c, ngx_uring_get_conn(c));
+    }
+
+    nchanges = 0;
+
+    if (!nowait) {
+        return NGX_OK;
+    }
+
+    /* the changes must be passed to the kernel right now */
+
+    n = sq_local_tail - *sq_head;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    if (io_uring_enter(ring, n, 0, 0, NULL, 0) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static struct io_uring_sqe *
+ngx_uring_get_sqe(ngx_log_t *log)
+{
+    uint32_t              n;
+    struct io_uring_sqe  *sqe;
+
+    n = sq_local_tail - *sq_head;
+
+    if (n == sq_entries) {
+
+        /* the submission ring is full, the queued requests are flushed */
+
+        if (io_uring_enter(ring, n, 0, 0, NULL, 0) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "io_uring_enter() failed");
+            return NULL;
+        }
+
+        if (sq_local_tail - *sq_head == sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission ring is full");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[sq_local_tail & sq_mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    sq_array[sq_local_tail & sq_mask] = sq_local_tail & sq_mask;
+    sq_local_tail++;
+
+    /* the kernel must see the request before the new tail */
+
+    ngx_memory_barrier();
+
+    *sq_tail = sq_local_tail;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_add(ngx_connection_t *c, uint32_t events, ngx_uint_t multishot)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll add: fd:%d ev:%04XD multishot:%ui",
+                   c->fd, events, multishot);
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+#if !(NGX_HAVE_LITTLE_ENDIAN)
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = (uintptr_t) c | c->read->instance;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_update(ngx_connection_t *c, uint32_t events,
+    ngx_uint_t multishot)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll update: fd:%d ev:%04XD", c->fd, events);
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+#if !(NGX_HAVE_LITTLE_ENDIAN)
+    events = (events << 16) | (events >> 16);
+#endif
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) c | c->read->instance;
+    sqe->poll32_events = events;
+    sqe->len = IORING_POLL_UPDATE_EVENTS
+               | (multishot ? IORING_POLL_ADD_MULTI : 0);
+
+    /* the result of the update is not interesting */
+
+    sqe->user_data = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_uring_poll_remove(ngx_connection_t *c)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "io_uring poll remove: fd:%d", c->fd);
+
+    sqe = ngx_uring_get_sqe(c->log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) c | c->read->instance;
+    sqe->user_data = 0;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+ngx_int_t
+ngx_uring_aio_read(ngx_event_t *ev, ngx_fd_t fd, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_uring_get_sqe(ev->log);
+    if (sqe == NULL) {
+        return NGX_AGAIN;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (uint32_t) size;
+    sqe->off = (uint64_t) offset;
+    sqe->user_data = (uintptr_t) ev | NGX_URING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_uring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_uring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                             n;
+    uint32_t                        head, tail;
+    ngx_uint_t                      wait, level;
+    ngx_err_t                       err;
+    struct io_uring_cqe            *cqe;
+    struct __kernel_timespec        ts;
+    struct io_uring_getevents_arg   arg;
+#if (NGX_HAVE_FILE_AIO)
+    ngx_event_t                    *e;
+    ngx_event_aio_t                *aio;
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M", timer);
+
+    if (nchanges) {
+        (void) ngx_uring_process_changes(cycle, 0);
+    }
+
+    ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+
+    arg.sigmask_sz = _NSIG / 8;
+
+    if (timer != NGX_TIMER_INFINITE) {
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+        arg.ts = (uintptr_t) &ts;
+    }
+
+    /* the completions left by a submission ring flush are not waited for */
+
+    wait = (*cq_tail == *cq_head && timer != 0) ? 1 : 0;
+
+    n = io_uring_enter(ring, sq_local_tail - *sq_head, wait,
+                       IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(struct io_uring_getevents_arg));
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err && err != NGX_ETIME) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    head = *cq_head;
+    tail = *cq_tail;
+
+    /* the completions must be read after the tail */
+
+    ngx_memory_barrier();
+
+    if (head == tail) {
+        if (timer != NGX_TIMER_INFINITE) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, 0,
+                      "io_uring_enter() returned no events without timeout");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring completions: %uD", tail - head);
+
+    ngx_mutex_lock(ngx_posted_events_mutex);
+
+    for ( /* void */ ; head != tail; head++) {
+        cqe = &cqes[head & cq_mask];
+
+        if (cqe->user_data == 0) {
+            continue;
+        }
+
+#if (NGX_HAVE_FILE_AIO)
+
+        if (cqe->user_data & NGX_URING_AIO) {
+            e = (ngx_event_t *) (uintptr_t)
+                                   (cqe->user_data & ~(uint64_t) NGX_URING_AIO);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring aio: %p res:%d", e, cqe->res);
+
+            e->complete = 1;
+            e->active = 0;
+            e->ready = 1;
+
+            aio = e->data;
+            aio->res = cqe->res;
+
+            ngx_post_event(e, &ngx_posted_events);
+
+            continue;
+        }
+
+#endif
+
+        ngx_uring_process_poll(cycle, cqe, flags);
+    }
+
+    ngx_memory_barrier();
+
+    *cq_head = tail;
+
+    ngx_mutex_unlock(ngx_posted_events_mutex);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_uring_process_poll(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    uint32_t           revents;
+    ngx_int_t          instance;
+    ngx_event_t       *rev, *wev, **queue;
+    ngx_connection_t  *c;
+    ngx_uring_conn_t  *ec;
+
+    /* the removed or updated requests are finished without events */
+
+    if (cqe->res == -NGX_ECANCELED) {
+        return;
+    }
+
+    c = (ngx_connection_t *) (uintptr_t) cqe->user_data;
+
+    instance = (uintptr_t) c & 1;
+    c = (ngx_connection_t *) ((uintptr_t) c & (uintptr_t) ~1);
+
+    rev = c->read;
+
+    if (c->fd == -1 || rev->instance != instance) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed in this iteration
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p", c);
+        return;
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+
+        /*
+         * the single shot request is complete or the multishot one
+         * was terminated by the kernel, the active events are rearmed
+         */
+
+#if (NGX_HAVE_EVENTFD)
+        if (c == &notify_conn) {
+            (void) ngx_uring_poll_add(c, POLLIN, 1);
+
+        } else
+#endif
+        {
+            ec = ngx_uring_get_conn(c);
+
+            if (ec) {
+                ec->armed = 0;
+                ec->events = 0;
+
+                if (rev->active || c->write->active) {
+                    (void) ngx_uring_post_change(c, ec);
+                }
+            }
+        }
+    }
+
+    if (cqe->res < 0) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                      "io_uring poll on fd:%d failed", c->fd);
+
+        revents = POLLERR;
+
+    } else {
+        revents = (uint32_t) cqe->res;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d ev:%04XD fl:%uD",
+                   c->fd, revents, cqe->flags);
+
+    if ((revents & (POLLERR|POLLHUP))
+         && (revents & (POLLIN|POLLOUT)) == 0)
+    {
+        /*
+         * if the error events were returned without POLLIN or POLLOUT,
+         * then add these flags to handle the events at least in one
+         * active handler
+         */
+
+        revents |= POLLIN|POLLOUT;
+    }
+
+    if ((revents & POLLIN) && rev->active) {
+
+        if ((flags & NGX_POST_THREAD_EVENTS) && !rev->accept) {
+            rev->posted_ready = 1;
+
+        } else {
+            rev->ready = 1;
+        }
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = (ngx_event_t **) (rev->accept ?
+                           &ngx_posted_accept_events : &ngx_posted_events);
+
+            ngx_locked_post_event(rev, queue);
+
+        } else {
+            rev->handler(rev);
+        }
+    }
+
+    wev = c->write;
+
+    /* the notify connection has no write event */
+
+    if ((revents & POLLOUT) && wev && wev->active) {
+
+        if (c->fd == -1 || wev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            return;
+        }
+
+        if (flags & NGX_POST_THREAD_EVENTS) {
+            wev->posted_ready = 1;
+
+        } else {
+            wev->ready = 1;
+        }
+
+#if (NGX_THREAD_POOL)
+        /* a write event arrived while a sendfile() task was running */
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_locked_post_event(wev, &ngx_posted_events);
+
+        } else {
+            wev->handler(wev);
+        }
+    }
+}
+
+
+static void *
+ngx_uring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_uring_conf_t  *urcf;
+
+    urcf = ngx_palloc(cycle->pool, sizeof(ngx_uring_conf_t));
+    if (urcf == NULL) {
+        return NULL;
+    }
+
+    urcf->entries = NGX_CONF_UNSET;
+
+    return urcf;
+}
+
+
+static char *
+ngx_uring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_uring_conf_t *urcf = conf;
+
+    ngx_conf_init_uint_value(urcf->entries, 512);
+
+    return NGX_CONF_OK;
+}
@@ -24,6 +24,9 @@ extern ngx_module_t ngx_select_module;
 static char *ngx_event_init_conf(ngx_cycle_t *cycle, void *conf);
 static ngx_int_t ngx_event_module_init(ngx_cycle_t *cycle);
 static ngx_int_t ngx_event_process_init(ngx_cycle_t *cycle);
+static void ngx_event_process_exit(ngx_cycle_t *cycle);
+static void ngx_event_pool_cache_handler(ngx_event_t *ev);
+static void ngx_event_pool_cache_flush(ngx_uint_t all, ngx_log_t *log);
 static char *ngx_events_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 static char *ngx_event_connections(ngx_conf_t *cf, ngx_command_t *cmd,
@@ -41,6 +44,8 @@ sig_atomic_t          ngx_event_timer_alarm;
 
 static ngx_uint_t     ngx_event_max_module;
 
+static ngx_event_t    ngx_pool_cache_event;
+
 ngx_uint_t            ngx_event_flags;
 ngx_event_actions_t   ngx_event_actions;
 
@@ -75,6 +80,16 @@ ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t  *ngx_stat_writing = &ngx_stat_writing0;
 ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t  *ngx_stat_waiting = &ngx_stat_waiting0;
+ngx_atomic_t   ngx_stat_event_ctl0;
+ngx_atomic_t  *ngx_stat_event_ctl = &ngx_stat_event_ctl0;
+ngx_atomic_t   ngx_stat_event_ctl_saved0;
+ngx_atomic_t  *ngx_stat_event_ctl_saved = &ngx_stat_event_ctl_saved0;
+ngx_atomic_t   ngx_stat_pool_hits0;
+ngx_atomic_t  *ngx_stat_pool_hits = &ngx_stat_pool_hits0;
+ngx_atomic_t   ngx_stat_pool_misses0;
+ngx_atomic_t  *ngx_stat_pool_misses = &ngx_stat_pool_misses0;
+ngx_atomic_t   ngx_stat_pool_retained0;
+ngx_atomic_t  *ngx_stat_pool_retained = &ngx_stat_pool_retained0;
 
 #endif
 
@@ -163,6 +178,13 @@ static ngx_command_t  ngx_event_core_commands[] = {
       offsetof(ngx_event_conf_t, accept_mutex_delay),
       NULL },
 
+    { ngx_string("timer_wheel"),
+      NGX_EVENT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_event_conf_t, timer_wheel),
+      NULL },
+
     { ngx_string("debug_connection"),
       NGX_EVENT_CONF|NGX_CONF_TAKE1,
       ngx_event_debug_connection,
@@ -179,7 +201,7 @@ ngx_event_module_t  ngx_event_core_module_ctx = {
     ngx_event_core_create_conf,            /* create configuration */
     ngx_event_core_init_conf,              /* init configuration */
 
-    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+    { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
 
@@ -193,7 +215,7 @@ ngx_module_t  ngx_event_core_module = {
     ngx_event_process_init,                /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_event_process_exit,                /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -552,7 +574,12 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_event_ctl */
+           + cl          /* ngx_stat_event_ctl_saved */
+           + cl          /* ngx_stat_pool_hits */
+           + cl          /* ngx_stat_pool_misses */
+           + cl;         /* ngx_stat_pool_retained */
 
 #endif
 
@@ -608,6 +635,11 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_event_ctl = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_event_ctl_saved = (ngx_atomic_t *) (shared + 11 * cl);
+    ngx_stat_pool_hits = (ngx_atomic_t *) (shared + 12 * cl);
+    ngx_stat_pool_misses = (ngx_atomic_t *) (shared + 13 * cl);
+    ngx_stat_pool_retained = (ngx_atomic_t *) (shared + 14 * cl);
 
 #endif
 
@@ -655,6 +687,27 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         ngx_use_accept_mutex = 0;
     }
 
+#if (NGX_HAVE_REUSEPORT)
+
+    /*
+     * 如果所有监听socket都开启了reuseport，由内核在各个worker间分配连接，
+     * 就不需要accept互斥体了
+     */
+
+    if (ngx_use_accept_mutex) {
+        ngx_use_accept_mutex = 0;
+
+        ls = cycle->listening.elts;
+        for (i = 0; i < cycle->listening.nelts; i++) {
+            if (!ls[i].reuseport) {
+                ngx_use_accept_mutex = 1;
+                break;
+            }
+        }
+    }
+
+#endif
+
 #if (NGX_WIN32)
 
     /*
@@ -672,6 +725,8 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         return NGX_ERROR;
     }
 #endif
+    ngx_event_timer_wheel = ecf->timer_wheel;
+
     /*初始化计时器，此处将会创建起一颗红黑色，来维护计时器。*/
     if (ngx_event_timer_init(cycle->log) == NGX_ERROR) {
         return NGX_ERROR;
@@ -696,6 +751,15 @@ ngx_event_process_init(ngx_cycle_t *cycle)
         break;
     }
 
+    if (ccf->pool_cache && ngx_process != NGX_PROCESS_HELPER) {
+        ngx_pool_cache_init(ccf->pool_cache, ccf->pool_cache_idle);
+
+        ngx_pool_cache_event.handler = ngx_event_pool_cache_handler;
+        ngx_pool_cache_event.log = cycle->log;
+
+        ngx_add_timer(&ngx_pool_cache_event, 1000);
+    }
+
 #if !(NGX_WIN32)
 
     if (ngx_timer_resolution && !(ngx_event_flags & NGX_USE_TIMER_EVENT)) {
@@ -808,6 +872,12 @@ ngx_event_process_init(ngx_cycle_t *cycle)
     ls = cycle->listening.elts;
     for (i = 0; i < cycle->listening.nelts; i++) {
 
+#if (NGX_HAVE_REUSEPORT)
+        if (ls[i].reuseport && ccf->master && ls[i].worker != ngx_worker) {
+            continue;
+        }
+#endif
+
         c = ngx_get_connection(ls[i].fd, cycle->log);
 
         if (c == NULL) {
@@ -888,6 +958,16 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 
         rev->handler = ngx_event_accept;    /*注册监听套接口读事件的回调函数ngx_event_accept*/
 
+#if (NGX_HAVE_REUSEPORT)
+        if (ls[i].reuseport) {
+            if (ngx_add_event(rev, NGX_READ_EVENT, 0) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            continue;
+        }
+#endif
+
         /*使用了accept_mutex,暂时不将监听套接字放入epoll中，而是等到worker抢到accept互斥体后，
         再放入epoll，避免惊群的发生。 */
         if (ngx_use_accept_mutex) {
@@ -900,7 +980,15 @@ ngx_event_process_init(ngx_cycle_t *cycle)
             }
 
         } else {
-            if (ngx_add_event(rev, NGX_READ_EVENT, 0) == NGX_ERROR) {
+
+            /*
+             * without accept mutex only one of the workers waiting
+             * on a listening socket is woken up if the kernel supports it
+             */
+
+            if (ngx_add_event(rev, NGX_READ_EVENT, NGX_EXCLUSIVE_EVENT)
+                == NGX_ERROR)
+            {
                 return NGX_ERROR;
             }
         }
@@ -913,6 +1001,56 @@ ngx_event_process_init(ngx_cycle_t *cycle)
 }
 
 
+static void
+ngx_event_process_exit(ngx_cycle_t *cycle)
+{
+    if (ngx_pool_cache_event.timer_set) {
+        ngx_del_timer(&ngx_pool_cache_event);
+    }
+
+    if (ngx_pool_cache_event.handler) {
+        ngx_event_pool_cache_flush(1, cycle->log);
+    }
+}
+
+
+static void
+ngx_event_pool_cache_handler(ngx_event_t *ev)
+{
+    ngx_event_pool_cache_flush(ngx_exiting, ev->log);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, 1000);
+}
+
+
+static void
+ngx_event_pool_cache_flush(ngx_uint_t all, ngx_log_t *log)
+{
+#if (NGX_STAT_STUB)
+    static ngx_pool_cache_stat_t  sent;
+#endif
+
+    ngx_pool_cache_trim(all, log);
+
+#if (NGX_STAT_STUB)
+
+    (void) ngx_atomic_fetch_add(ngx_stat_pool_hits,
+                                ngx_pool_cache_stat.hits - sent.hits);
+    (void) ngx_atomic_fetch_add(ngx_stat_pool_misses,
+                                ngx_pool_cache_stat.misses - sent.misses);
+    (void) ngx_atomic_fetch_add(ngx_stat_pool_retained,
+                                ngx_pool_cache_stat.size - sent.size);
+
+    sent = ngx_pool_cache_stat;
+
+#endif
+}
+
+
 ngx_int_t
 ngx_send_lowat(ngx_connection_t *c, size_t lowat)
 {
@@ -1249,6 +1387,7 @@ ngx_event_core_create_conf(ngx_cycle_t *cycle)
     ecf->multi_accept = NGX_CONF_UNSET;
     ecf->accept_mutex = NGX_CONF_UNSET;
     ecf->accept_mutex_delay = NGX_CONF_UNSET_MSEC;
+    ecf->timer_wheel = NGX_CONF_UNSET;
     ecf->name = (void *) NGX_CONF_UNSET;
 
 #if (NGX_DEBUG)
@@ -1364,6 +1503,7 @@ ngx_event_core_init_conf(ngx_cycle_t *cycle, void *conf)
     ngx_conf_init_value(ecf->multi_accept, 0);
     ngx_conf_init_value(ecf->accept_mutex, 1);
     ngx_conf_init_msec_value(ecf->accept_mutex_delay, 500);
+    ngx_conf_init_value(ecf->timer_wheel, 0);
 
 
 #if (NGX_HAVE_RTSIG)
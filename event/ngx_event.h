@@ -68,6 +68,9 @@ struct ngx_event_s {
     unsigned         timedout:1;
     unsigned         timer_set:1;
 
+    /* the timer does not delay a graceful shutdown of a worker */
+    unsigned         cancelable:1;
+
     unsigned         delayed:1;
 
     unsigned         read_discarded:1;
@@ -232,6 +235,8 @@ typedef struct {
     ngx_int_t  (*add_conn)(ngx_connection_t *c);
     ngx_int_t  (*del_conn)(ngx_connection_t *c, ngx_uint_t flags);
 
+    ngx_int_t  (*notify)(ngx_event_handler_pt handler);
+
     ngx_int_t  (*process_changes)(ngx_cycle_t *cycle, ngx_uint_t nowait);
     ngx_int_t  (*process_events)(ngx_cycle_t *cycle, ngx_msec_t timer,
                    ngx_uint_t flags);
@@ -324,6 +329,12 @@ extern ngx_event_actions_t   ngx_event_actions;
  */
 #define NGX_USE_VNODE_EVENT      0x00002000
 
+/*
+ * The event filter is io_uring, the file aio operations are posted
+ * to the same ring.
+ */
+#define NGX_USE_URING_EVENT      0x00004000
+
 
 /*
  * The event filter is deleted just before the closing file.
@@ -403,6 +414,9 @@ extern ngx_event_actions_t   ngx_event_actions;
 #define NGX_LEVEL_EVENT    0
 #define NGX_CLEAR_EVENT    EPOLLET
 #define NGX_ONESHOT_EVENT  0x70000000
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+#define NGX_EXCLUSIVE_EVENT  EPOLLEXCLUSIVE
+#endif
 #if 0
 #define NGX_ONESHOT_EVENT  EPOLLONESHOT
 #endif
@@ -439,6 +453,10 @@ extern ngx_event_actions_t   ngx_event_actions;
 #define NGX_CLEAR_EVENT    0    /* dummy declaration */
 #endif
 
+#ifndef NGX_EXCLUSIVE_EVENT
+#define NGX_EXCLUSIVE_EVENT  0  /* dummy declaration */
+#endif
+
 
 #define ngx_process_changes  ngx_event_actions.process_changes
 #define ngx_process_events   ngx_event_actions.process_events
@@ -448,6 +466,7 @@ extern ngx_event_actions_t   ngx_event_actions;
 #define ngx_del_event        ngx_event_actions.del
 #define ngx_add_conn         ngx_event_actions.add_conn
 #define ngx_del_conn         ngx_event_actions.del_conn
+#define ngx_notify           ngx_event_actions.notify
 
 #define ngx_add_timer        ngx_event_add_timer
 #define ngx_del_timer        ngx_event_del_timer
@@ -475,6 +494,8 @@ typedef struct {
 
     ngx_msec_t    accept_mutex_delay;
 
+    ngx_flag_t    timer_wheel;      /* 使用时间轮代替红黑树管理定时器 */
+
     u_char       *name;
 
 #if (NGX_DEBUG)
@@ -513,6 +534,11 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_event_ctl;
+extern ngx_atomic_t  *ngx_stat_event_ctl_saved;
+extern ngx_atomic_t  *ngx_stat_pool_hits;
+extern ngx_atomic_t  *ngx_stat_pool_misses;
+extern ngx_atomic_t  *ngx_stat_pool_retained;
 
 #endif
 
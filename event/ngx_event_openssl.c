@@ -1770,6 +1770,94 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 }
 
 
+ngx_int_t
+ngx_ssl_session_cache_copy(ngx_shm_zone_t *shm_zone, ngx_shm_zone_t *ozone)
+{
+    u_char                   *id, *cached_sess;
+    time_t                    now;
+    ngx_int_t                 rc;
+    ngx_queue_t              *q;
+    ngx_slab_pool_t          *shpool, *oshpool;
+    ngx_ssl_sess_id_t        *sess_id, *osess_id;
+    ngx_ssl_session_cache_t  *cache, *ocache;
+
+    cache = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ocache = ozone->data;
+    oshpool = (ngx_slab_pool_t *) ozone->shm.addr;
+
+    now = ngx_time();
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&oshpool->mutex);
+
+    /* the most recent sessions are copied first */
+
+    for (q = ngx_queue_head(&ocache->expire_queue);
+         q != ngx_queue_sentinel(&ocache->expire_queue);
+         q = ngx_queue_next(q))
+    {
+        osess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
+
+        if (osess_id->expire <= now) {
+            continue;
+        }
+
+        cached_sess = ngx_slab_alloc_locked(shpool, osess_id->len);
+
+        if (cached_sess == NULL) {
+            rc = NGX_DECLINED;
+            break;
+        }
+
+        sess_id = ngx_slab_alloc_locked(shpool, sizeof(ngx_ssl_sess_id_t));
+
+        if (sess_id == NULL) {
+            ngx_slab_free_locked(shpool, cached_sess);
+            rc = NGX_DECLINED;
+            break;
+        }
+
+#if (NGX_PTR_SIZE == 8)
+
+        id = sess_id->sess_id;
+
+#else
+
+        id = ngx_slab_alloc_locked(shpool, osess_id->node.data);
+
+        if (id == NULL) {
+            ngx_slab_free_locked(shpool, cached_sess);
+            ngx_slab_free_locked(shpool, sess_id);
+            rc = NGX_DECLINED;
+            break;
+        }
+
+#endif
+
+        ngx_memcpy(cached_sess, osess_id->session, osess_id->len);
+
+        ngx_memcpy(id, osess_id->id, osess_id->node.data);
+
+        sess_id->node.key = osess_id->node.key;
+        sess_id->node.data = osess_id->node.data;
+        sess_id->id = id;
+        sess_id->len = osess_id->len;
+        sess_id->session = cached_sess;
+        sess_id->expire = osess_id->expire;
+
+        ngx_queue_insert_tail(&cache->expire_queue, &sess_id->queue);
+
+        ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
+    }
+
+    ngx_shmtx_unlock(&oshpool->mutex);
+
+    return rc;
+}
+
+
 /*
  * The length of the session id is 16 bytes for SSLv2 sessions and
  * between 1 and 32 bytes for SSLv3/TLSv1, typically 32 bytes.
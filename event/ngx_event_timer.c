@@ -18,6 +18,77 @@ ngx_mutex_t  *ngx_event_timer_mutex;
 ngx_thread_volatile ngx_rbtree_t  ngx_event_timer_rbtree;
 static ngx_rbtree_node_t          ngx_event_timer_sentinel;
 
+ngx_uint_t                        ngx_event_timer_wheel;
+
+
+/*
+ * The hierarchical timer wheel: the root level has 256 slots of 1 ms each,
+ * the upper levels have 64 slots each covering the whole lower level.
+ * The timers of an upper level slot are cascaded down when the lower
+ * levels wrap around.  The timer node is linked to a slot list using
+ * its "left" and "right" fields, the "color" field keeps the level.
+ */
+
+#define NGX_TIMER_WHEEL_LEVELS     5
+#define NGX_TIMER_WHEEL_ROOT_BITS  8
+#define NGX_TIMER_WHEEL_BITS       6
+#define NGX_TIMER_WHEEL_ROOT_SIZE  (1 << NGX_TIMER_WHEEL_ROOT_BITS)
+#define NGX_TIMER_WHEEL_SIZE       (1 << NGX_TIMER_WHEEL_BITS)
+#define NGX_TIMER_WHEEL_ROOT_MASK  (NGX_TIMER_WHEEL_ROOT_SIZE - 1)
+#define NGX_TIMER_WHEEL_MASK       (NGX_TIMER_WHEEL_SIZE - 1)
+#define NGX_TIMER_WHEEL_MAX        (ngx_msec_t) 0xffffffff
+
+#define ngx_timer_wheel_shift(level)                                          \
+    (NGX_TIMER_WHEEL_ROOT_BITS + ((level) - 1) * NGX_TIMER_WHEEL_BITS)
+
+
+typedef struct {
+    ngx_msec_t         current;         /* the next tick to expire */
+    ngx_uint_t         count;
+    ngx_uint_t         level_count[NGX_TIMER_WHEEL_LEVELS];
+    ngx_rbtree_node_t  root[NGX_TIMER_WHEEL_ROOT_SIZE];
+    ngx_rbtree_node_t  slots[NGX_TIMER_WHEEL_LEVELS - 1][NGX_TIMER_WHEEL_SIZE];
+} ngx_event_timer_wheel_t;
+
+
+#define ngx_timer_wheel_list_init(h)                                          \
+    (h)->left = h;                                                            \
+    (h)->right = h
+
+#define ngx_timer_wheel_list_empty(h)                                         \
+    ((h)->right == h)
+
+#define ngx_timer_wheel_list_insert(h, x)                                     \
+    (x)->left = (h)->left;                                                    \
+    (x)->left->right = x;                                                     \
+    (x)->right = h;                                                           \
+    (h)->left = x
+
+#define ngx_timer_wheel_list_remove(x)                                        \
+    (x)->right->left = (x)->left;                                             \
+    (x)->left->right = (x)->right
+
+#define ngx_timer_wheel_list_move(h, n)                                       \
+    (n)->left = (h)->left;                                                    \
+    (n)->right = (h)->right;                                                  \
+    (n)->left->right = n;                                                     \
+    (n)->right->left = n;                                                     \
+    ngx_timer_wheel_list_init(h)
+
+
+static void ngx_event_timer_wheel_init(void);
+static void ngx_event_timer_wheel_link(ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_event_timer_wheel_cascade(ngx_uint_t level);
+static ngx_msec_t ngx_event_timer_wheel_find(void);
+static void ngx_event_timer_wheel_expire(void);
+static ngx_uint_t ngx_event_timer_rbtree_cancelable(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_uint_t ngx_event_timer_wheel_cancelable(void);
+static ngx_uint_t ngx_event_timer_list_cancelable(ngx_rbtree_node_t *h);
+
+
+static ngx_event_timer_wheel_t    ngx_timer_wheel;
+
 /*
  * the event timer rbtree may contain the duplicate keys, however,
  * it should not be a problem, because we use the rbtree to find
@@ -30,6 +101,10 @@ ngx_event_timer_init(ngx_log_t *log)
     ngx_rbtree_init(&ngx_event_timer_rbtree, &ngx_event_timer_sentinel,
                     ngx_rbtree_insert_timer_value);
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_init();
+    }
+
 #if (NGX_THREADS)
 
     if (ngx_event_timer_mutex) {
@@ -54,6 +129,10 @@ ngx_event_find_timer(void)
     ngx_msec_int_t      timer;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        return ngx_event_timer_wheel_find();
+    }
+
     if (ngx_event_timer_rbtree.root == &ngx_event_timer_sentinel) {
         return NGX_TIMER_INFINITE;
     }
@@ -79,6 +158,11 @@ ngx_event_expire_timers(void)
     ngx_event_t        *ev;
     ngx_rbtree_node_t  *node, *root, *sentinel;
 
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_expire();
+        return;
+    }
+
     sentinel = ngx_event_timer_rbtree.sentinel;
 
     for ( ;; ) {
@@ -156,3 +240,347 @@ ngx_event_expire_timers(void)
 
     ngx_mutex_unlock(ngx_event_timer_mutex);
 }
+
+
+ngx_uint_t
+ngx_event_no_timers_left(void)
+{
+    if (ngx_event_timer_wheel) {
+        return ngx_timer_wheel.count == 0
+               || ngx_event_timer_wheel_cancelable();
+    }
+
+    return ngx_event_timer_rbtree_cancelable(ngx_event_timer_rbtree.root,
+                                             ngx_event_timer_rbtree.sentinel);
+}
+
+
+static ngx_uint_t
+ngx_event_timer_rbtree_cancelable(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_event_t  *ev;
+
+    if (node == sentinel) {
+        return 1;
+    }
+
+    ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+    return ev->cancelable
+           && ngx_event_timer_rbtree_cancelable(node->left, sentinel)
+           && ngx_event_timer_rbtree_cancelable(node->right, sentinel);
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_cancelable(void)
+{
+    ngx_uint_t  i, l;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        if (!ngx_event_timer_list_cancelable(&ngx_timer_wheel.root[i])) {
+            return 0;
+        }
+    }
+
+    for (l = 0; l < NGX_TIMER_WHEEL_LEVELS - 1; l++) {
+        for (i = 0; i < NGX_TIMER_WHEEL_SIZE; i++) {
+            if (!ngx_event_timer_list_cancelable(&ngx_timer_wheel.slots[l][i]))
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+static ngx_uint_t
+ngx_event_timer_list_cancelable(ngx_rbtree_node_t *h)
+{
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
+
+    for (node = h->right; node != h; node = node->right) {
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (!ev->cancelable) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static void
+ngx_event_timer_wheel_init(void)
+{
+    ngx_uint_t  i, l;
+
+    ngx_memzero(&ngx_timer_wheel, sizeof(ngx_event_timer_wheel_t));
+
+    ngx_timer_wheel.current = ngx_current_msec;
+
+    for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+        ngx_timer_wheel_list_init(&ngx_timer_wheel.root[i]);
+    }
+
+    for (l = 0; l < NGX_TIMER_WHEEL_LEVELS - 1; l++) {
+        for (i = 0; i < NGX_TIMER_WHEEL_SIZE; i++) {
+            ngx_timer_wheel_list_init(&ngx_timer_wheel.slots[l][i]);
+        }
+    }
+}
+
+
+void
+ngx_event_timer_wheel_add(ngx_event_t *ev)
+{
+    if (ngx_timer_wheel.count == 0) {
+        ngx_timer_wheel.current = ngx_current_msec;
+    }
+
+    ngx_event_timer_wheel_link(&ev->timer);
+
+    ngx_timer_wheel.count++;
+}
+
+
+void
+ngx_event_timer_wheel_del(ngx_event_t *ev)
+{
+    ngx_timer_wheel_list_remove(&ev->timer);
+
+    ngx_timer_wheel.level_count[ev->timer.color]--;
+    ngx_timer_wheel.count--;
+}
+
+
+static void
+ngx_event_timer_wheel_link(ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          level;
+    ngx_msec_t          key, diff;
+    ngx_rbtree_node_t  *slot;
+
+    key = node->key;
+    diff = key - ngx_timer_wheel.current;
+
+    if ((ngx_msec_int_t) diff < 0) {
+
+        /* the timer has already expired */
+
+        slot = &ngx_timer_wheel.root[ngx_timer_wheel.current
+                                     & NGX_TIMER_WHEEL_ROOT_MASK];
+        level = 0;
+
+    } else if (diff < NGX_TIMER_WHEEL_ROOT_SIZE) {
+        slot = &ngx_timer_wheel.root[key & NGX_TIMER_WHEEL_ROOT_MASK];
+        level = 0;
+
+    } else {
+
+        if (diff > NGX_TIMER_WHEEL_MAX) {
+            key = ngx_timer_wheel.current + NGX_TIMER_WHEEL_MAX;
+        }
+
+        for (level = 1; level < NGX_TIMER_WHEEL_LEVELS - 1; level++) {
+            if ((diff >> ngx_timer_wheel_shift(level + 1)) == 0) {
+                break;
+            }
+        }
+
+        slot = &ngx_timer_wheel.slots[level - 1]
+                          [(key >> ngx_timer_wheel_shift(level))
+                           & NGX_TIMER_WHEEL_MASK];
+    }
+
+    ngx_timer_wheel_list_insert(slot, node);
+
+    node->color = (u_char) level;
+    ngx_timer_wheel.level_count[level]++;
+}
+
+
+static ngx_uint_t
+ngx_event_timer_wheel_cascade(ngx_uint_t level)
+{
+    ngx_uint_t          index;
+    ngx_rbtree_node_t  *node, *slot, list;
+
+    index = (ngx_timer_wheel.current >> ngx_timer_wheel_shift(level))
+            & NGX_TIMER_WHEEL_MASK;
+
+    slot = &ngx_timer_wheel.slots[level - 1][index];
+
+    if (ngx_timer_wheel_list_empty(slot)) {
+        return index;
+    }
+
+    ngx_timer_wheel_list_move(slot, &list);
+
+    while (!ngx_timer_wheel_list_empty(&list)) {
+        node = list.right;
+
+        ngx_timer_wheel_list_remove(node);
+        ngx_timer_wheel.level_count[level]--;
+
+        ngx_event_timer_wheel_link(node);
+    }
+
+    return index;
+}
+
+
+static ngx_msec_t
+ngx_event_timer_wheel_find(void)
+{
+    ngx_uint_t      i, level, index, shift, found;
+    ngx_msec_t      next, base, key;
+    ngx_msec_int_t  timer;
+
+    if (ngx_timer_wheel.count == 0) {
+        return NGX_TIMER_INFINITE;
+    }
+
+    next = 0;
+    found = 0;
+
+    if (ngx_timer_wheel.level_count[0]) {
+        for (i = 0; i < NGX_TIMER_WHEEL_ROOT_SIZE; i++) {
+            key = ngx_timer_wheel.current + i;
+
+            if (!ngx_timer_wheel_list_empty(
+                     &ngx_timer_wheel.root[key & NGX_TIMER_WHEEL_ROOT_MASK]))
+            {
+                next = key;
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    /*
+     * the timers of an upper level can not expire before
+     * their slot is cascaded down
+     */
+
+    for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+
+        if (ngx_timer_wheel.level_count[level] == 0) {
+            continue;
+        }
+
+        shift = ngx_timer_wheel_shift(level);
+
+        base = ngx_timer_wheel.current + ((ngx_msec_t) 1 << shift) - 1;
+        base = (base >> shift) << shift;
+
+        if (found && (ngx_msec_int_t) (base - next) >= 0) {
+            break;
+        }
+
+        index = base >> shift;
+
+        for (i = 0; i < NGX_TIMER_WHEEL_SIZE; i++) {
+
+            if (!ngx_timer_wheel_list_empty(
+                     &ngx_timer_wheel.slots[level - 1]
+                                           [(index + i) & NGX_TIMER_WHEEL_MASK]))
+            {
+                key = base + ((ngx_msec_t) i << shift);
+
+                if (!found || (ngx_msec_int_t) (key - next) < 0) {
+                    next = key;
+                    found = 1;
+                }
+
+                break;
+            }
+        }
+    }
+
+    timer = (ngx_msec_int_t) (next - ngx_current_msec);
+
+    return (ngx_msec_t) (timer > 0 ? timer : 0);
+}
+
+
+static void
+ngx_event_timer_wheel_expire(void)
+{
+    ngx_uint_t          index, level;
+    ngx_msec_t          next;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node, list;
+
+    while ((ngx_msec_int_t) (ngx_current_msec - ngx_timer_wheel.current) >= 0)
+    {
+        if (ngx_timer_wheel.count == 0) {
+            ngx_timer_wheel.current = ngx_current_msec + 1;
+            return;
+        }
+
+        index = ngx_timer_wheel.current & NGX_TIMER_WHEEL_ROOT_MASK;
+
+        if (index == 0) {
+            for (level = 1; level < NGX_TIMER_WHEEL_LEVELS; level++) {
+                if (ngx_event_timer_wheel_cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        if (ngx_timer_wheel.level_count[0] == 0) {
+
+            /* skip to the next cascade */
+
+            next = (ngx_timer_wheel.current | NGX_TIMER_WHEEL_ROOT_MASK) + 1;
+
+            if ((ngx_msec_int_t) (next - ngx_current_msec) > 0) {
+                ngx_timer_wheel.current = ngx_current_msec + 1;
+                return;
+            }
+
+            ngx_timer_wheel.current = next;
+            continue;
+        }
+
+        ngx_timer_wheel.current++;
+
+        if (ngx_timer_wheel_list_empty(&ngx_timer_wheel.root[index])) {
+            continue;
+        }
+
+        /* the handlers may add new timers to the slot */
+
+        ngx_timer_wheel_list_move(&ngx_timer_wheel.root[index], &list);
+
+        while (!ngx_timer_wheel_list_empty(&list)) {
+            node = list.right;
+
+            ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "event timer del: %d: %M",
+                           ngx_event_ident(ev->data), ev->timer.key);
+
+            ngx_event_timer_wheel_del(ev);
+
+#if (NGX_DEBUG)
+            ev->timer.left = NULL;
+            ev->timer.right = NULL;
+            ev->timer.parent = NULL;
+#endif
+
+            ev->timer_set = 0;
+
+            ev->timedout = 1;
+
+            ev->handler(ev);
+        }
+    }
+}
@@ -22,6 +22,10 @@
 ngx_int_t ngx_event_timer_init(ngx_log_t *log);
 ngx_msec_t ngx_event_find_timer(void);
 void ngx_event_expire_timers(void);
+ngx_uint_t ngx_event_no_timers_left(void);
+
+void ngx_event_timer_wheel_add(ngx_event_t *ev);
+void ngx_event_timer_wheel_del(ngx_event_t *ev);
 
 
 #if (NGX_THREADS)
@@ -30,6 +34,7 @@ extern ngx_mutex_t  *ngx_event_timer_mutex;
 
 
 extern ngx_thread_volatile ngx_rbtree_t  ngx_event_timer_rbtree;
+extern ngx_uint_t                        ngx_event_timer_wheel;
 
 
 static ngx_inline void
@@ -41,7 +46,12 @@ ngx_event_del_timer(ngx_event_t *ev)
 
     ngx_mutex_lock(ngx_event_timer_mutex);
 
-    ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_del(ev);
+
+    } else {
+        ngx_rbtree_delete(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ngx_mutex_unlock(ngx_event_timer_mutex);
 
@@ -91,7 +101,12 @@ ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer)
 
     ngx_mutex_lock(ngx_event_timer_mutex);
 
-    ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    if (ngx_event_timer_wheel) {
+        ngx_event_timer_wheel_add(ev);
+
+    } else {
+        ngx_rbtree_insert(&ngx_event_timer_rbtree, &ev->timer);
+    }
 
     ngx_mutex_unlock(ngx_event_timer_mutex);
 
@@ -33,11 +33,26 @@ typedef struct {
 typedef struct {
     ngx_http_limit_req_shctx_t  *sh;
     ngx_slab_pool_t             *shpool;
+} ngx_http_limit_req_shard_t;
+
+
+typedef struct {
+    ngx_http_limit_req_shard_t  *shards;
+    ngx_uint_t                   nshards;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
     ngx_int_t                    index;
     ngx_str_t                    var;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shard_t  *shard;
+
+    /* the worker local state of the approximate mode */
+    ngx_msec_t                   sync;
+    ngx_http_limit_req_node_t   *local;
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+    ngx_event_t                  event;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -59,12 +74,22 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, u_char *data, size_t len, ngx_uint_t *ep,
-    ngx_uint_t account);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_find(
+    ngx_rbtree_t *rbtree, ngx_uint_t hash, u_char *data, size_t len);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_alloc(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shard_t *shard,
+    ngx_uint_t hash, u_char *data, size_t len);
+static ngx_int_t ngx_http_limit_req_lookup_local(
+    ngx_http_limit_req_limit_t *limit, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n);
+static void ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx);
+static void ngx_http_limit_req_sync_handler(ngx_event_t *ev);
 
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
@@ -74,6 +99,8 @@ static char *ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd,
 static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_limit_req_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req_init_process(ngx_cycle_t *cycle);
+static void ngx_http_limit_req_exit_process(ngx_cycle_t *cycle);
 
 
 static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
@@ -93,7 +120,7 @@ static ngx_conf_num_bounds_t  ngx_http_limit_req_status_bounds = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4|NGX_CONF_TAKE5,
       ngx_http_limit_req_zone,
       0,
       0,
@@ -146,10 +173,10 @@ ngx_module_t  ngx_http_limit_req_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_http_limit_req_exit_process,       /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -166,6 +193,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_http_variable_value_t   *vv;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shard_t  *shard;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_set) {
@@ -211,12 +239,22 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(vv->data, len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        if (ctx->sync) {
+            rc = ngx_http_limit_req_lookup_local(limit, hash, vv->data, len,
+                                                 &excess,
+                                                 (n == lrcf->limits.nelts - 1));
 
-        rc = ngx_http_limit_req_lookup(limit, hash, vv->data, len, &excess,
-                                       (n == lrcf->limits.nelts - 1));
+        } else {
+            shard = &ctx->shards[hash % ctx->nshards];
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(&shard->shpool->mutex);
+
+            rc = ngx_http_limit_req_lookup(limit, shard, hash, vv->data, len,
+                                           &excess,
+                                           (n == lrcf->limits.nelts - 1));
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+        }
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -245,15 +283,17 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
         while (n--) {
             ctx = limits[n].shm_zone->data;
 
+            ctx->local = NULL;
+
             if (ctx->node == NULL) {
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(&ctx->shard->shpool->mutex);
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
             ctx->node = NULL;
         }
@@ -364,15 +404,14 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    u_char *data, size_t len, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account)
 {
-    size_t                      size;
-    ngx_int_t                   rc, excess;
+    ngx_int_t                   excess;
     ngx_time_t                 *tp;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node, *sentinel;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
 
@@ -381,8 +420,74 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    lr = ngx_http_limit_req_find(&shard->sh->rbtree, hash, data, len);
+
+    if (lr) {
+        ngx_queue_remove(&lr->queue);
+        ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+        ms = (ngx_msec_int_t) (now - lr->last);
+
+        excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+
+        if (excess < 0) {
+            excess = 0;
+        }
+
+        *ep = excess;
+
+        if ((ngx_uint_t) excess > limit->burst) {
+            return NGX_BUSY;
+        }
+
+        if (account) {
+            lr->excess = excess;
+            lr->last = now;
+            return NGX_OK;
+        }
+
+        lr->count++;
+
+        ctx->node = lr;
+        ctx->shard = shard;
+
+        return NGX_AGAIN;
+    }
+
+    *ep = 0;
+
+    lr = ngx_http_limit_req_alloc(ctx, shard, hash, data, len);
+
+    if (lr == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (account) {
+        lr->last = now;
+        lr->count = 0;
+        return NGX_OK;
+    }
+
+    lr->last = 0;
+    lr->count = 1;
+
+    ctx->node = lr;
+    ctx->shard = shard;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_find(ngx_rbtree_t *rbtree, ngx_uint_t hash, u_char *data,
+    size_t len)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_http_limit_req_node_t  *lr;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
 
     while (node != sentinel) {
 
@@ -403,55 +508,39 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
         rc = ngx_memn2cmp(data, lr->data, len, (size_t) lr->len);
 
         if (rc == 0) {
-            ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
-            ms = (ngx_msec_int_t) (now - lr->last);
-
-            excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
-
-            if (excess < 0) {
-                excess = 0;
-            }
-
-            *ep = excess;
-
-            if ((ngx_uint_t) excess > limit->burst) {
-                return NGX_BUSY;
-            }
-
-            if (account) {
-                lr->excess = excess;
-                lr->last = now;
-                return NGX_OK;
-            }
-
-            lr->count++;
-
-            ctx->node = lr;
-
-            return NGX_AGAIN;
+            return lr;
         }
 
         node = (rc < 0) ? node->left : node->right;
     }
 
-    *ep = 0;
+    return NULL;
+}
+
+
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_alloc(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len)
+{
+    size_t                      size;
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req_node_t  *lr;
 
     size = offsetof(ngx_rbtree_node_t, color)
            + offsetof(ngx_http_limit_req_node_t, data)
            + len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, shard, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_slab_alloc_locked(shard->shpool, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, shard, 0);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        node = ngx_slab_alloc_locked(shard->shpool, size);
         if (node == NULL) {
-            return NGX_ERROR;
+            return NULL;
         }
     }
 
@@ -459,27 +548,120 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     lr = (ngx_http_limit_req_node_t *) &node->color;
 
-    lr->len = (u_char) len;
+    lr->len = (u_short) len;
     lr->excess = 0;
 
     ngx_memcpy(lr->data, data, len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_rbtree_insert(&shard->sh->rbtree, node);
 
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
+    ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
 
-    if (account) {
-        lr->last = now;
-        lr->count = 0;
-        return NGX_OK;
+    return lr;
+}
+
+
+/*
+ * the approximate mode: the requests are accounted in the worker local
+ * tree without any locks, and the accumulated excess is merged into
+ * the shared zone once per the "sync" interval
+ */
+
+static ngx_int_t
+ngx_http_limit_req_lookup_local(ngx_http_limit_req_limit_t *limit,
+    ngx_uint_t hash, u_char *data, size_t len, ngx_uint_t *ep,
+    ngx_uint_t account)
+{
+    ngx_int_t                    rc, excess;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    tp = ngx_timeofday();
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    ctx = limit->shm_zone->data;
+
+    lr = ngx_http_limit_req_find(&ctx->rbtree, hash, data, len);
+
+    if (lr) {
+        ms = (ngx_msec_int_t) (now - lr->last);
+
+        excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+
+        if (excess < 0) {
+            excess = 0;
+        }
+
+        *ep = excess;
+
+        if ((ngx_uint_t) excess > limit->burst) {
+            return NGX_BUSY;
+        }
+
+        if (account) {
+            lr->excess = excess;
+            lr->last = now;
+            lr->count++;
+            return NGX_OK;
+        }
+
+        /* the request is accounted once all limits are passed */
+
+        ctx->local = lr;
+
+        return NGX_AGAIN;
     }
 
-    lr->last = 0;
-    lr->count = 1;
+    /* the first request of the key in the interval is accounted in the zone */
 
-    ctx->node = lr;
+    shard = &ctx->shards[hash % ctx->nshards];
 
-    return NGX_AGAIN;
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    rc = ngx_http_limit_req_lookup(limit, shard, hash, data, len, ep, account);
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    node = ngx_alloc(offsetof(ngx_rbtree_node_t, color)
+                     + offsetof(ngx_http_limit_req_node_t, data) + len,
+                     ngx_cycle->log);
+    if (node == NULL) {
+        return rc;
+    }
+
+    node->key = hash;
+
+    lr = (ngx_http_limit_req_node_t *) &node->color;
+
+    lr->len = (u_short) len;
+    lr->last = now;
+    lr->count = 0;
+
+    /* the request not accounted is excluded, a new key has no excess */
+
+    if (rc == NGX_OK) {
+        lr->excess = *ep;
+
+    } else {
+        lr->excess = (*ep > 1000) ? *ep - 1000 : 0;
+    }
+
+    ngx_memcpy(lr->data, data, len);
+
+    ngx_rbtree_insert(&ctx->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->queue, &lr->queue);
+
+    return rc;
 }
 
 
@@ -506,14 +688,19 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
     while (n--) {
         ctx = limits[n].shm_zone->data;
-        lr = ctx->node;
 
-        if (lr == NULL) {
+        if (ctx->local) {
+            lr = ctx->local;
+
+        } else if (ctx->node) {
+            lr = ctx->node;
+
+            ngx_shmtx_lock(&ctx->shard->shpool->mutex);
+
+        } else {
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
-
         tp = ngx_timeofday();
 
         now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
@@ -527,11 +714,18 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
         lr->last = now;
         lr->excess = excess;
-        lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        if (ctx->local) {
+            lr->count++;
+            ctx->local = NULL;
+
+        } else {
+            lr->count--;
+
+            ngx_shmtx_unlock(&ctx->shard->shpool->mutex);
 
-        ctx->node = NULL;
+            ctx->node = NULL;
+        }
 
         if (limits[n].nodelay) {
             continue;
@@ -551,7 +745,8 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 
 
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shard_t *shard, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_time_t                 *tp;
@@ -573,11 +768,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&shard->sh->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&shard->sh->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -612,20 +807,120 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&shard->sh->rbtree, node);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_slab_free_locked(shard->shpool, node);
     }
 }
 
 
+static void
+ngx_http_limit_req_sync(ngx_http_limit_req_ctx_t *ctx)
+{
+    ngx_int_t                    excess;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_queue_t                 *q, *next;
+    ngx_rbtree_node_t           *node;
+    ngx_http_limit_req_node_t   *lr, *slr;
+    ngx_http_limit_req_shard_t  *shard;
+
+    tp = ngx_timeofday();
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    for (q = ngx_queue_head(&ctx->queue);
+         q != ngx_queue_sentinel(&ctx->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+
+        if (lr->count == 0) {
+
+            /* the key was idle during the interval */
+
+            ngx_queue_remove(q);
+            ngx_rbtree_delete(&ctx->rbtree, node);
+            ngx_free(node);
+
+            continue;
+        }
+
+        shard = &ctx->shards[node->key % ctx->nshards];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
+
+        slr = ngx_http_limit_req_find(&shard->sh->rbtree, node->key,
+                                      lr->data, lr->len);
+
+        if (slr == NULL) {
+            slr = ngx_http_limit_req_alloc(ctx, shard, node->key, lr->data,
+                                           lr->len);
+            if (slr) {
+                slr->last = now;
+                slr->count = 0;
+            }
+
+        } else {
+            ngx_queue_remove(&slr->queue);
+            ngx_queue_insert_head(&shard->sh->queue, &slr->queue);
+        }
+
+        if (slr) {
+            ms = (ngx_msec_int_t) (now - slr->last);
+
+            excess = slr->excess - ctx->rate * ngx_abs(ms) / 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            slr->excess = excess + lr->count * 1000;
+            slr->last = now;
+
+            lr->excess = slr->excess;
+            lr->last = now;
+        }
+
+        ngx_shmtx_unlock(&shard->shpool->mutex);
+
+        lr->count = 0;
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_handler(ngx_event_t *ev)
+{
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    ctx = ev->data;
+
+    ngx_http_limit_req_sync(ctx);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, ctx->sync);
+}
+
+
 static ngx_int_t
 ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_slab_pool_t             *shpool, **pools;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -638,46 +933,162 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
+        ctx->shards = octx->shards;
 
         return NGX_OK;
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+        ctx->shards = shpool->data;
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
+    ctx->shards = ngx_slab_alloc(shpool, sizeof(ngx_http_limit_req_shard_t)
+                                         * ctx->nshards);
+    if (ctx->shards == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
-
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
-
-    ngx_queue_init(&ctx->sh->queue);
+    shpool->data = ctx->shards;
 
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
+    ngx_sprintf(shpool->log_ctx, " in limit_req zone \"%V\"%Z",
                 &shm_zone->shm.name);
 
+    if (ctx->nshards == 1) {
+        ctx->shards[0].shpool = shpool;
+
+    } else {
+        pools = ngx_alloc(sizeof(ngx_slab_pool_t *) * ctx->nshards,
+                          shm_zone->shm.log);
+        if (pools == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_slab_split(shpool, pools, ctx->nshards) != NGX_OK) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req zone \"%V\" is too small for %ui shards",
+                          &shm_zone->shm.name, ctx->nshards);
+            ngx_free(pools);
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].shpool = pools[i];
+        }
+
+        ngx_free(pools);
+    }
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sh = ngx_slab_alloc(ctx->shards[i].shpool,
+                            sizeof(ngx_http_limit_req_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&sh->queue);
+
+        ctx->shards[i].sh = sh;
+    }
+
     return NGX_OK;
 }
 
 
+static ngx_int_t
+ngx_http_limit_req_copy_zone(ngx_shm_zone_t *shm_zone, ngx_shm_zone_t *ozone)
+{
+    size_t                       size;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q;
+    ngx_rbtree_node_t           *node, *onode;
+    ngx_http_limit_req_ctx_t    *ctx, *octx;
+    ngx_http_limit_req_node_t   *lr, *olr;
+    ngx_http_limit_req_shard_t  *shard, *oshard;
+
+    ctx = shm_zone->data;
+    octx = ozone->data;
+
+    if (ngx_strcmp(ctx->var.data, octx->var.data) != 0) {
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_OK;
+
+    for (i = 0; i < octx->nshards; i++) {
+        oshard = &octx->shards[i];
+
+        ngx_shmtx_lock(&oshard->shpool->mutex);
+
+        /* the most recently used entries are copied first */
+
+        for (q = ngx_queue_head(&oshard->sh->queue);
+             q != ngx_queue_sentinel(&oshard->sh->queue);
+             q = ngx_queue_next(q))
+        {
+            olr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+
+            onode = (ngx_rbtree_node_t *)
+                        ((u_char *) olr - offsetof(ngx_rbtree_node_t, color));
+
+            shard = &ctx->shards[onode->key % ctx->nshards];
+
+            size = offsetof(ngx_rbtree_node_t, color)
+                   + offsetof(ngx_http_limit_req_node_t, data)
+                   + olr->len;
+
+            node = ngx_slab_alloc_locked(shard->shpool, size);
+
+            if (node == NULL) {
+                rc = NGX_DECLINED;
+                break;
+            }
+
+            node->key = onode->key;
+
+            lr = (ngx_http_limit_req_node_t *) &node->color;
+
+            lr->len = olr->len;
+            lr->last = olr->last;
+            lr->excess = olr->excess;
+            lr->count = 0;
+
+            ngx_memcpy(lr->data, olr->data, olr->len);
+
+            ngx_rbtree_insert(&shard->sh->rbtree, node);
+
+            ngx_queue_insert_tail(&shard->sh->queue, &lr->queue);
+        }
+
+        ngx_shmtx_unlock(&oshard->shpool->mutex);
+    }
+
+    return rc;
+}
+
+
 static void *
 ngx_http_limit_req_create_conf(ngx_conf_t *cf)
 {
@@ -731,8 +1142,9 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size_t                     len;
     ssize_t                    size;
     ngx_str_t                 *value, name, s;
-    ngx_int_t                  rate, scale;
+    ngx_int_t                  rate, scale, shards;
     ngx_uint_t                 i;
+    ngx_msec_t                 sync;
     ngx_shm_zone_t            *shm_zone;
     ngx_http_limit_req_ctx_t  *ctx;
 
@@ -742,6 +1154,8 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     rate = 1;
     scale = 1;
+    shards = 1;
+    sync = 0;
     name.len = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
@@ -804,6 +1218,35 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "sync=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            sync = ngx_parse_time(&s, 0);
+            if (sync == (ngx_msec_t) NGX_ERROR || sync == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid sync interval \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (value[i].data[0] == '$') {
 
             value[i].len--;
@@ -844,6 +1287,14 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     ctx->rate = rate * 1000 / scale;
+    ctx->nshards = shards;
+    ctx->sync = sync;
+
+    if (sync) {
+        ngx_rbtree_init(&ctx->rbtree, &ctx->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+        ngx_queue_init(&ctx->queue);
+    }
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -861,6 +1312,7 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     shm_zone->init = ngx_http_limit_req_init_zone;
+    shm_zone->copy = ngx_http_limit_req_copy_zone;
     shm_zone->data = ctx;
 
     return NGX_CONF_OK;
@@ -983,3 +1435,89 @@ ngx_http_limit_req_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_limit_req_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_list_part_t           *part;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_limit_req_module) {
+            continue;
+        }
+
+        ctx = shm_zone[i].data;
+
+        if (ctx == NULL || ctx->sync == 0) {
+            continue;
+        }
+
+        ctx->event.handler = ngx_http_limit_req_sync_handler;
+        ctx->event.data = ctx;
+        ctx->event.log = cycle->log;
+
+        ngx_add_timer(&ctx->event, ctx->sync);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_limit_req_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                 i;
+    ngx_list_part_t           *part;
+    ngx_shm_zone_t            *shm_zone;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag != &ngx_http_limit_req_module) {
+            continue;
+        }
+
+        ctx = shm_zone[i].data;
+
+        if (ctx == NULL || ctx->sync == 0) {
+            continue;
+        }
+
+        ngx_http_limit_req_sync(ctx);
+    }
+}
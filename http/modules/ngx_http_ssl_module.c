@@ -747,6 +747,7 @@ ngx_http_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
 
             sscf->shm_zone->init = ngx_ssl_session_cache_init;
+            sscf->shm_zone->copy = ngx_ssl_session_cache_copy;
 
             continue;
         }
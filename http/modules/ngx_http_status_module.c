@@ -0,0 +1,1163 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_STATUS_CLASSES  5
+#define NGX_HTTP_STATUS_BUCKETS  10
+
+
+/*
+ * the counters are updated by the owner worker only,
+ * so they are not incremented atomically
+ */
+
+typedef struct {
+    ngx_atomic_t                     requests;
+    ngx_atomic_t                     received;
+    ngx_atomic_t                     sent;
+    ngx_atomic_t                     time;
+    ngx_atomic_t                     responses[NGX_HTTP_STATUS_CLASSES];
+    ngx_atomic_t                     latency[NGX_HTTP_STATUS_BUCKETS];
+} ngx_http_status_counters_t;
+
+
+typedef struct {
+    ngx_atomic_t                     generation;
+    ngx_uint_t                       workers;
+    ngx_uint_t                       nservers;
+    ngx_uint_t                       npeers;
+    size_t                           worker_size;
+    u_char                          *counters;
+} ngx_http_status_shctx_t;
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t    *upstream;
+    ngx_uint_t                       npeers;
+    ngx_uint_t                       index;
+} ngx_http_status_upstream_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_slab_pool_t                 *shpool;
+    ngx_http_status_shctx_t         *sh;
+
+    ngx_array_t                      servers;   /* ngx_str_t */
+    ngx_array_t                      upstreams; /* ngx_http_status_upstream_t */
+
+    ngx_uint_t                       npeers;
+    size_t                           worker_size;
+} ngx_http_status_main_conf_t;
+
+
+typedef struct {
+    ngx_uint_t                       index;
+} ngx_http_status_srv_conf_t;
+
+
+static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_status_log_handler(ngx_http_request_t *r);
+static void ngx_http_status_count(ngx_http_status_counters_t *sc,
+    ngx_uint_t status, ngx_msec_int_t ms, off_t received, off_t sent);
+static void ngx_http_status_sum(ngx_http_status_main_conf_t *smcf,
+    ngx_http_status_counters_t *total);
+static u_char *ngx_http_status_name(u_char *p, ngx_str_t *name);
+#if (NGX_HAVE_ATOMIC_OPS)
+static u_char *ngx_http_status_mutex(u_char *p, ngx_str_t *name,
+    ngx_shmtx_stat_t *stat);
+#endif
+static u_char *ngx_http_status_slab(u_char *p, ngx_str_t *name,
+    ngx_slab_pool_t *sp);
+static u_char *ngx_http_status_counters(u_char *p,
+    ngx_http_status_counters_t *sc);
+static ngx_int_t ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static void *ngx_http_status_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_status_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_status_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_status_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_status_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_status_commands[] = {
+
+    { ngx_string("status_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_status_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_status,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_status_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_status_init,                  /* postconfiguration */
+
+    ngx_http_status_create_main_conf,      /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_status_create_srv_conf,       /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_status_module = {
+    NGX_MODULE_V1,
+    &ngx_http_status_module_ctx,           /* module context */
+    ngx_http_status_commands,              /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    ngx_http_status_init_module,           /* init module */
+    ngx_http_status_init_process,          /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_msec_t  ngx_http_status_buckets[NGX_HTTP_STATUS_BUCKETS - 1] = {
+    1, 5, 10, 50, 100, 500, 1000, 5000, 10000
+};
+
+
+#define NGX_HTTP_STATUS_COUNTERS_LEN                                          \
+    (sizeof("\"requests\":,\"received\":,\"sent\":,\"time\":,"                \
+            "\"responses\":{\"1xx\":,\"2xx\":,\"3xx\":,\"4xx\":,\"5xx\":},"   \
+            "\"latency\":{\"1\":,\"5\":,\"10\":,\"50\":,\"100\":,\"500\":,"   \
+            "\"1000\":,\"5000\":,\"10000\":,\"inf\":}}")                      \
+     + (4 + NGX_HTTP_STATUS_CLASSES + NGX_HTTP_STATUS_BUCKETS)                \
+       * NGX_ATOMIC_T_LEN)
+
+#define NGX_HTTP_STATUS_MUTEX_LEN                                             \
+    (sizeof(",{\"name\":\"\",\"acquisitions\":,\"spins\":,\"sleeps\":,"       \
+            "\"handoffs\":,\"wait\":,\"max_wait\":}") - 1                     \
+     + 6 * NGX_ATOMIC_T_LEN)
+
+#define NGX_HTTP_STATUS_SLAB_LEN                                              \
+    (sizeof(",{\"name\":\"\",\"pages\":{\"total\":,\"free\":,"             \
+            "\"largest\":},\"fails\":,\"slots\":{}}") - 1                     \
+     + 4 * NGX_INT_T_LEN)
+
+#define NGX_HTTP_STATUS_SLOT_LEN                                              \
+    (sizeof(",\"\":{\"total\":,\"used\":,\"reqs\":,\"fails\":}") - 1          \
+     + 5 * NGX_INT_T_LEN)
+
+
+static ngx_http_status_counters_t  *ngx_http_status_worker;
+static ngx_atomic_uint_t            ngx_http_status_generation;
+
+
+static ngx_int_t
+ngx_http_status_handler(ngx_http_request_t *r)
+{
+    size_t                          size;
+    u_char                         *p;
+    ngx_int_t                       rc;
+    ngx_str_t                      *name;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i, j, k, n, ncounters;
+    ngx_chain_t                     out;
+    ngx_http_status_shctx_t        *sh;
+    ngx_http_status_counters_t     *total;
+    ngx_http_status_upstream_t     *us;
+    ngx_http_status_main_conf_t    *smcf;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_slab_pool_t                *sp;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_list_part_t                *part;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_str_t                       accept;
+#endif
+#if (NGX_HTTP_CACHE)
+    off_t                           cache_size;
+    ngx_http_file_cache_t         **caches;
+    ngx_http_file_cache_stat_t      stat;
+    ngx_http_upstream_main_conf_t  *umcf;
+#endif
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+
+    sh = smcf->sh;
+
+    if (sh == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the \"status_zone\" directive is not set");
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (sh->counters == NULL
+        || sh->generation != ngx_http_status_generation)
+    {
+        /* an old worker after reconfiguration */
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    ncounters = 1 + sh->nservers + sh->npeers;
+
+    total = ngx_pcalloc(r->pool,
+                        sizeof(ngx_http_status_counters_t) * ncounters);
+    if (total == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_status_sum(smcf, total);
+
+    size = sizeof("{\"connections\":{\"active\":,\"reading\":,\"writing\":,"
+                  "\"waiting\":,\"accepted\":,\"handled\":},") - 1
+           + 6 * NGX_ATOMIC_T_LEN
+           + sizeof("\"total\":{},\"workers\":[],\"servers\":[],"
+                    "\"upstreams\":[]}\n") - 1
+           + sh->workers * (sizeof("{\"id\":,") - 1 + NGX_INT_T_LEN
+                            + NGX_HTTP_STATUS_COUNTERS_LEN)
+           + ncounters * (sizeof("{\"name\":\"\",\"backup\":false,") - 1
+                          + NGX_HTTP_STATUS_COUNTERS_LEN);
+
+    name = smcf->servers.elts;
+    for (i = 0; i < smcf->servers.nelts; i++) {
+        size += 2 * name[i].len;
+    }
+
+    us = smcf->upstreams.elts;
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        size += sizeof("{\"name\":\"\",\"peers\":[]},") - 1
+                + 2 * us[i].upstream->host.len;
+
+        for (peers = us[i].upstream->peer.data; peers; peers = peers->next) {
+            for (j = 0; j < peers->number; j++) {
+
+                /* the names in an upstream zone may be changed meanwhile */
+
+                size += 2 * (peers->shpool ? NGX_SOCKADDR_STRLEN
+                                           : peers->peer[j].name.len);
+            }
+        }
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    caches = umcf->caches.elts;
+
+    size += sizeof(",\"caches\":[]") - 1;
+
+    for (i = 0; i < umcf->caches.nelts; i++) {
+        size += sizeof("{\"name\":\"\",\"size\":,\"cold\":false,\"hit\":,"
+                       "\"miss\":,\"promoted\":,\"demoted\":,\"rejected\":,"
+                       "\"variant_hit\":,\"variant_miss\":},")
+                - 1 + NGX_OFF_T_LEN + 7 * NGX_INT_T_LEN
+                + 2 * caches[i]->shm_zone->shm.name.len;
+    }
+
+#endif
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    size += sizeof(",\"mutexes\":[]") - 1 + NGX_HTTP_STATUS_MUTEX_LEN
+            + sizeof("accept") - 1;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        size += NGX_HTTP_STATUS_MUTEX_LEN + 2 * shm_zone[i].shm.name.len;
+    }
+
+#endif
+
+    size += sizeof(",\"slabs\":[]") - 1;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+        size += NGX_HTTP_STATUS_SLAB_LEN + 2 * shm_zone[i].shm.name.len
+                + (ngx_pagesize_shift - sp->min_shift)
+                  * NGX_HTTP_STATUS_SLOT_LEN;
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    p = b->last;
+
+#if (NGX_STAT_STUB)
+    p = ngx_sprintf(p, "{\"connections\":{\"active\":%uA,\"reading\":%uA,"
+                    "\"writing\":%uA,\"waiting\":%uA,\"accepted\":%uA,"
+                    "\"handled\":%uA},",
+                    *ngx_stat_active, *ngx_stat_reading, *ngx_stat_writing,
+                    *ngx_stat_waiting, *ngx_stat_accepted, *ngx_stat_handled);
+#else
+    *p++ = '{';
+#endif
+
+    p = ngx_cpymem(p, "\"total\":{", sizeof("\"total\":{") - 1);
+    p = ngx_http_status_counters(p, &total[0]);
+
+    p = ngx_cpymem(p, ",\"workers\":[", sizeof(",\"workers\":[") - 1);
+
+    for (i = 0; i < sh->workers; i++) {
+        p = ngx_sprintf(p, "%s{\"id\":%ui,", i ? "," : "", i);
+        p = ngx_http_status_counters(p, (ngx_http_status_counters_t *)
+                                        (sh->counters + i * sh->worker_size));
+    }
+
+    p = ngx_cpymem(p, "],\"servers\":[", sizeof("],\"servers\":[") - 1);
+
+    for (i = 0; i < smcf->servers.nelts; i++) {
+        p = ngx_cpymem(p, i ? ",{\"name\":" : "{\"name\":",
+                       i ? sizeof(",{\"name\":") - 1 : sizeof("{\"name\":") - 1);
+        p = ngx_http_status_name(p, &name[i]);
+        *p++ = ',';
+        p = ngx_http_status_counters(p, &total[1 + i]);
+    }
+
+    p = ngx_cpymem(p, "],\"upstreams\":[", sizeof("],\"upstreams\":[") - 1);
+
+    n = 1 + sh->nservers;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        p = ngx_cpymem(p, i ? ",{\"name\":" : "{\"name\":",
+                       i ? sizeof(",{\"name\":") - 1 : sizeof("{\"name\":") - 1);
+        p = ngx_http_status_name(p, &us[i].upstream->host);
+        p = ngx_cpymem(p, ",\"peers\":[", sizeof(",\"peers\":[") - 1);
+
+        k = 0;
+
+        for (peers = us[i].upstream->peer.data; peers; peers = peers->next) {
+
+            ngx_http_upstream_rr_peers_lock(peers);
+
+            for (j = 0; j < peers->number; j++, k++) {
+                peer = &peers->peer[j];
+
+                if (peer->removed) {
+                    continue;
+                }
+
+                if (*(p - 1) == '}') {
+                    *p++ = ',';
+                }
+
+                p = ngx_cpymem(p, "{\"name\":", sizeof("{\"name\":") - 1);
+                p = ngx_http_status_name(p, &peer->name);
+                p = ngx_sprintf(p, ",\"backup\":%s,",
+                                peers == us[i].upstream->peer.data
+                                ? "false" : "true");
+                p = ngx_http_status_counters(p, &total[n + us[i].index + k]);
+            }
+
+            ngx_http_upstream_rr_peers_unlock(peers);
+        }
+
+        *p++ = ']';
+        *p++ = '}';
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    p = ngx_cpymem(p, "],\"caches\":[", sizeof("],\"caches\":[") - 1);
+
+    for (i = 0; i < umcf->caches.nelts; i++) {
+
+        ngx_shmtx_lock(&caches[i]->shpool->mutex);
+
+        cache_size = caches[i]->sh->size;
+        stat = caches[i]->sh->stat;
+
+        ngx_shmtx_unlock(&caches[i]->shpool->mutex);
+
+        p = ngx_cpymem(p, i ? ",{\"name\":" : "{\"name\":",
+                       i ? sizeof(",{\"name\":") - 1 : sizeof("{\"name\":") - 1);
+        p = ngx_http_status_name(p, &caches[i]->shm_zone->shm.name);
+        p = ngx_sprintf(p, ",\"size\":%O,\"cold\":%s,\"hit\":%ui,"
+                        "\"miss\":%ui,\"promoted\":%ui,\"demoted\":%ui,"
+                        "\"rejected\":%ui,\"variant_hit\":%ui,"
+                        "\"variant_miss\":%ui}",
+                        cache_size * caches[i]->bsize,
+                        caches[i]->sh->cold ? "true" : "false",
+                        stat.hit, stat.miss, stat.promoted, stat.demoted,
+                        stat.rejected, stat.variant_hit, stat.variant_miss);
+    }
+
+#endif
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    p = ngx_cpymem(p, "],\"mutexes\":[", sizeof("],\"mutexes\":[") - 1);
+
+    k = 0;
+
+    /* the accept mutex exists only with the master process */
+
+    if (ngx_accept_mutex_ptr && ngx_use_accept_mutex) {
+        ngx_str_set(&accept, "accept");
+        p = ngx_http_status_mutex(p, &accept, ngx_accept_mutex.stat);
+        k++;
+    }
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        sp = (ngx_slab_pool_t *) shm_zone[i].shm.addr;
+
+        if (k++) {
+            *p++ = ',';
+        }
+
+        p = ngx_http_status_mutex(p, &shm_zone[i].shm.name, &sp->lock.stat);
+    }
+
+#endif
+
+    p = ngx_cpymem(p, "],\"slabs\":[", sizeof("],\"slabs\":[") - 1);
+
+    k = 0;
+
+    part = (ngx_list_part_t *) &ngx_cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (k++) {
+            *p++ = ',';
+        }
+
+        p = ngx_http_status_slab(p, &shm_zone[i].shm.name,
+                                 (ngx_slab_pool_t *) shm_zone[i].shm.addr);
+    }
+
+    p = ngx_cpymem(p, "]}" CRLF, sizeof("]}" CRLF) - 1);
+
+    b->last = p;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static ngx_int_t
+ngx_http_status_log_handler(ngx_http_request_t *r)
+{
+    ngx_uint_t                     i, j, k, n, status;
+    ngx_time_t                    *tp;
+    ngx_msec_int_t                 ms;
+    ngx_http_upstream_t           *u;
+    ngx_http_status_shctx_t       *sh;
+    ngx_http_status_upstream_t    *us;
+    ngx_http_upstream_state_t     *state;
+    ngx_http_status_srv_conf_t    *sscf;
+    ngx_http_status_main_conf_t   *smcf;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    if (ngx_http_status_worker == NULL) {
+        return NGX_OK;
+    }
+
+    smcf = ngx_http_get_module_main_conf(r, ngx_http_status_module);
+    sscf = ngx_http_get_module_srv_conf(r, ngx_http_status_module);
+
+    sh = smcf->sh;
+
+    if (sh->generation != ngx_http_status_generation) {
+
+        /* an old worker, the counters have been laid out anew */
+
+        ngx_http_status_worker = NULL;
+        return NGX_OK;
+    }
+
+    if (r->err_status) {
+        status = r->err_status;
+
+    } else {
+        status = r->headers_out.status;
+    }
+
+    tp = ngx_timeofday();
+
+    ms = (ngx_msec_int_t)
+             ((tp->sec - r->start_sec) * 1000 + (tp->msec - r->start_msec));
+    ms = ngx_max(ms, 0);
+
+    ngx_http_status_count(&ngx_http_status_worker[0], status, ms,
+                          r->request_length, r->connection->sent);
+
+    if (sscf->index != NGX_CONF_UNSET_UINT) {
+        ngx_http_status_count(&ngx_http_status_worker[1 + sscf->index],
+                              status, ms, r->request_length,
+                              r->connection->sent);
+    }
+
+    u = r->upstream;
+
+    if (u == NULL || u->conf == NULL || u->conf->upstream == NULL
+        || r->upstream_states == NULL)
+    {
+        return NGX_OK;
+    }
+
+    us = smcf->upstreams.elts;
+
+    for (i = 0; i < smcf->upstreams.nelts; i++) {
+        if (us[i].upstream == u->conf->upstream) {
+            break;
+        }
+    }
+
+    if (i == smcf->upstreams.nelts) {
+        return NGX_OK;
+    }
+
+    us = &us[i];
+
+    n = 1 + sh->nservers + us->index;
+
+    state = r->upstream_states->elts;
+
+    for (i = 0; i < r->upstream_states->nelts; i++) {
+        if (state[i].peer == NULL) {
+            continue;
+        }
+
+        k = 0;
+
+        for (peers = us->upstream->peer.data; peers; peers = peers->next) {
+            for (j = 0; j < peers->number; j++, k++) {
+                peer = &peers->peer[j];
+
+                if (&peer->name == state[i].peer) {
+                    goto found;
+                }
+
+                /* the name of a peer in a zone is copied to the request */
+
+                if (peers->shpool
+                    && !peer->removed
+                    && peer->name.len == state[i].peer->len
+                    && ngx_strncmp(peer->name.data, state[i].peer->data,
+                                   peer->name.len)
+                       == 0)
+                {
+                    goto found;
+                }
+            }
+        }
+
+        continue;
+
+    found:
+
+        ms = (ngx_msec_int_t)
+                 (state[i].response_sec * 1000 + state[i].response_msec);
+        ms = ngx_max(ms, 0);
+
+        ngx_http_status_count(&ngx_http_status_worker[n + k], state[i].status,
+                              ms, state[i].response_length, 0);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_status_count(ngx_http_status_counters_t *sc, ngx_uint_t status,
+    ngx_msec_int_t ms, off_t received, off_t sent)
+{
+    ngx_uint_t  i;
+
+    sc->requests++;
+    sc->received += received;
+    sc->sent += sent;
+    sc->time += ms;
+
+    if (status >= 100 && status < 600) {
+        sc->responses[status / 100 - 1]++;
+    }
+
+    for (i = 0; i < NGX_HTTP_STATUS_BUCKETS - 1; i++) {
+        if ((ngx_msec_t) ms <= ngx_http_status_buckets[i]) {
+            break;
+        }
+    }
+
+    sc->latency[i]++;
+}
+
+
+static void
+ngx_http_status_sum(ngx_http_status_main_conf_t *smcf,
+    ngx_http_status_counters_t *total)
+{
+    ngx_uint_t                     i, j, k, n;
+    ngx_http_status_shctx_t       *sh;
+    ngx_http_status_counters_t    *sc;
+
+    sh = smcf->sh;
+
+    n = 1 + sh->nservers + sh->npeers;
+
+    for (i = 0; i < sh->workers; i++) {
+        sc = (ngx_http_status_counters_t *)
+                 (sh->counters + i * sh->worker_size);
+
+        for (j = 0; j < n; j++) {
+            total[j].requests += sc[j].requests;
+            total[j].received += sc[j].received;
+            total[j].sent += sc[j].sent;
+            total[j].time += sc[j].time;
+
+            for (k = 0; k < NGX_HTTP_STATUS_CLASSES; k++) {
+                total[j].responses[k] += sc[j].responses[k];
+            }
+
+            for (k = 0; k < NGX_HTTP_STATUS_BUCKETS; k++) {
+                total[j].latency[k] += sc[j].latency[k];
+            }
+        }
+    }
+}
+
+
+static u_char *
+ngx_http_status_name(u_char *p, ngx_str_t *name)
+{
+    ngx_uint_t  i;
+
+    *p++ = '"';
+
+    for (i = 0; i < name->len; i++) {
+        if (name->data[i] == '"' || name->data[i] == '\\') {
+            *p++ = '\\';
+        }
+
+        *p++ = name->data[i];
+    }
+
+    *p++ = '"';
+
+    return p;
+}
+
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+static u_char *
+ngx_http_status_mutex(u_char *p, ngx_str_t *name, ngx_shmtx_stat_t *stat)
+{
+    p = ngx_cpymem(p, "{\"name\":", sizeof("{\"name\":") - 1);
+    p = ngx_http_status_name(p, name);
+
+    return ngx_sprintf(p, ",\"acquisitions\":%uA,\"spins\":%uA,"
+                       "\"sleeps\":%uA,\"handoffs\":%uA,\"wait\":%uA,"
+                       "\"max_wait\":%uA}",
+                       stat->acquisitions, stat->spins, stat->sleeps,
+                       stat->handoffs, stat->wait, stat->max_wait);
+}
+
+#endif
+
+
+static u_char *
+ngx_http_status_slab(u_char *p, ngx_str_t *name, ngx_slab_pool_t *sp)
+{
+    ngx_uint_t        i, n;
+    ngx_slab_stat_t  *stat;
+
+    p = ngx_cpymem(p, "{\"name\":", sizeof("{\"name\":") - 1);
+    p = ngx_http_status_name(p, name);
+
+    n = ngx_pagesize_shift - sp->min_shift;
+
+    ngx_shmtx_lock(&sp->mutex);
+
+    p = ngx_sprintf(p, ",\"pages\":{\"total\":%ui,\"free\":%ui,"
+                    "\"largest\":%ui},\"fails\":%ui,\"slots\":{",
+                    (ngx_uint_t) (sp->last - sp->pages), sp->pfree,
+                    ngx_slab_largest_free_locked(sp), sp->fails);
+
+    for (i = 0; i < n; i++) {
+        stat = &sp->stats[i];
+
+        p = ngx_sprintf(p, "%s\"%uz\":{\"total\":%ui,\"used\":%ui,"
+                        "\"reqs\":%ui,\"fails\":%ui}",
+                        i ? "," : "", (size_t) 1 << (i + sp->min_shift),
+                        stat->total, stat->used, stat->reqs, stat->fails);
+    }
+
+    ngx_shmtx_unlock(&sp->mutex);
+
+    *p++ = '}';
+    *p++ = '}';
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_status_counters(u_char *p, ngx_http_status_counters_t *sc)
+{
+    return ngx_sprintf(p, "\"requests\":%uA,\"received\":%uA,\"sent\":%uA,"
+                       "\"time\":%uA,\"responses\":{\"1xx\":%uA,\"2xx\":%uA,"
+                       "\"3xx\":%uA,\"4xx\":%uA,\"5xx\":%uA},"
+                       "\"latency\":{\"1\":%uA,\"5\":%uA,\"10\":%uA,"
+                       "\"50\":%uA,\"100\":%uA,\"500\":%uA,\"1000\":%uA,"
+                       "\"5000\":%uA,\"10000\":%uA,\"inf\":%uA}}",
+                       sc->requests, sc->received, sc->sent, sc->time,
+                       sc->responses[0], sc->responses[1], sc->responses[2],
+                       sc->responses[3], sc->responses[4],
+                       sc->latency[0], sc->latency[1], sc->latency[2],
+                       sc->latency[3], sc->latency[4], sc->latency[5],
+                       sc->latency[6], sc->latency[7], sc->latency[8],
+                       sc->latency[9]);
+}
+
+
+static ngx_int_t
+ngx_http_status_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_status_main_conf_t  *osmcf = data;
+
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = shm_zone->data;
+
+    if (osmcf) {
+        smcf->sh = osmcf->sh;
+        smcf->shpool = osmcf->shpool;
+
+        return NGX_OK;
+    }
+
+    smcf->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        smcf->sh = smcf->shpool->data;
+
+        return NGX_OK;
+    }
+
+    smcf->sh = ngx_slab_alloc(smcf->shpool, sizeof(ngx_http_status_shctx_t));
+    if (smcf->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(smcf->sh, sizeof(ngx_http_status_shctx_t));
+
+    smcf->shpool->data = smcf->sh;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_status_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_main_conf_t  *smcf;
+
+    smcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_status_main_conf_t));
+    if (smcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     smcf->shm_zone = NULL;
+     *     smcf->sh = NULL;
+     *     smcf->npeers = 0;
+     */
+
+    if (ngx_array_init(&smcf->servers, cf->pool, 4, sizeof(ngx_str_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&smcf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_status_upstream_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return smcf;
+}
+
+
+static void *
+ngx_http_status_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_status_srv_conf_t  *sscf;
+
+    sscf = ngx_palloc(cf->pool, sizeof(ngx_http_status_srv_conf_t));
+    if (sscf == NULL) {
+        return NULL;
+    }
+
+    sscf->index = NGX_CONF_UNSET_UINT;
+
+    return sscf;
+}
+
+
+static char *
+ngx_http_status_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_status_main_conf_t *smcf = conf;
+
+    ssize_t     size;
+    ngx_str_t  *value, name;
+
+    if (smcf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&name, "http_status");
+
+    smcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_status_module);
+    if (smcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    smcf->shm_zone->init = ngx_http_status_init_zone;
+    smcf->shm_zone->data = smcf;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_init(ngx_conf_t *cf)
+{
+    ngx_str_t                       *name;
+    ngx_uint_t                       i;
+    ngx_http_handler_pt             *h;
+    ngx_http_core_srv_conf_t       **cscfp;
+    ngx_http_status_upstream_t      *us;
+    ngx_http_status_srv_conf_t      *sscf;
+    ngx_http_core_main_conf_t       *cmcf;
+    ngx_http_status_main_conf_t     *smcf;
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_upstream_srv_conf_t   **uscfp;
+    ngx_http_upstream_main_conf_t   *umcf;
+
+    smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_status_module);
+
+    if (smcf->shm_zone == NULL) {
+        return NGX_OK;
+    }
+
+    cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
+
+    cscfp = cmcf->servers.elts;
+
+    for (i = 0; i < cmcf->servers.nelts; i++) {
+        sscf = cscfp[i]->ctx->srv_conf[ngx_http_status_module.ctx_index];
+        sscf->index = i;
+
+        name = ngx_array_push(&smcf->servers);
+        if (name == NULL) {
+            return NGX_ERROR;
+        }
+
+        *name = cscfp[i]->server_name;
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        /* all the standard balancers keep the round robin peers */
+
+        peers = uscfp[i]->peer.data;
+
+        if (peers == NULL) {
+            continue;
+        }
+
+        us = ngx_array_push(&smcf->upstreams);
+        if (us == NULL) {
+            return NGX_ERROR;
+        }
+
+        us->upstream = uscfp[i];
+        us->index = smcf->npeers;
+        us->npeers = 0;
+
+        for ( /* void */ ; peers; peers = peers->next) {
+            us->npeers += peers->number;
+        }
+
+        smcf->npeers += us->npeers;
+    }
+
+    smcf->worker_size = ngx_align((1 + smcf->servers.nelts + smcf->npeers)
+                                  * sizeof(ngx_http_status_counters_t),
+                                  NGX_CPU_CACHE_LINE);
+
+    h = ngx_array_push(&cmcf->phases[NGX_HTTP_LOG_PHASE].handlers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    *h = ngx_http_status_log_handler;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_init_module(ngx_cycle_t *cycle)
+{
+    u_char                       *counters, *old;
+    size_t                        size;
+    ngx_uint_t                    workers;
+    ngx_core_conf_t              *ccf;
+    ngx_http_status_shctx_t      *sh;
+    ngx_http_status_main_conf_t  *smcf;
+
+    if (ngx_http_cycle_get_module_main_conf(cycle, ngx_http_status_module)
+        == NULL)
+    {
+        return NGX_OK;
+    }
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_status_module);
+
+    sh = smcf->sh;
+
+    if (sh == NULL) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    workers = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+
+    if (sh->counters
+        && sh->workers == workers
+        && sh->nservers == smcf->servers.nelts
+        && sh->npeers == smcf->npeers
+        && sh->worker_size == smcf->worker_size)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the layout has been changed, so the counters are started anew;
+     * the old workers stop counting once they see the new generation
+     */
+
+    size = workers * smcf->worker_size;
+
+    counters = ngx_slab_alloc(smcf->shpool, size);
+
+    if (counters == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "\"status_zone\" is too small, %uz bytes are required",
+                      size);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(counters, size);
+
+    ngx_shmtx_lock(&smcf->shpool->mutex);
+
+    old = sh->counters;
+
+    sh->generation++;
+    sh->counters = counters;
+    sh->workers = workers;
+    sh->nservers = smcf->servers.nelts;
+    sh->npeers = smcf->npeers;
+    sh->worker_size = smcf->worker_size;
+
+    if (old) {
+        ngx_slab_free_locked(smcf->shpool, old);
+    }
+
+    ngx_shmtx_unlock(&smcf->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_status_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_status_shctx_t      *sh;
+    ngx_http_status_main_conf_t  *smcf;
+
+    ngx_http_status_worker = NULL;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_cycle_get_module_main_conf(cycle, ngx_http_status_module)
+        == NULL)
+    {
+        return NGX_OK;
+    }
+
+    smcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_status_module);
+
+    sh = smcf->sh;
+
+    if (sh == NULL || sh->counters == NULL || ngx_worker >= sh->workers) {
+        return NGX_OK;
+    }
+
+    ngx_http_status_worker = (ngx_http_status_counters_t *)
+                                 (sh->counters + ngx_worker * sh->worker_size);
+    ngx_http_status_generation = sh->generation;
+
+    return NGX_OK;
+}
@@ -86,7 +86,7 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     ngx_int_t          rc;
     ngx_buf_t         *b;
     ngx_chain_t        out;
-    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa;
+    ngx_atomic_int_t   ap, hn, ac, rq, rd, wr, wa, ec, es, ph, pm, pr;
 
     if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
         return NGX_HTTP_NOT_ALLOWED;
@@ -113,7 +113,10 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     size = sizeof("Active connections:  \n") + NGX_ATOMIC_T_LEN
            + sizeof("server accepts handled requests\n") - 1
            + 6 + 3 * NGX_ATOMIC_T_LEN
-           + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN;
+           + sizeof("Reading:  Writing:  Waiting:  \n") + 3 * NGX_ATOMIC_T_LEN
+           + sizeof("Event ctl:  saved:  \n") + 2 * NGX_ATOMIC_T_LEN
+           + sizeof("Pool cache hits:  misses:  retained:  \n")
+           + 3 * NGX_ATOMIC_T_LEN;
 
     b = ngx_create_temp_buf(r->pool, size);
     if (b == NULL) {
@@ -130,6 +133,11 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     rd = *ngx_stat_reading;
     wr = *ngx_stat_writing;
     wa = *ngx_stat_waiting;
+    ec = *ngx_stat_event_ctl;
+    es = *ngx_stat_event_ctl_saved;
+    ph = *ngx_stat_pool_hits;
+    pm = *ngx_stat_pool_misses;
+    pr = *ngx_stat_pool_retained;
 
     b->last = ngx_sprintf(b->last, "Active connections: %uA \n", ac);
 
@@ -141,6 +149,12 @@ static ngx_int_t ngx_http_status_handler(ngx_http_request_t *r)
     b->last = ngx_sprintf(b->last, "Reading: %uA Writing: %uA Waiting: %uA \n",
                           rd, wr, wa);
 
+    b->last = ngx_sprintf(b->last, "Event ctl: %uA saved: %uA \n", ec, es);
+
+    b->last = ngx_sprintf(b->last,
+                          "Pool cache hits: %uA misses: %uA retained: %uA \n",
+                          ph, pm, pr);
+
     r->headers_out.status = NGX_HTTP_OK;
     r->headers_out.content_length_n = b->last - b->pos;
 
@@ -0,0 +1,834 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_TCP     0
+#define NGX_HTTP_UPSTREAM_HC_HTTP    1
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER  4096
+
+
+typedef struct {
+    ngx_http_upstream_srv_conf_t    *upstream;
+    ngx_shm_zone_t                  *shm_zone;
+
+    ngx_msec_t                       interval;
+    ngx_msec_t                       timeout;
+    ngx_uint_t                       fails;
+    ngx_uint_t                       passes;
+
+    ngx_uint_t                       type;
+    ngx_str_t                        uri;
+    ngx_uint_t                       status;
+    ngx_str_t                        body;
+
+    ngx_str_t                        request;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct ngx_http_upstream_hc_shctx_s  ngx_http_upstream_hc_shctx_t;
+
+struct ngx_http_upstream_hc_shctx_s {
+    ngx_http_upstream_hc_shctx_t    *previous;
+    ngx_uint_t                       number;
+    ngx_http_upstream_rr_health_t    peer[1];
+};
+
+
+typedef struct {
+    ngx_http_upstream_hc_srv_conf_t *conf;
+    ngx_http_upstream_rr_peers_t    *peers;
+    ngx_http_upstream_rr_peer_t     *peer;
+
+    ngx_peer_connection_t            pc;
+    ngx_event_t                      event;
+
+    u_char                          *sent;
+    ngx_buf_t                       *buffer;
+} ngx_http_upstream_hc_peer_t;
+
+
+static void ngx_http_upstream_hc_start(ngx_event_t *ev);
+static void ngx_http_upstream_hc_send_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_done(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t ok);
+static ngx_int_t ngx_http_upstream_hc_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static void *ngx_http_upstream_hc_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_health_check(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_upstream_hc_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_health_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_health_check,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_health_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_init,             /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_health_check_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_health_check_module_ctx, /* module context */
+    ngx_http_upstream_health_check_commands,    /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_process,     /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_http_upstream_hc_start(ngx_event_t *ev)
+{
+    ngx_int_t                     rc;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    hp = ev->data;
+
+    if (hp->pc.connection) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "health check of %V in upstream \"%V\" timed out",
+                      &hp->peer->name, &hp->conf->upstream->host);
+
+        ngx_http_upstream_hc_done(hp, 0);
+        return;
+    }
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_http_upstream_rr_peers_lock(hp->peers);
+
+    if (hp->peer->removed) {
+
+        /* a free slot of an upstream zone */
+
+        ngx_http_upstream_rr_peers_unlock(hp->peers);
+
+        ngx_add_timer(&hp->event, hp->conf->interval);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "health check start: %V", &hp->peer->name);
+
+    hp->pc.sockaddr = hp->peer->sockaddr;
+    hp->pc.socklen = hp->peer->socklen;
+    hp->pc.name = &hp->peer->name;
+
+    ngx_http_upstream_rr_peers_unlock(hp->peers);
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = ev->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        hp->pc.connection = NULL;
+        ngx_http_upstream_hc_done(hp, 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->read->handler = ngx_http_upstream_hc_recv_handler;
+    c->write->handler = ngx_http_upstream_hc_send_handler;
+
+    hp->sent = hp->conf->request.data;
+    hp->buffer->pos = hp->buffer->start;
+    hp->buffer->last = hp->buffer->start;
+
+    ngx_add_timer(&hp->event, hp->conf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hc_send_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_send_handler(ngx_event_t *wev)
+{
+    int                           err;
+    ssize_t                       n;
+    socklen_t                     len;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    if (hp->sent == hp->conf->request.data) {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            ngx_http_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        if (hp->conf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+            ngx_http_upstream_hc_done(hp, 1);
+            return;
+        }
+    }
+
+    while (hp->sent < hp->conf->request.data + hp->conf->request.len) {
+
+        n = c->send(c, hp->sent,
+                    hp->conf->request.data + hp->conf->request.len - hp->sent);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_done(hp, 0);
+            }
+
+            return;
+        }
+
+        hp->sent += n;
+    }
+
+    wev->handler = ngx_http_upstream_hc_send_handler;
+
+    if (c->read->ready) {
+        ngx_http_upstream_hc_recv_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_recv_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (hp->conf->type == NGX_HTTP_UPSTREAM_HC_TCP
+        || hp->sent < hp->conf->request.data + hp->conf->request.len)
+    {
+        /* the connection is tested on the write event */
+        return;
+    }
+
+    b = hp->buffer;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            ngx_http_upstream_hc_done(hp, ngx_http_upstream_hc_parse(hp)
+                                          == NGX_OK);
+            return;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_done(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_done(hp, 0);
+            return;
+        }
+
+        if (n == 0) {
+            ngx_http_upstream_hc_done(hp, ngx_http_upstream_hc_parse(hp)
+                                          == NGX_OK);
+            return;
+        }
+
+        b->last += n;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_parse(ngx_http_upstream_hc_peer_t *hp)
+{
+    u_char     *p, *last;
+    ngx_int_t   status;
+    ngx_buf_t  *b;
+
+    b = hp->buffer;
+    p = b->pos;
+    last = b->last;
+
+    if (last - p < (ssize_t) sizeof("HTTP/1.x 200") - 1
+        || ngx_strncmp(p, "HTTP/", sizeof("HTTP/") - 1) != 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.connection->log, 0,
+                      "health check of %V in upstream \"%V\": "
+                      "invalid response",
+                      &hp->peer->name, &hp->conf->upstream->host);
+        return NGX_ERROR;
+    }
+
+    p = ngx_strlchr(p, last, ' ');
+
+    if (p == NULL || last - p < 4) {
+        status = NGX_ERROR;
+
+    } else {
+        status = ngx_atoi(p + 1, 3);
+    }
+
+    if (status == NGX_ERROR) {
+        hp->peer->health->status = 0;
+
+        ngx_log_error(NGX_LOG_ERR, hp->pc.connection->log, 0,
+                      "health check of %V in upstream \"%V\": "
+                      "invalid status line",
+                      &hp->peer->name, &hp->conf->upstream->host);
+        return NGX_ERROR;
+    }
+
+    hp->peer->health->status = status;
+
+    if (hp->conf->status ? (ngx_uint_t) status != hp->conf->status
+                         : (status < 200 || status >= 400))
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.connection->log, 0,
+                      "health check of %V in upstream \"%V\": "
+                      "unexpected status %i",
+                      &hp->peer->name, &hp->conf->upstream->host, status);
+        return NGX_ERROR;
+    }
+
+    if (hp->conf->body.len == 0) {
+        return NGX_OK;
+    }
+
+    p = ngx_strnstr(b->pos, "\r\n\r\n", last - b->pos);
+
+    if (p == NULL
+        || ngx_strnstr(p + 4, (char *) hp->conf->body.data, last - p - 4)
+           == NULL)
+    {
+        ngx_log_error(NGX_LOG_ERR, hp->pc.connection->log, 0,
+                      "health check of %V in upstream \"%V\": "
+                      "body does not match",
+                      &hp->peer->name, &hp->conf->upstream->host);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hc_done(ngx_http_upstream_hc_peer_t *hp, ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_health_t  *health;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    if (hp->event.timer_set) {
+        ngx_del_timer(&hp->event);
+    }
+
+    health = hp->peer->health;
+
+    health->checked = ngx_time();
+
+    if (ok) {
+        health->fails = 0;
+        health->passes++;
+
+        if (health->down && health->passes >= hp->conf->passes) {
+            health->down = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, hp->event.log, 0,
+                          "peer %V in upstream \"%V\" is up",
+                          &hp->peer->name, &hp->conf->upstream->host);
+        }
+
+    } else {
+        health->passes = 0;
+        health->fails++;
+
+        if (!health->down && health->fails >= hp->conf->fails) {
+            health->down = 1;
+
+            ngx_log_error(NGX_LOG_WARN, hp->event.log, 0,
+                          "peer %V in upstream \"%V\" is down",
+                          &hp->peer->name, &hp->conf->upstream->host);
+        }
+    }
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(&hp->event, hp->conf->interval);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_upstream_hc_srv_conf_t  *ohccf = data;
+
+    ngx_uint_t                        i, n;
+    ngx_slab_pool_t                  *shpool;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_shctx_t     *sh, *osh;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    hccf = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    n = 0;
+
+    for (peers = hccf->upstream->peer.data; peers; peers = peers->next) {
+        n += peers->number;
+    }
+
+    if (ohccf || shm_zone->shm.exists) {
+        osh = shpool->data;
+
+    } else {
+        osh = NULL;
+    }
+
+    sh = osh;
+
+    if (sh == NULL || sh->number != n) {
+
+        /*
+         * the peers have been changed, the state is started anew;
+         * the old state is left to the old worker processes, and
+         * the state before it, which no running cycle uses, is freed
+         */
+
+        if (osh && osh->previous) {
+            ngx_slab_free(shpool, osh->previous);
+            osh->previous = NULL;
+        }
+
+        sh = ngx_slab_alloc(shpool, sizeof(ngx_http_upstream_hc_shctx_t)
+                                    + (n - 1)
+                                      * sizeof(ngx_http_upstream_rr_health_t));
+        if (sh == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "could not allocate the health check state "
+                          "of upstream \"%V\"", &hccf->upstream->host);
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(sh, sizeof(ngx_http_upstream_hc_shctx_t)
+                        + (n - 1) * sizeof(ngx_http_upstream_rr_health_t));
+
+        sh->previous = osh;
+        sh->number = n;
+
+        shpool->data = sh;
+    }
+
+    i = 0;
+
+    for (peers = hccf->upstream->peer.data; peers; peers = peers->next) {
+        for (n = 0; n < peers->number; n++) {
+            peers->peer[n].health = &sh->peer[i++];
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->upstream = NULL;
+     *     conf->shm_zone = NULL;
+     *     conf->uri = { 0, NULL };
+     *     conf->status = 0;
+     *     conf->body = { 0, NULL };
+     *     conf->request = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_health_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hccf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (hccf->upstream) {
+        return "is duplicate";
+    }
+
+    hccf->upstream = ngx_http_conf_get_module_srv_conf(cf,
+                                                       ngx_http_upstream_module);
+
+    hccf->interval = 5000;
+    hccf->timeout = 1000;
+    hccf->fails = 1;
+    hccf->passes = 1;
+    hccf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+    ngx_str_set(&hccf->uri, "/");
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hccf->interval = ngx_parse_time(&s, 0);
+            if (hccf->interval == (ngx_msec_t) NGX_ERROR
+                || hccf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hccf->timeout = ngx_parse_time(&s, 0);
+            if (hccf->timeout == (ngx_msec_t) NGX_ERROR
+                || hccf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hccf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hccf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            hccf->uri.len = value[i].len - 4;
+            hccf->uri.data = &value[i].data[4];
+
+            if (hccf->uri.len == 0 || hccf->uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "status=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n < 100 || n > 599) {
+                goto invalid;
+            }
+
+            hccf->status = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "body=", 5) == 0) {
+
+            hccf->body.len = value[i].len - 5;
+            hccf->body.data = &value[i].data[5];
+
+            if (hccf->body.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init(ngx_conf_t *cf)
+{
+    size_t                            size;
+    ngx_str_t                         name;
+    ngx_uint_t                        i, n;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hccf->upstream == NULL) {
+            continue;
+        }
+
+        /* all the standard balancers keep the round robin peers */
+
+        if (uscfp[i]->peer.data == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health_check is not supported "
+                          "in upstream \"%V\" in %s:%ui",
+                          &uscfp[i]->host, uscfp[i]->file_name,
+                          uscfp[i]->line);
+            return NGX_ERROR;
+        }
+
+        n = 0;
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            n += peers->number;
+        }
+
+        name.len = sizeof("health_check:") - 1 + uscfp[i]->host.len;
+
+        name.data = ngx_pnalloc(cf->pool, name.len);
+        if (name.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(name.data, "health_check:%V", &uscfp[i]->host);
+
+        /* the old state is kept while the peers are changed on reload */
+
+        size = 8 * ngx_pagesize
+               + 2 * ngx_align(n * sizeof(ngx_http_upstream_rr_health_t),
+                               ngx_pagesize);
+
+        hccf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                        &ngx_http_upstream_health_check_module);
+        if (hccf->shm_zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        hccf->shm_zone->init = ngx_http_upstream_hc_init_zone;
+        hccf->shm_zone->data = hccf;
+
+        if (hccf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+            continue;
+        }
+
+        hccf->request.len = sizeof("GET  HTTP/1.0" CRLF "Host: " CRLF
+                                   "Connection: close" CRLF CRLF) - 1
+                            + hccf->uri.len + uscfp[i]->host.len;
+
+        hccf->request.data = ngx_pnalloc(cf->pool, hccf->request.len);
+        if (hccf->request.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_sprintf(hccf->request.data, "GET %V HTTP/1.0" CRLF "Host: %V" CRLF
+                    "Connection: close" CRLF CRLF,
+                    &hccf->uri, &uscfp[i]->host);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i, n;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_peer_t      *hp;
+    ngx_http_upstream_srv_conf_t    **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hccf;
+
+    /* the checks are run by the first worker only */
+
+    if (!(ngx_process == NGX_PROCESS_WORKER && ngx_worker == 0)
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        hccf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                        ngx_http_upstream_health_check_module);
+
+        if (hccf->upstream == NULL) {
+            continue;
+        }
+
+        for (peers = uscfp[i]->peer.data; peers; peers = peers->next) {
+            for (n = 0; n < peers->number; n++) {
+
+                hp = ngx_pcalloc(cycle->pool,
+                                 sizeof(ngx_http_upstream_hc_peer_t));
+                if (hp == NULL) {
+                    return NGX_ERROR;
+                }
+
+                hp->conf = hccf;
+                hp->peers = peers;
+                hp->peer = &peers->peer[n];
+
+                hp->buffer = ngx_create_temp_buf(cycle->pool,
+                                                 NGX_HTTP_UPSTREAM_HC_BUFFER);
+                if (hp->buffer == NULL) {
+                    return NGX_ERROR;
+                }
+
+                hp->event.handler = ngx_http_upstream_hc_start;
+                hp->event.data = hp;
+                hp->event.log = cycle->log;
+                hp->event.cancelable = 1;
+
+                ngx_add_timer(&hp->event, 1);
+            }
+        }
+    }
+
+    return NGX_OK;
+}
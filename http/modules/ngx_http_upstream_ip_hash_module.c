@@ -172,6 +172,8 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     hash = iphp->hash;
 
+    ngx_http_upstream_rr_peers_lock(iphp->rrp.peers);
+
     for ( ;; ) {
 
         for (i = 0; i < iphp->addrlen; i++) {
@@ -204,9 +206,7 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
             peer = &iphp->rrp.peers->peer[p];
 
-            /* ngx_lock_mutex(iphp->rrp.peers->mutex); */
-
-            if (!peer->down) {
+            if (!ngx_http_upstream_rr_peer_down(peer)) {
 
                 if (peer->max_fails == 0 || peer->fails < peer->max_fails) {
                     break;
@@ -220,12 +220,11 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
 
             iphp->rrp.tried[n] |= m;
 
-            /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
-
             pc->tries--;
         }
 
         if (++iphp->tries >= 20) {
+            ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
             return iphp->get_rr_peer(pc, &iphp->rrp);
         }
     }
@@ -236,7 +235,9 @@ ngx_http_upstream_get_ip_hash_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(iphp->rrp.peers->mutex); */
+    peer->refs++;
+
+    ngx_http_upstream_rr_peers_unlock(iphp->rrp.peers);
 
     iphp->rrp.tried[n] |= m;
     iphp->hash = hash;
@@ -180,6 +180,8 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
     peers = lcp->rrp.peers;
 
+    ngx_http_upstream_rr_peers_lock(peers);
+
     best = NULL;
     total = 0;
 
@@ -199,7 +201,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
         peer = &peers->peer[i];
 
-        if (peer->down) {
+        if (ngx_http_upstream_rr_peer_down(peer)) {
             continue;
         }
 
@@ -252,7 +254,7 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
 
             peer = &peers->peer[i];
 
-            if (peer->down) {
+            if (ngx_http_upstream_rr_peer_down(peer)) {
                 continue;
             }
 
@@ -291,6 +293,8 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = best->socklen;
     pc->name = &best->name;
 
+    best->refs++;
+
     lcp->rrp.current = p;
 
     n = p / (8 * sizeof(uintptr_t));
@@ -299,6 +303,8 @@ ngx_http_upstream_get_least_conn_peer(ngx_peer_connection_t *pc, void *data)
     lcp->rrp.tried[n] |= m;
     lcp->conns[p]++;
 
+    ngx_http_upstream_rr_peers_unlock(peers);
+
     if (pc->tries == 1 && peers->next) {
         pc->tries += peers->next->number;
     }
@@ -311,6 +317,8 @@ failed:
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                        "get least conn peer, backup servers");
 
+        ngx_http_upstream_rr_peers_unlock(peers);
+
         lcp->conns += peers->number;
 
         lcp->rrp.peers = peers->next;
@@ -328,6 +336,8 @@ failed:
         if (rc != NGX_BUSY) {
             return rc;
         }
+
+        ngx_http_upstream_rr_peers_lock(peers);
     }
 
     /* all peers failed, mark them as live for quick recovery */
@@ -336,6 +346,8 @@ failed:
         peers->peer[i].fails = 0;
     }
 
+    ngx_http_upstream_rr_peers_unlock(peers);
+
     pc->name = peers->name;
 
     return NGX_BUSY;
@@ -0,0 +1,530 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_RANDOM_ONE         0
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN  1
+#define NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME  2
+
+
+typedef struct {
+    ngx_uint_t                          method;
+
+    /* the cumulative weights of the peers, local to a process */
+    ngx_uint_t                         *ranges;
+    ngx_uint_t                          config;
+} ngx_http_upstream_random_srv_conf_t;
+
+
+typedef struct {
+    /* the round robin data must be first */
+    ngx_http_upstream_rr_peer_data_t    rrp;
+
+    ngx_http_upstream_random_srv_conf_t *conf;
+    ngx_http_request_t                 *request;
+    ngx_uint_t                          counted;  /* unsigned  counted:1; */
+
+    ngx_event_get_peer_pt               get_rr_peer;
+    ngx_event_free_peer_pt              free_rr_peer;
+} ngx_http_upstream_random_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_random(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static void ngx_http_upstream_update_random(
+    ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_int_t ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc,
+    void *data);
+static ngx_uint_t ngx_http_upstream_peek_random_peer(
+    ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_uint_t ngx_http_upstream_random_usable(
+    ngx_http_upstream_random_peer_data_t *rp, ngx_uint_t i, time_t now);
+static ngx_uint_t ngx_http_upstream_random_better(ngx_uint_t method,
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_rr_peer_t *other);
+static void ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_random_commands[] = {
+
+    { ngx_string("random"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_random,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_random_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_random_create_conf,  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_random_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_random_module_ctx,  /* module context */
+    ngx_http_upstream_random_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_init_random(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_random_srv_conf_t  *rcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0, "init random");
+
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_random_peer;
+
+    peers = us->peer.data;
+
+    rcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_random_module);
+
+    rcf->ranges = ngx_palloc(cf->pool, sizeof(ngx_uint_t) * peers->number);
+    if (rcf->ranges == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_upstream_update_random(rcf, peers);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_update_random(ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t  i, total;
+
+    total = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        total += peers->peer[i].weight;
+        rcf->ranges[i] = total;
+    }
+
+    rcf->config = peers->config;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_random_peer_data_t  *rp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init random peer");
+
+    rp = ngx_palloc(r->pool, sizeof(ngx_http_upstream_random_peer_data_t));
+    if (rp == NULL) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.data = &rp->rrp;
+
+    if (ngx_http_upstream_init_round_robin_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_random_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_random_peer;
+
+    rp->conf = ngx_http_conf_upstream_srv_conf(us,
+                                             ngx_http_upstream_random_module);
+    rp->request = r;
+    rp->counted = 0;
+
+    rp->get_rr_peer = ngx_http_upstream_get_round_robin_peer;
+    rp->free_rr_peer = ngx_http_upstream_free_round_robin_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    time_t                                now;
+    uintptr_t                             m;
+    ngx_uint_t                            i, j, n, tries;
+    ngx_http_upstream_rr_peer_t          *peer;
+    ngx_http_upstream_rr_peers_t         *peers;
+    ngx_http_upstream_random_srv_conf_t  *rcf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get random peer, try: %ui", pc->tries);
+
+    peers = rp->rrp.peers;
+
+    if (peers->single) {
+        return rp->get_rr_peer(pc, &rp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    now = ngx_time();
+
+    rcf = rp->conf;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    if (rcf->config != peers->config) {
+        ngx_http_upstream_update_random(rcf, peers);
+    }
+
+    tries = 0;
+
+    for ( ;; ) {
+        i = ngx_http_upstream_peek_random_peer(rcf, peers);
+
+        if (ngx_http_upstream_random_usable(rp, i, now)) {
+            break;
+        }
+
+        if (++tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(peers);
+            return rp->get_rr_peer(pc, &rp->rrp);
+        }
+    }
+
+    if (rcf->method != NGX_HTTP_UPSTREAM_RANDOM_ONE) {
+
+        /*
+         * the power of two choices: the second peer is sampled
+         * the same way, and the less loaded of the two is used
+         */
+
+        for ( ;; ) {
+            j = ngx_http_upstream_peek_random_peer(rcf, peers);
+
+            if (j != i && ngx_http_upstream_random_usable(rp, j, now)) {
+
+                if (ngx_http_upstream_random_better(rcf->method,
+                                                    &peers->peer[j],
+                                                    &peers->peer[i]))
+                {
+                    n = i;
+                    i = j;
+                    j = n;
+                }
+
+                /*
+                 * the response time of the peer not chosen decays,
+                 * so a peer penalized by a slow response is probed again
+                 */
+
+                if (rcf->method == NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME) {
+                    peer = &peers->peer[j];
+                    peer->response_time -= (peer->response_time + 7) / 8;
+                }
+
+                break;
+            }
+
+            if (++tries > 20) {
+                break;
+            }
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get random peer, peer:%ui", i);
+
+    peer = &peers->peer[i];
+
+    rp->rrp.current = i;
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->refs++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    peer->conns++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    rp->counted = 1;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    rp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_peek_random_peer(ngx_http_upstream_random_srv_conf_t *rcf,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t  i, j, k, x;
+
+    if (peers->total_weight == 0) {
+        return 0;
+    }
+
+    x = ngx_random() % peers->total_weight;
+
+    i = 0;
+    j = peers->number;
+
+    while (j - i > 1) {
+        k = (i + j) / 2;
+
+        if (x < rcf->ranges[k - 1]) {
+            j = k;
+
+        } else {
+            i = k;
+        }
+    }
+
+    return i;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_random_usable(ngx_http_upstream_random_peer_data_t *rp,
+    ngx_uint_t i, time_t now)
+{
+    uintptr_t                     m;
+    ngx_uint_t                    n;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    n = i / (8 * sizeof(uintptr_t));
+    m = (uintptr_t) 1 << i % (8 * sizeof(uintptr_t));
+
+    if (rp->rrp.tried[n] & m) {
+        return 0;
+    }
+
+    peer = &rp->rrp.peers->peer[i];
+
+    if (ngx_http_upstream_rr_peer_down(peer)) {
+        return 0;
+    }
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_random_better(ngx_uint_t method,
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_rr_peer_t *other)
+{
+    uint64_t  a, b;
+
+    /*
+     * least_time scores a peer as (conns + 1) * response_time / weight,
+     * the peers with equal scores, e.g. without a response time yet,
+     * are compared by conns only
+     */
+
+    if (method == NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME) {
+        a = (uint64_t) (peer->conns + 1) * peer->response_time
+            * other->weight;
+        b = (uint64_t) (other->conns + 1) * other->response_time
+            * peer->weight;
+
+        if (a != b) {
+            return a < b;
+        }
+    }
+
+    return peer->conns * other->weight < other->conns * peer->weight;
+}
+
+
+static void
+ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    ngx_msec_t                     ms;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random peer %ui %ui", pc->tries, state);
+
+    if (rp->counted) {
+        peers = rp->rrp.peers;
+        peer = &peers->peer[rp->rrp.current];
+
+        u = rp->request->upstream;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        peer->conns--;
+
+        /*
+         * the response time is set by ngx_http_upstream_finalize_request()
+         * just before the peer is freed with the zero state
+         */
+
+        if (state == 0
+            && rp->conf->method == NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME
+            && u->state)
+        {
+            ms = (ngx_msec_t) (u->state->response_sec * 1000
+                               + u->state->response_msec) * 1000;
+
+            if (peer->response_time == 0) {
+                peer->response_time = ms;
+
+            } else {
+                peer->response_time = (peer->response_time * 7 + ms) / 8;
+            }
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                           "free random peer, response time: %Mus, ewma: %Mus",
+                           ms, peer->response_time);
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        rp->counted = 0;
+    }
+
+    rp->free_rr_peer(pc, &rp->rrp, state);
+}
+
+
+static void *
+ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_random_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_random_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->method = NGX_HTTP_UPSTREAM_RANDOM_ONE;
+     *     conf->ranges = NULL;
+     *     conf->config = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_random_srv_conf_t  *rcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+    }
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_random;
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    if (cf->args->nelts == 1) {
+        return NGX_CONF_OK;
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "two") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    rcf->method = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
+
+    if (cf->args->nelts == 2) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        rcf->method = NGX_HTTP_UPSTREAM_RANDOM_LEAST_CONN;
+
+    } else if (ngx_strcmp(value[2].data, "least_time") == 0) {
+        rcf->method = NGX_HTTP_UPSTREAM_RANDOM_LEAST_TIME;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
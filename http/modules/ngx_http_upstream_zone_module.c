@@ -0,0 +1,1029 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_CONF_SERVER_LEN                                    \
+    (sizeof("server  weight= max_fails= fail_timeout=s drain backup; # id="  \
+            CRLF) - 1 + NGX_SOCKADDR_STRLEN + 4 * NGX_INT_T_LEN)
+
+
+typedef struct {
+    ngx_str_t                        state;
+    ngx_uint_t                       nservers;
+} ngx_http_upstream_zone_srv_conf_t;
+
+
+static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
+    ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peers_t *peers);
+static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_str_t *msg);
+static ngx_int_t ngx_http_upstream_conf_modify(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    ngx_str_t *msg);
+static ngx_int_t ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_uint_t ngx_http_upstream_conf_local(ngx_connection_t *c);
+static u_char *ngx_http_upstream_conf_server(u_char *p,
+    ngx_http_upstream_rr_peer_t *peer, ngx_uint_t backup, ngx_int_t id);
+static u_char *ngx_http_upstream_zone_state(u_char *p,
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_int_t ngx_http_upstream_zone_save(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *state);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_uint_t status, ngx_str_t *msg);
+
+static void *ngx_http_upstream_zone_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_state(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_zone_init(ngx_conf_t *cf);
+
+
+static ngx_command_t  ngx_http_upstream_zone_commands[] = {
+
+    { ngx_string("zone"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE2,
+      ngx_http_upstream_zone,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("state"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_state,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_zone_init,           /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_zone_create_conf,    /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_zone_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_zone_module_ctx,    /* module context */
+    ngx_http_upstream_zone_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_rr_peers_t *peers)
+{
+    size_t                          size;
+    ngx_uint_t                      i;
+    ngx_http_upstream_rr_addr_t    *addr;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peers_t   *shpeers;
+
+    size = sizeof(ngx_http_upstream_rr_peers_t)
+           + sizeof(ngx_http_upstream_rr_peer_t) * (peers->number - 1);
+
+    shpeers = ngx_slab_alloc(shpool, size
+                             + sizeof(ngx_http_upstream_rr_addr_t)
+                               * peers->number);
+    if (shpeers == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(shpeers, peers, size);
+
+    addr = (ngx_http_upstream_rr_addr_t *) ((u_char *) shpeers + size);
+
+    for (i = 0; i < shpeers->number; i++) {
+        peer = &shpeers->peer[i];
+
+        if (peer->sockaddr) {
+            ngx_memcpy(addr[i].sockaddr, peer->sockaddr, peer->socklen);
+
+            peer->name.len = ngx_min(peer->name.len, NGX_SOCKADDR_STRLEN);
+            ngx_memcpy(addr[i].name, peer->name.data, peer->name.len);
+        }
+
+        peer->sockaddr = (struct sockaddr *) addr[i].sockaddr;
+        peer->name.data = addr[i].name;
+    }
+
+    shpeers->shpool = shpool;
+    shpeers->next = NULL;
+
+    return shpeers;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                          len;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_upstream_rr_peers_t   *peers, *shpeers;
+    ngx_http_upstream_srv_conf_t   *uscf;
+
+    uscf = shm_zone->data;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        uscf->peer.data = shpool->data;
+        return NGX_OK;
+    }
+
+    /* the zone is not reused, the peers are copied on each reconfiguration */
+
+    peers = uscf->peer.data;
+
+    shpeers = ngx_http_upstream_zone_copy_peers(shpool, peers);
+    if (shpeers == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (peers->next) {
+        shpeers->next = ngx_http_upstream_zone_copy_peers(shpool, peers->next);
+        if (shpeers->next == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    len = sizeof(" in upstream zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in upstream zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->data = shpeers;
+
+    uscf->peer.data = shpeers;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    u_char                             *p;
+    ngx_int_t                           rc, id;
+    ngx_str_t                           name, value, msg;
+    ngx_uint_t                          i, j, n, backup;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers, *list;
+    ngx_http_upstream_srv_conf_t       *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_zone_srv_conf_t  *zscf;
+
+    if (!ngx_http_upstream_conf_local(r->connection)) {
+        return NGX_HTTP_FORBIDDEN;
+    }
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &name) != NGX_OK) {
+        ngx_str_set(&msg, "upstream is not specified");
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST, &msg);
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscf = NULL;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        if (uscfp[i]->shm_zone
+            && uscfp[i]->host.len == name.len
+            && ngx_strncasecmp(uscfp[i]->host.data, name.data, name.len) == 0)
+        {
+            uscf = uscfp[i];
+            break;
+        }
+    }
+
+    if (uscf == NULL) {
+        ngx_str_set(&msg, "upstream not found");
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_FOUND, &msg);
+    }
+
+    zscf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_zone_module);
+
+    peers = uscf->peer.data;
+
+    if (ngx_http_arg(r, (u_char *) "id", 2, &value) != NGX_OK
+        && ngx_http_arg(r, (u_char *) "add", 3, &value) != NGX_OK)
+    {
+        /* the list of the servers */
+
+        n = peers->number + (peers->next ? peers->next->number : 0);
+
+        p = ngx_pnalloc(r->pool, n * NGX_HTTP_UPSTREAM_CONF_SERVER_LEN);
+        if (p == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        msg.data = p;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+
+        id = 0;
+
+        for (list = peers, backup = 0; list; list = list->next, backup = 1) {
+            for (i = 0; i < list->number; i++, id++) {
+                if (!list->peer[i].removed) {
+                    p = ngx_http_upstream_conf_server(p, &list->peer[i],
+                                                      backup, id);
+                }
+            }
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        msg.len = p - msg.data;
+
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_OK, &msg);
+    }
+
+    /* the servers are changed by POST requests only */
+
+    if (r->method != NGX_HTTP_POST) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    if (ngx_http_arg(r, (u_char *) "add", 3, &value) == NGX_OK) {
+        rc = ngx_http_upstream_conf_add(r, peers, &msg);
+        goto done;
+    }
+
+    id = ngx_atoi(value.data, value.len);
+
+    j = id;
+    backup = 0;
+
+    if (id != NGX_ERROR && j >= peers->number && peers->next) {
+        j -= peers->number;
+        peers = peers->next;
+        backup = 1;
+    }
+
+    if (id == NGX_ERROR || j >= peers->number || peers->peer[j].removed) {
+        ngx_str_set(&msg, "server not found");
+        rc = NGX_HTTP_NOT_FOUND;
+        goto done;
+    }
+
+    peer = &peers->peer[j];
+
+    if (ngx_http_arg(r, (u_char *) "remove", 6, &value) == NGX_OK) {
+
+        if (!backup) {
+            for (i = 0; i < peers->number; i++) {
+                if (&peers->peer[i] != peer && !peers->peer[i].removed) {
+                    break;
+                }
+            }
+
+            if (i == peers->number) {
+                ngx_str_set(&msg, "the last server cannot be removed");
+                rc = NGX_HTTP_BAD_REQUEST;
+                goto done;
+            }
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "server %V removed from upstream \"%V\"",
+                      &peer->name, &uscf->host);
+
+        /*
+         * the slot and the address are kept until the slot is taken
+         * by a new server, which is not done while requests refer to them
+         */
+
+        peers->total_weight -= peer->weight;
+        peers->config++;
+
+        peer->weight = 0;
+        peer->effective_weight = 0;
+        peer->down = 1;
+        peer->drain = 0;
+        peer->removed = 1;
+
+        ngx_str_null(&msg);
+        rc = NGX_HTTP_OK;
+
+        goto done;
+    }
+
+    rc = ngx_http_upstream_conf_modify(r, peers, peer, &msg);
+
+    if (rc == NGX_HTTP_OK) {
+        p = ngx_pnalloc(r->pool, NGX_HTTP_UPSTREAM_CONF_SERVER_LEN);
+        if (p == NULL) {
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            goto done;
+        }
+
+        msg.data = p;
+        msg.len = ngx_http_upstream_conf_server(p, peer, backup, id) - p;
+    }
+
+done:
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (rc == NGX_HTTP_OK && zscf->state.data) {
+        if (ngx_http_upstream_zone_save(r, uscf, &zscf->state) != NGX_OK) {
+            ngx_str_set(&msg, "the state file is not saved");
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return ngx_http_upstream_conf_send(r, rc, &msg);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_str_t *msg)
+{
+    u_char                       *p, *src;
+    ngx_str_t                     value;
+    ngx_url_t                     u;
+    ngx_uint_t                    i, n;
+    ngx_http_upstream_rr_peer_t  *peer, tmp;
+
+    if (ngx_http_arg(r, (u_char *) "backup", 6, &value) == NGX_OK) {
+        ngx_str_set(msg, "backup servers cannot be added");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "server", 6, &value) != NGX_OK) {
+        ngx_str_set(msg, "server is not specified");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    p = ngx_pnalloc(r->pool, value.len);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    src = value.data;
+    u.url.data = p;
+
+    ngx_unescape_uri(&p, &src, value.len, 0);
+
+    u.url.len = p - u.url.data;
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(r->pool, &u) != NGX_OK || u.naddrs != 1) {
+        ngx_str_set(msg, "invalid server address");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_memzero(&tmp, sizeof(ngx_http_upstream_rr_peer_t));
+
+    tmp.weight = 1;
+    tmp.max_fails = 1;
+    tmp.fail_timeout = 10;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        ngx_str_set(msg, "invalid server parameters");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    n = peers->number;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->removed) {
+            if (n == peers->number && peer->refs == 0) {
+                n = i;
+            }
+
+            continue;
+        }
+
+        if (peer->name.len == u.addrs[0].name.len
+            && ngx_strncmp(peer->name.data, u.addrs[0].name.data,
+                           peer->name.len)
+               == 0)
+        {
+            ngx_str_set(msg, "server already exists");
+            return NGX_HTTP_CONFLICT;
+        }
+    }
+
+    if (n == peers->number) {
+        ngx_str_set(msg, "no free slots in the zone");
+        return NGX_HTTP_INSUFFICIENT_STORAGE;
+    }
+
+    peer = &peers->peer[n];
+
+    ngx_memcpy(peer->sockaddr, u.addrs[0].sockaddr, u.addrs[0].socklen);
+    peer->socklen = u.addrs[0].socklen;
+
+    peer->name.len = ngx_min(u.addrs[0].name.len, NGX_SOCKADDR_STRLEN);
+    ngx_memcpy(peer->name.data, u.addrs[0].name.data, peer->name.len);
+
+    peer->weight = tmp.weight;
+    peer->effective_weight = tmp.weight;
+    peer->current_weight = 0;
+    peer->max_fails = tmp.max_fails;
+    peer->fail_timeout = tmp.fail_timeout;
+    peer->fails = 0;
+    peer->accessed = 0;
+    peer->checked = 0;
+    peer->down = tmp.down;
+    peer->drain = 0;
+    peer->response_time = 0;
+
+    if (peer->health) {
+        ngx_memzero(peer->health, sizeof(ngx_http_upstream_rr_health_t));
+    }
+
+    peer->removed = 0;
+
+    peers->total_weight += peer->weight;
+    peers->config++;
+
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "server %V added to upstream \"%V\"",
+                  &peer->name, peers->name);
+
+    p = ngx_pnalloc(r->pool, NGX_HTTP_UPSTREAM_CONF_SERVER_LEN);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    msg->data = p;
+    msg->len = ngx_http_upstream_conf_server(p, peer, 0, n) - p;
+
+    return NGX_HTTP_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_modify(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer,
+    ngx_str_t *msg)
+{
+    ngx_str_t                    value;
+    ngx_http_upstream_rr_peer_t  tmp;
+
+    tmp = *peer;
+
+    if (ngx_http_upstream_conf_params(r, &tmp) != NGX_OK) {
+        ngx_str_set(msg, "invalid server parameters");
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "drain", 5, &value) == NGX_OK) {
+        tmp.drain = 1;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "up", 2, &value) == NGX_OK) {
+        tmp.down = 0;
+        tmp.drain = 0;
+    }
+
+    if (tmp.weight != peer->weight) {
+        peers->total_weight += tmp.weight - peer->weight;
+        peers->config++;
+
+        peer->weight = tmp.weight;
+        peer->effective_weight = tmp.weight;
+        peer->current_weight = 0;
+    }
+
+    peer->max_fails = tmp.max_fails;
+    peer->fail_timeout = tmp.fail_timeout;
+
+    if (peer->down != tmp.down || peer->drain != tmp.drain) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "server %V in upstream \"%V\" is %s",
+                      &peer->name, peers->name,
+                      tmp.down ? "down" : (tmp.drain ? "draining" : "up"));
+    }
+
+    peer->down = tmp.down;
+    peer->drain = tmp.drain;
+
+    return NGX_HTTP_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_params(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    time_t     fail_timeout;
+    ngx_int_t  n;
+    ngx_str_t  value;
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR || n == 0) {
+            return NGX_ERROR;
+        }
+
+        peer->weight = n;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_fails", 9, &value) == NGX_OK) {
+        n = ngx_atoi(value.data, value.len);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->max_fails = n;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "fail_timeout", 12, &value) == NGX_OK) {
+        fail_timeout = ngx_parse_time(&value, 1);
+
+        if (fail_timeout == (time_t) NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        peer->fail_timeout = fail_timeout;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "down", 4, &value) == NGX_OK) {
+        peer->down = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_conf_local(ngx_connection_t *c)
+{
+    struct sockaddr_in   *sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6;
+#endif
+
+    switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_UNIX_DOMAIN)
+    case AF_UNIX:
+        return 1;
+#endif
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) c->sockaddr;
+        return IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr);
+#endif
+
+    default: /* AF_INET */
+        sin = (struct sockaddr_in *) c->sockaddr;
+        return (ntohl(sin->sin_addr.s_addr) >> 24) == 127;
+    }
+}
+
+
+static u_char *
+ngx_http_upstream_conf_server(u_char *p, ngx_http_upstream_rr_peer_t *peer,
+    ngx_uint_t backup, ngx_int_t id)
+{
+    char  *state;
+
+    /* the draining servers are saved as down ones */
+
+    if (peer->down || (peer->drain && id == NGX_ERROR)) {
+        state = " down";
+
+    } else if (peer->drain) {
+        state = " drain";
+
+    } else {
+        state = "";
+    }
+
+    p = ngx_sprintf(p, "server %V weight=%i max_fails=%ui fail_timeout=%Ts%s%s;",
+                    &peer->name, peer->weight, peer->max_fails,
+                    peer->fail_timeout, state, backup ? " backup" : "");
+
+    if (id == NGX_ERROR) {
+        *p++ = LF;
+        return p;
+    }
+
+    return ngx_sprintf(p, " # id=%i" CRLF, id);
+}
+
+
+static u_char *
+ngx_http_upstream_zone_state(u_char *p, ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                     i, backup;
+    ngx_http_upstream_rr_peers_t  *list;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    for (list = peers, backup = 0; list; list = list->next, backup = 1) {
+        for (i = 0; i < list->number; i++) {
+            if (!list->peer[i].removed) {
+                p = ngx_http_upstream_conf_server(p, &list->peer[i], backup,
+                                                  NGX_ERROR);
+            }
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_save(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_str_t *state)
+{
+    u_char                        *p, *last, *buf, *saved;
+    size_t                         size;
+    ssize_t                        n;
+    ngx_fd_t                       fd;
+    ngx_str_t                      temp;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    peers = uscf->peer.data;
+
+    size = (peers->number + (peers->next ? peers->next->number : 0))
+           * NGX_HTTP_UPSTREAM_CONF_SERVER_LEN;
+
+    buf = ngx_pnalloc(r->pool, 2 * size);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    saved = buf + size;
+
+    temp.len = state->len + sizeof(".4294967295.tmp") - 1;
+    temp.data = ngx_pnalloc(r->pool, temp.len + 1);
+    if (temp.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(temp.data, "%V.%P.tmp%Z", state, ngx_pid);
+
+    /*
+     * the file is written without the peers locked, and the servers may
+     * be changed meanwhile by another worker process, which saves them
+     * as well; so the servers are saved again until the file matches them
+     */
+
+    last = ngx_http_upstream_zone_state(buf, peers);
+
+    for ( ;; ) {
+
+        fd = ngx_open_file(temp.data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                           NGX_FILE_DEFAULT_ACCESS);
+
+        if (fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed", temp.data);
+            return NGX_ERROR;
+        }
+
+        n = ngx_write_fd(fd, buf, last - buf);
+
+        if (n != last - buf) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_write_fd_n " \"%s\" failed", temp.data);
+        }
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed", temp.data);
+        }
+
+        if (n != last - buf) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_rename_file(temp.data, state->data) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                          temp.data, state->data);
+            return NGX_ERROR;
+        }
+
+        p = saved;
+        saved = buf;
+        buf = p;
+
+        last = ngx_http_upstream_zone_state(buf, peers);
+
+        if (last - buf == n && ngx_memcmp(buf, saved, n) == 0) {
+            return NGX_OK;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r, ngx_uint_t status,
+    ngx_str_t *msg)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    b = ngx_create_temp_buf(r->pool, msg->len + sizeof(CRLF) - 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, msg->data, msg->len);
+
+    if (status != NGX_HTTP_OK) {
+        *b->last++ = CR; *b->last++ = LF;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static void *
+ngx_http_upstream_zone_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_zone_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_zone_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->state = { 0, NULL };
+     *     conf->nservers = 0;
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ssize_t                        size;
+    ngx_str_t                     *value;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->shm_zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (16 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                           &ngx_http_upstream_zone_module);
+    if (uscf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (uscf->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is already used by upstream \"%V\"",
+                           &value[1], &((ngx_http_upstream_srv_conf_t *)
+                                        uscf->shm_zone->data)->host);
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->shm_zone->init = ngx_http_upstream_init_zone;
+    uscf->shm_zone->data = uscf;
+    uscf->shm_zone->noreuse = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_state(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_zone_srv_conf_t  *zscf = conf;
+
+    char                          *rv;
+    ngx_str_t                     *value;
+    ngx_err_t                      err;
+    ngx_file_info_t                fi;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (zscf->state.data) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    zscf->state = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, &zscf->state, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_file_info(zscf->state.data, &fi) == NGX_FILE_ERROR) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, err,
+                               ngx_file_info_n " \"%s\" failed",
+                               zscf->state.data);
+            return NGX_CONF_ERROR;
+        }
+
+        /* the servers configured before are used until the state is saved */
+
+        zscf->nservers = uscf->servers ? uscf->servers->nelts : 0;
+
+        return NGX_CONF_OK;
+    }
+
+    /* the saved servers replace the configured ones */
+
+    if (uscf->servers) {
+        uscf->servers->nelts = 0;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "upstream state %s", zscf->state.data);
+
+    rv = ngx_conf_parse(cf, &zscf->state);
+
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    if (uscf->servers == NULL) {
+        uscf->servers = ngx_array_create(cf->pool, 1,
+                                         sizeof(ngx_http_upstream_server_t));
+        if (uscf->servers == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    zscf->nservers = uscf->servers->nelts;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_zone_srv_conf_t  *zscf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        zscf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_upstream_zone_module);
+
+        if (zscf->state.data == NULL) {
+            continue;
+        }
+
+        if (uscfp[i]->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"state\" requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+
+        if ((uscfp[i]->servers ? uscfp[i]->servers->nelts : 0)
+            != zscf->nservers)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"server\" directives must precede \"state\" "
+                          "in upstream \"%V\" in %s:%ui", &uscfp[i]->host,
+                          uscfp[i]->file_name, uscfp[i]->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
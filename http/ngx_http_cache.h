@@ -20,9 +20,16 @@
 #define NGX_HTTP_CACHE_STALE         4
 #define NGX_HTTP_CACHE_UPDATING      5
 #define NGX_HTTP_CACHE_HIT           6
-#define NGX_HTTP_CACHE_SCARCE        7
+#define NGX_HTTP_CACHE_REVALIDATED   7
+#define NGX_HTTP_CACHE_SCARCE        8
 
 #define NGX_HTTP_CACHE_KEY_LEN       16
+#define NGX_HTTP_CACHE_ETAG_LEN      42
+#define NGX_HTTP_CACHE_VARY_LEN      42
+
+#define NGX_HTTP_CACHE_VERSION       3
+
+#define NGX_HTTP_CACHE_DISKS         16
 
 
 typedef struct {
@@ -31,6 +38,19 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct {
+    off_t                            length;
+    uint64_t                         waiting;
+    u_char                          *name;
+    ngx_uint_t                       count;
+    unsigned                         done:1;
+    unsigned                         error:1;
+} ngx_http_file_cache_fill_t;
+
+
+typedef struct ngx_http_file_cache_tag_ref_s  ngx_http_file_cache_tag_ref_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -45,35 +65,89 @@ typedef struct {
     unsigned                         exists:1;
     unsigned                         updating:1;
     unsigned                         deleting:1;
-                                     /* 11 unused bits */
+    unsigned                         hot:1;
+    unsigned                         disk:4;
+    unsigned                         purged:1;
+    unsigned                         vary:1;
+                                     /* 4 unused bits */
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
     time_t                           valid_sec;
     size_t                           body_start;
     off_t                            fs_size;
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_http_file_cache_tag_ref_t   *tags;
 } ngx_http_file_cache_node_t;
 
 
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_queue_t                      refs;
+    u_char                           data[1];
+} ngx_http_file_cache_tag_t;
+
+
+struct ngx_http_file_cache_tag_ref_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_tag_t       *tag;
+    ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_tag_ref_t   *next;
+};
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    time_t                           time;
+    size_t                           len;
+    ngx_uint_t                       exact;
+    u_char                           data[1];
+} ngx_http_file_cache_purge_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_mem_node_t;
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
     uint32_t                         crc32;
     u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    u_char                           main[NGX_HTTP_CACHE_KEY_LEN];
+    u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
 
     ngx_file_uniq_t                  uniq;
     time_t                           valid_sec;
+    time_t                           updating_sec;
+    time_t                           error_sec;
     time_t                           last_modified;
     time_t                           date;
 
+    ngx_str_t                        etag;
+    ngx_str_t                        tags;
+    ngx_str_t                        vary;
+
+    size_t                           buffer_size;
     size_t                           header_start;
     size_t                           body_start;
     off_t                            length;
     off_t                            fs_size;
 
     ngx_uint_t                       min_uses;
+    ngx_uint_t                       uses;
     ngx_uint_t                       error;
     ngx_uint_t                       valid_msec;
+    ngx_uint_t                       disk;
 
     ngx_buf_t                       *buf;
 
@@ -85,44 +159,117 @@ struct ngx_http_cache_s {
 
     ngx_event_t                      wait_event;
 
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_buf_t                       *fill_buf;
+    ngx_queue_t                      queue;
+
     unsigned                         lock:1;
     unsigned                         waiting:1;
+    unsigned                         filling:1;
+    unsigned                         queued:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
     unsigned                         exists:1;
     unsigned                         temp_file:1;
+    unsigned                         memory:1;
+    unsigned                         stale_updating:1;
+    unsigned                         stale_error:1;
+    unsigned                         secondary:1;
+    unsigned                         counted:1;
 };
 
 
 typedef struct {
+    ngx_uint_t                       version;
     time_t                           valid_sec;
+    time_t                           updating_sec;
+    time_t                           error_sec;
     time_t                           last_modified;
     time_t                           date;
     uint32_t                         crc32;
     u_short                          valid_msec;
     u_short                          header_start;
     u_short                          body_start;
+    u_char                           etag_len;
+    u_char                           etag[NGX_HTTP_CACHE_ETAG_LEN];
+    u_char                           vary_len;
+    u_char                           vary[NGX_HTTP_CACHE_VARY_LEN];
+    u_char                           variant[NGX_HTTP_CACHE_KEY_LEN];
 } ngx_http_file_cache_header_t;
 
 
+typedef struct {
+    ngx_uint_t                       mask;
+    ngx_uint_t                       additions;
+    ngx_uint_t                       sample;
+    u_char                           counters[1];
+} ngx_http_file_cache_sketch_t;
+
+
+typedef struct {
+    ngx_uint_t                       hit;
+    ngx_uint_t                       miss;
+    ngx_uint_t                       promoted;
+    ngx_uint_t                       demoted;
+    ngx_uint_t                       rejected;
+    ngx_uint_t                       variant_hit;
+    ngx_uint_t                       variant_miss;
+} ngx_http_file_cache_stat_t;
+
+
+typedef struct {
+    off_t                            size;
+    time_t                           down;
+} ngx_http_file_cache_disk_sh_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
+    ngx_queue_t                      hot;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
     off_t                            size;
+    off_t                            hot_size;
+    time_t                           snapshot;
+    ngx_http_file_cache_sketch_t    *sketch;
+    ngx_http_file_cache_stat_t       stat;
+    ngx_http_file_cache_disk_sh_t    disks[NGX_HTTP_CACHE_DISKS];
+    ngx_rbtree_t                     tags;
+    ngx_rbtree_node_t                tags_sentinel;
+    ngx_queue_t                      purges;
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_path_t                      *path;
+    ngx_path_t                      *temp_path;
+    off_t                            max_size;
+    ngx_uint_t                       weight;
+} ngx_http_file_cache_disk_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+} ngx_http_file_cache_mem_sh_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
 
     ngx_path_t                      *path;
 
+    ngx_http_file_cache_disk_t      *disks;
+    ngx_uint_t                       ndisks;
+    ngx_uint_t                       loader_disk;
+
     off_t                            max_size;
+    off_t                            hot_max_size;
     size_t                           bsize;
 
     time_t                           inactive;
@@ -133,7 +280,22 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
 
+    ngx_str_t                        snapshot;
+    time_t                           snapshot_interval;
+    time_t                           snapshot_next;
+
+    ngx_flag_t                       slru;
+    ngx_flag_t                       tinylfu;
+
     ngx_shm_zone_t                  *shm_zone;
+
+    ngx_http_file_cache_mem_sh_t    *mem_sh;
+    ngx_slab_pool_t                 *mem_shpool;
+
+    size_t                           mem_max_object;
+    ngx_uint_t                       mem_min_uses;
+
+    ngx_shm_zone_t                  *mem_zone;
 };
 
 
@@ -141,10 +303,14 @@ ngx_int_t ngx_http_file_cache_new(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_create(ngx_http_request_t *r);
 void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
-void ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
+void ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
+ngx_int_t ngx_http_file_cache_purge(ngx_http_request_t *r, ngx_str_t *tags);
+ngx_int_t ngx_http_file_cache_vary_normalize(ngx_http_request_t *r);
 time_t ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status);
 
 char *ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
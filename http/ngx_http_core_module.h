@@ -13,6 +13,10 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_THREAD_POOL)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_HTTP_GZIP_PROXIED_OFF       0x0002
 #define NGX_HTTP_GZIP_PROXIED_EXPIRED   0x0004
@@ -28,6 +32,7 @@
 #define NGX_HTTP_AIO_OFF                0
 #define NGX_HTTP_AIO_ON                 1
 #define NGX_HTTP_AIO_SENDFILE           2
+#define NGX_HTTP_AIO_THREADS            3
 
 
 #define NGX_HTTP_SATISFY_ALL            0
@@ -82,6 +87,9 @@ typedef struct {
     unsigned                   ipv6only:1;
 #endif
     unsigned                   so_keepalive:2;
+#if (NGX_HAVE_REUSEPORT)
+    unsigned                   reuseport:1;
+#endif
 
     int                        backlog;
     int                        rcvbuf;
@@ -391,8 +399,11 @@ struct ngx_http_core_loc_conf_s {
                                            /* client_body_in_singe_buffer */
     ngx_flag_t    internal;                /* internal */
     ngx_flag_t    sendfile;                /* sendfile */
-#if (NGX_HAVE_FILE_AIO)
+#if (NGX_HAVE_FILE_AIO || NGX_THREAD_POOL)
     ngx_flag_t    aio;                     /* aio */
+#endif
+#if (NGX_THREAD_POOL)
+    ngx_thread_pool_t  *thread_pool;       /* aio threads=pool */
 #endif
     ngx_flag_t    tcp_nopush;              /* tcp_nopush */
     ngx_flag_t    tcp_nodelay;             /* tcp_nodelay */
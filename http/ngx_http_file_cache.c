@@ -11,32 +11,141 @@
 #include <ngx_md5.h>
 
 
+typedef struct {
+    u_char                           signature[8];
+    uint32_t                         node_size;
+    uint32_t                         crc32;
+    time_t                           time;
+    uint64_t                         number;
+    uint64_t                         bsize;
+    uint32_t                         level[3];
+    uint32_t                         disks;
+} ngx_http_file_cache_snapshot_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    time_t                           valid_sec;
+    off_t                            fs_size;
+    uint32_t                         body_start;
+    uint16_t                         uses;
+    uint16_t                         valid_msec;
+    uint16_t                         disk;
+    uint16_t                         purged;
+} ngx_http_file_cache_snapshot_node_t;
+
+
+typedef ngx_int_t (*ngx_http_file_cache_vary_normalize_pt)
+    (ngx_http_request_t *r, ngx_str_t *value);
+
+
+typedef struct {
+    ngx_str_t                               name;
+    ngx_http_file_cache_vary_normalize_pt   handler;
+} ngx_http_file_cache_vary_normalizer_t;
+
+
+#define NGX_HTTP_FILE_CACHE_SNAPSHOT_NODES  512
+
+#define NGX_HTTP_FILE_CACHE_DISK_RETRY      60
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_fill_wait_locked(
+    ngx_http_file_cache_t *cache, ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_fill_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_handler(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_file_cache_fill_send(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_sleep(ngx_http_cache_t *c,
+    ngx_msec_t timer);
+static void ngx_http_file_cache_fill_unqueue(ngx_http_cache_t *c);
+static void ngx_http_file_cache_fill_release(ngx_http_cache_t *c);
+static uint64_t ngx_http_file_cache_fill_detach_locked(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn,
+    ngx_temp_file_t *tf);
+static void ngx_http_file_cache_fill_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill);
+static void ngx_http_file_cache_fill_notify(ngx_http_file_cache_node_t *fcn,
+    uint64_t mask, ngx_log_t *log);
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
+    size_t len, u_char *hash);
+static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
+    ngx_md5_t *md5, ngx_str_t *name);
+static ngx_int_t ngx_http_file_cache_vary_accept_encoding(
+    ngx_http_request_t *r, ngx_str_t *value);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
 static void ngx_http_cache_aio_event_handler(ngx_event_t *ev);
 #endif
+#if (NGX_THREAD_POOL)
+static ngx_int_t ngx_http_cache_thread_handler(ngx_thread_task_t *task,
+    ngx_file_t *file);
+static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_insert_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t hit);
+static ngx_int_t ngx_http_file_cache_admit_locked(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_int_t ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache,
+    size_t size);
+static void ngx_http_file_cache_sketch_add(
+    ngx_http_file_cache_sketch_t *sketch, u_char *key);
+static ngx_uint_t ngx_http_file_cache_sketch_estimate(
+    ngx_http_file_cache_sketch_t *sketch, u_char *key);
+static ngx_uint_t ngx_http_file_cache_disk_locked(
+    ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_disk_error(ngx_http_file_cache_t *cache,
+    ngx_uint_t disk, ngx_log_t *log);
+static void ngx_http_file_cache_disk_probe(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
+static u_char *ngx_http_file_cache_name_alloc(ngx_http_file_cache_t *cache);
 static ngx_http_file_cache_node_t *
     ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key);
 static void ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_file_cache_purge_node_locked(
+    ngx_http_file_cache_t *cache, ngx_http_file_cache_node_t *fcn);
+static ngx_int_t ngx_http_file_cache_purged_locked(
+    ngx_http_file_cache_t *cache, ngx_http_cache_t *c, time_t date);
+static void ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_tag_next(ngx_str_t *tags,
+    ngx_str_t *name);
+static void ngx_http_file_cache_tags_add_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *tags);
+static void ngx_http_file_cache_tags_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_int_t disk);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_snapshot_save(ngx_http_file_cache_t *cache);
+static ngx_int_t ngx_http_file_cache_snapshot_load(
+    ngx_http_file_cache_t *cache, ngx_log_t *log);
+static void ngx_http_file_cache_snapshot_drop(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
@@ -45,6 +154,19 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static ngx_int_t ngx_http_file_cache_mem_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_file_cache_mem_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_mem_store(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_mem_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static ngx_http_file_cache_mem_node_t *
+    ngx_http_file_cache_mem_lookup(ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_mem_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -53,13 +175,31 @@ ngx_str_t  ngx_http_cache_status[] = {
     ngx_string("EXPIRED"),
     ngx_string("STALE"),
     ngx_string("UPDATING"),
-    ngx_string("HIT")
+    ngx_string("HIT"),
+    ngx_string("REVALIDATED")
 };
 
 
 static u_char  ngx_http_file_cache_key[] = { LF, 'K', 'E', 'Y', ':', ' ' };
 
 
+/* the request headers are normalized to keep the number of variants low */
+
+static ngx_http_file_cache_vary_normalizer_t
+    ngx_http_file_cache_vary_normalizers[] =
+{
+    { ngx_string("accept-encoding"),
+      ngx_http_file_cache_vary_accept_encoding },
+
+    { ngx_null_string, NULL }
+};
+
+
+/* the requests of this process waiting for a cache entry being filled */
+
+static ngx_queue_t  ngx_http_file_cache_waiters;
+
+
 static ngx_int_t
 ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
@@ -91,17 +231,47 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             }
         }
 
+        if (cache->ndisks != ocache->ndisks) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "cache \"%V\" had previously different disks",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        for (n = 1; n < cache->ndisks; n++) {
+            if (ngx_strcmp(cache->disks[n].path->name.data,
+                           ocache->disks[n].path->name.data)
+                != 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                              "cache \"%V\" had previously different disks",
+                              &shm_zone->shm.name);
+                return NGX_ERROR;
+            }
+        }
+
         cache->sh = ocache->sh;
 
         cache->shpool = ocache->shpool;
         cache->bsize = ocache->bsize;
 
         cache->max_size /= cache->bsize;
+        cache->hot_max_size = cache->max_size / 5 * 4;
+
+        for (n = 0; n < cache->ndisks; n++) {
+            cache->disks[n].max_size /= cache->bsize;
+        }
 
-        if (!cache->sh->cold || cache->sh->loading) {
+        if ((!cache->sh->cold && !cache->sh->snapshot)
+            || cache->sh->loading)
+        {
             cache->path->loader = NULL;
         }
 
+        if (cache->tinylfu && cache->sh->sketch == NULL) {
+            return ngx_http_file_cache_sketch_init(cache, shm_zone->shm.size);
+        }
+
         return NGX_OK;
     }
 
@@ -125,14 +295,38 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_http_file_cache_rbtree_insert_value);
 
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->hot);
+
+    ngx_rbtree_init(&cache->sh->tags, &cache->sh->tags_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->purges);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
+    cache->sh->hot_size = 0;
+    cache->sh->snapshot = 0;
+    cache->sh->sketch = NULL;
+
+    ngx_memzero(&cache->sh->stat, sizeof(ngx_http_file_cache_stat_t));
+    ngx_memzero(cache->sh->disks, sizeof(cache->sh->disks));
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
+    cache->hot_max_size = cache->max_size / 5 * 4;
+
+    for (n = 0; n < cache->ndisks; n++) {
+        cache->disks[n].max_size /= cache->bsize;
+    }
+
+    if (cache->tinylfu
+        && ngx_http_file_cache_sketch_init(cache, shm_zone->shm.size)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
     len = sizeof(" in cache keys zone \"\"") + shm_zone->shm.name.len;
 
@@ -144,10 +338,154 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     ngx_sprintf(cache->shpool->log_ctx, " in cache keys zone \"%V\"%Z",
                 &shm_zone->shm.name);
 
+    if (cache->snapshot.len) {
+        (void) ngx_http_file_cache_snapshot_load(cache, shm_zone->shm.log);
+    }
+
     return NGX_OK;
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_copy(ngx_shm_zone_t *shm_zone, ngx_shm_zone_t *ozone)
+{
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_uint_t                      n;
+    ngx_queue_t                    *q, *queue;
+    ngx_http_file_cache_t          *cache, *ocache;
+    ngx_http_file_cache_node_t     *fcn, *ofcn;
+    ngx_http_file_cache_purge_t    *purge, *opurge;
+    ngx_http_file_cache_tag_ref_t  *ref;
+
+    cache = shm_zone->data;
+    ocache = ozone->data;
+
+    if (ngx_strcmp(cache->path->name.data, ocache->path->name.data) != 0
+        || cache->bsize != ocache->bsize
+        || cache->ndisks != ocache->ndisks)
+    {
+        return NGX_DECLINED;
+    }
+
+    for (n = 0; n < 3; n++) {
+        if (cache->path->level[n] != ocache->path->level[n]) {
+            return NGX_DECLINED;
+        }
+    }
+
+    for (n = 1; n < cache->ndisks; n++) {
+        if (ngx_strcmp(cache->disks[n].path->name.data,
+                       ocache->disks[n].path->name.data)
+            != 0)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    /* the zone is filled from the old one instead of the snapshot */
+
+    ngx_http_file_cache_snapshot_drop(cache);
+
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&ocache->shpool->mutex);
+
+    for (q = ngx_queue_head(&ocache->sh->purges);
+         q != ngx_queue_sentinel(&ocache->sh->purges);
+         q = ngx_queue_next(q))
+    {
+        opurge = ngx_queue_data(q, ngx_http_file_cache_purge_t, queue);
+
+        size = sizeof(ngx_http_file_cache_purge_t) + opurge->len;
+
+        purge = ngx_slab_alloc_locked(cache->shpool, size);
+        if (purge == NULL) {
+            rc = NGX_DECLINED;
+            goto done;
+        }
+
+        ngx_memcpy(purge, opurge, size);
+
+        ngx_queue_insert_tail(&cache->sh->purges, &purge->queue);
+    }
+
+    /*
+     * the protected queue is copied first, and both queues are copied
+     * starting from the most recently used entries, so only the least
+     * valuable ones are lost if the new zone is smaller
+     */
+
+    for (n = 0; n < 2; n++) {
+
+        queue = (n == 0) ? &ocache->sh->hot : &ocache->sh->queue;
+
+        for (q = ngx_queue_head(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_next(q))
+        {
+            ofcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (!ofcn->exists || ofcn->deleting) {
+                continue;
+            }
+
+            fcn = ngx_slab_alloc_locked(cache->shpool,
+                                        sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                rc = NGX_DECLINED;
+                goto done;
+            }
+
+            ngx_memcpy(fcn, ofcn, sizeof(ngx_http_file_cache_node_t));
+
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+            fcn->count = 0;
+            fcn->updating = 0;
+            fcn->hot = (n == 0 && cache->slru) ? 1 : 0;
+            fcn->fill = NULL;
+            fcn->tags = NULL;
+
+            if (fcn->hot) {
+                ngx_queue_insert_tail(&cache->sh->hot, &fcn->queue);
+                cache->sh->hot_size += fcn->fs_size;
+
+            } else {
+                ngx_queue_insert_tail(&cache->sh->queue, &fcn->queue);
+            }
+
+            cache->sh->size += fcn->fs_size;
+            cache->sh->disks[fcn->disk].size += fcn->fs_size;
+
+            for (ref = ofcn->tags; ref; ref = ref->next) {
+                ngx_http_file_cache_tags_add_locked(cache, fcn,
+                                                    &ref->tag->sn.str);
+            }
+        }
+    }
+
+done:
+
+    cache->sh->stat = ocache->sh->stat;
+
+    for (n = 0; n < cache->ndisks; n++) {
+        cache->sh->disks[n].down = ocache->sh->disks[n].down;
+    }
+
+    ngx_shmtx_unlock(&ocache->shpool->mutex);
+
+    /*
+     * the loader adds the files stored by the old workers after the copy,
+     * or all files if not every entry has been copied
+     */
+
+    cache->sh->snapshot = (rc == NGX_OK) ? ngx_time() : 0;
+
+    return rc;
+}
+
+
 ngx_int_t
 ngx_http_file_cache_new(ngx_http_request_t *r)
 {
@@ -192,7 +530,7 @@ ngx_http_file_cache_create(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, cache->disks[c->disk].path) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -232,6 +570,8 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 
     ngx_crc32_final(c->crc32);
     ngx_md5_final(c->key, &md5);
+
+    ngx_memcpy(c->main, c->key, NGX_HTTP_CACHE_KEY_LEN);
 }
 
 
@@ -258,7 +598,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
 
     cache = c->file_cache;
 
-    if (c->node == NULL) {
+    if (c->node == NULL && !c->secondary) {
         cln = ngx_pool_cleanup_add(r->pool, 0);
         if (cln == NULL) {
             return NGX_ERROR;
@@ -311,7 +651,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         }
     }
 
-    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+    if (ngx_http_file_cache_name(r, cache->disks[c->disk].path) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -319,6 +659,19 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->mem_shpool) {
+
+        rc = ngx_http_file_cache_mem_open(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -345,6 +698,9 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         default:
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, of.err,
                           ngx_open_file_n " \"%s\" failed", c->file.name.data);
+
+            ngx_http_file_cache_disk_error(cache, c->disk, r->connection->log);
+
             return NGX_ERROR;
         }
     }
@@ -358,7 +714,20 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (cache->mem_shpool
+        && c->exists
+        && c->uses >= cache->mem_min_uses
+        && of.size <= (off_t) cache->mem_max_object)
+    {
+        /* a small object is read at once and is kept in the memory zone */
+
+        c->buf = ngx_create_temp_buf(r->pool, (size_t) of.size);
+        c->memory = 1;
+
+    } else {
+        c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    }
+
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -378,6 +747,7 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    ngx_int_t                  rc;
     ngx_msec_t                 now, timer;
     ngx_http_file_cache_t     *cache;
 
@@ -386,24 +756,39 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
     }
 
     cache = c->file_cache;
+    rc = NGX_DECLINED;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     if (!c->node->updating) {
         c->node->updating = 1;
         c->updating = 1;
+
+    } else if (r == r->main) {
+        rc = ngx_http_file_cache_fill_wait_locked(cache, c);
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d f:%i wt:%M",
+                   c->updating, rc, c->wait_time);
 
     if (c->updating) {
         return NGX_DECLINED;
     }
 
+    if (rc == NGX_OK) {
+
+        /* the response is being written, read it while it grows */
+
+        rc = ngx_http_file_cache_fill_open(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     c->waiting = 1;
 
     now = ngx_current_msec;
@@ -418,7 +803,7 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     timer = c->wait_time - now;
 
-    ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
+    ngx_http_file_cache_fill_sleep(c, (timer > 500) ? 500 : timer);
 
     r->main->blocked++;
 
@@ -442,6 +827,8 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
                    "http file cache wait handler wt:%M cur:%M",
                    c->wait_time, ngx_current_msec);
 
+    ngx_http_file_cache_fill_unqueue(c);
+
     timer = c->wait_time - ngx_current_msec;
 
     if ((ngx_msec_int_t) timer <= 0) {
@@ -458,17 +845,27 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
 
     if (c->node->updating) {
         wait = 1;
+
+        if (r == r->main
+            && ngx_http_file_cache_fill_wait_locked(cache, c) == NGX_OK)
+        {
+            wait = 0;
+        }
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     if (wait) {
-        ngx_add_timer(ev, (timer > 500) ? 500 : timer);
+        ngx_http_file_cache_fill_sleep(c, (timer > 500) ? 500 : timer);
         return;
     }
 
 wakeup:
 
+    if (c->fill) {
+        ngx_http_file_cache_fill_release(c);
+    }
+
     c->waiting = 0;
     r->main->blocked--;
     r->connection->write->handler(r->connection->write);
@@ -476,1085 +873,3951 @@ wakeup:
 
 
 static ngx_int_t
-ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+ngx_http_file_cache_fill_wait_locked(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
 {
-    time_t                         now;
-    ssize_t                        n;
-    ngx_int_t                      rc;
-    ngx_http_file_cache_t         *cache;
-    ngx_http_file_cache_header_t  *h;
+    ngx_http_file_cache_fill_t  *fill;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    fill = c->fill;
 
-    if (n < 0) {
-        return n;
-    }
+    if (fill == NULL) {
+        fill = c->node->fill;
 
-    if ((size_t) n < c->header_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" is too small", c->file.name.data);
-        return NGX_DECLINED;
-    }
+        if (fill == NULL) {
+            fill = ngx_slab_alloc_locked(cache->shpool,
+                                         sizeof(ngx_http_file_cache_fill_t));
+            if (fill == NULL) {
+                return NGX_DECLINED;
+            }
 
-    h = (ngx_http_file_cache_header_t *) c->buf->pos;
+            ngx_memzero(fill, sizeof(ngx_http_file_cache_fill_t));
 
-    if (h->crc32 != c->crc32) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has md5 collision", c->file.name.data);
-        return NGX_DECLINED;
+            /* the reference of the node */
+            fill->count = 1;
+
+            c->node->fill = fill;
+        }
+
+        fill->count++;
+        c->fill = fill;
     }
 
-    if (h->body_start > c->body_start) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                      "cache file \"%s\" has too long header",
-                      c->file.name.data);
-        return NGX_DECLINED;
+    if (fill->name) {
+        return NGX_OK;
     }
 
-    c->buf->last += n;
+    /* the processes beyond the mask are left to the timer */
 
-    c->valid_sec = h->valid_sec;
-    c->last_modified = h->last_modified;
-    c->date = h->date;
-    c->valid_msec = h->valid_msec;
-    c->header_start = h->header_start;
-    c->body_start = h->body_start;
+    if (ngx_process_slot < 64) {
+        fill->waiting |= (uint64_t) 1 << ngx_process_slot;
+    }
 
-    r->cached = 1;
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_fill_open(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_fd_t                    fd;
+    ngx_err_t                   err;
+    ngx_pool_cleanup_t         *cln;
+    ngx_http_file_cache_t      *cache;
+    ngx_pool_cleanup_file_t    *clnf;
 
     cache = c->file_cache;
 
-    if (cache->sh->cold) {
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the name does not change while the fill is referenced */
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    fd = ngx_open_file(c->fill->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-        if (!c->node->exists) {
-            c->node->uses = 1;
-            c->node->body_start = c->body_start;
-            c->node->exists = 1;
-            c->node->uniq = c->uniq;
-            c->node->fs_size = c->fs_size;
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
 
-            cache->sh->size += c->fs_size;
+        if (err == NGX_ENOENT) {
+
+            /* the temp file has been just renamed to the cache file */
+
+            ngx_http_file_cache_fill_release(c);
+            return NGX_DECLINED;
         }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", c->fill->name);
+        return NGX_ERROR;
     }
 
-    now = ngx_time();
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%s\" fd:%d", c->fill->name, fd);
 
-    if (c->valid_sec < now) {
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
 
-        if (c->node->updating) {
-            rc = NGX_HTTP_CACHE_UPDATING;
+    c->file.fd = fd;
+    c->file.log = r->connection->log;
+    c->filling = 1;
 
-        } else {
-            c->node->updating = 1;
-            c->updating = 1;
-            rc = NGX_HTTP_CACHE_STALE;
-        }
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    c->length = c->fill->length;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http file cache expired: %i %T %T",
-                       rc, c->valid_sec, now);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        return rc;
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
     }
 
-    return NGX_OK;
+    return ngx_http_file_cache_read(r, c);
 }
 
 
-static ssize_t
-ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_fill_handler(ngx_http_request_t *r)
 {
-#if (NGX_HAVE_FILE_AIO)
-    ssize_t                    n;
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_int_t     rc;
+    ngx_event_t  *wev;
 
-    if (!ngx_file_aio) {
-        goto noaio;
-    }
+    wev = r->connection->write;
 
-    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache fill handler: \"%V?%V\"",
+                   &r->uri, &r->args);
 
-    if (!clcf->aio) {
-        goto noaio;
-    }
+    if (wev->timedout) {
 
-    n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        if (!wev->delayed) {
+            ngx_log_error(NGX_LOG_INFO, wev->log, NGX_ETIMEDOUT,
+                          "client timed out");
+            r->connection->timedout = 1;
 
-    if (n != NGX_AGAIN) {
-        return n;
+            ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
+
+        wev->timedout = 0;
+        wev->delayed = 0;
     }
 
-    c->file.aio->data = r;
-    c->file.aio->handler = ngx_http_cache_aio_event_handler;
+    if (wev->delayed || r->aio) {
+        return;
+    }
 
-    r->main->blocked++;
-    r->aio = 1;
+    rc = ngx_http_file_cache_fill_send(r);
 
-    return NGX_AGAIN;
+    if (rc == NGX_DONE) {
+        return;
+    }
 
-noaio:
+    ngx_http_finalize_request(r, rc);
+}
 
-#endif
-
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
-}
-
-
-#if (NGX_HAVE_FILE_AIO)
 
 static void
-ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+ngx_http_file_cache_fill_wait_handler(ngx_event_t *ev)
 {
-    ngx_event_aio_t     *aio;
+    ngx_connection_t    *c;
     ngx_http_request_t  *r;
 
-    aio = ev->data;
-    r = aio->data;
+    r = ev->data;
+    c = r->connection;
 
-    r->main->blocked--;
-    r->aio = 0;
+    ngx_http_file_cache_fill_unqueue(r->cache);
 
-    r->connection->write->handler(r->connection->write);
-}
+    r->write_event_handler = ngx_http_file_cache_fill_handler;
 
-#endif
+    ngx_http_file_cache_fill_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
 
 
 static ngx_int_t
-ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+ngx_http_file_cache_fill_send(ngx_http_request_t *r)
 {
+    off_t                        length;
     ngx_int_t                    rc;
-    ngx_http_file_cache_node_t  *fcn;
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_buf_t                   *b;
+    ngx_uint_t                   done, error;
+    ngx_file_t                  *file;
+    ngx_chain_t                  out;
+    ngx_event_t                 *wev;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_file_cache_fill_t  *fill;
 
-    fcn = c->node;
+    c = r->cache;
+    b = c->fill_buf;
+    fill = c->fill;
+    cache = c->file_cache;
 
-    if (fcn == NULL) {
-        fcn = ngx_http_file_cache_lookup(cache, c->key);
-    }
+    wev = r->connection->write;
 
-    if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+    for ( ;; ) {
 
-        if (c->node == NULL) {
-            fcn->uses++;
-            fcn->count++;
-        }
+        /* the buffer is reused only after it has been sent */
 
-        if (fcn->error) {
+        if (ngx_buf_size(b)) {
 
-            if (fcn->valid_sec < ngx_time()) {
-                goto renew;
+            if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+                return NGX_ERROR;
             }
 
-            rc = NGX_OK;
+            if (ngx_buf_size(b)) {
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-            goto done;
-        }
+                if (!wev->delayed) {
+                    ngx_add_timer(wev, clcf->send_timeout);
+                }
 
-        if (fcn->exists || fcn->uses >= c->min_uses) {
+                if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+                    return NGX_ERROR;
+                }
 
-            c->exists = fcn->exists;
-            if (fcn->body_start) {
-                c->body_start = fcn->body_start;
+                return NGX_DONE;
             }
+        }
 
-            rc = NGX_OK;
-
-            goto done;
+        if (wev->timer_set && !wev->delayed) {
+            ngx_del_timer(wev);
         }
 
-        rc = NGX_AGAIN;
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-        goto done;
-    }
+        length = fill->length;
+        done = fill->done;
+        error = fill->error;
 
-    fcn = ngx_slab_alloc_locked(cache->shpool,
-                                sizeof(ngx_http_file_cache_node_t));
-    if (fcn == NULL) {
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (length == c->length && !done && !error
+            && ngx_process_slot < 64)
+        {
+            fill->waiting |= (uint64_t) 1 << ngx_process_slot;
+        }
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache fill send: %O of %O d:%ui e:%ui",
+                       c->length, length, done, error);
 
-        fcn = ngx_slab_alloc_locked(cache->shpool,
-                                    sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            rc = NGX_ERROR;
-            goto failed;
+        if (error) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "cache file \"%s\" was not completely received "
+                          "from upstream", c->file.name.data);
+            return NGX_ERROR;
         }
-    }
-
-    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+        if (length == c->length && !done) {
+            ngx_http_file_cache_fill_sleep(c, 500);
+            return NGX_DONE;
+        }
 
-    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+        file = b->file;
+        ngx_memzero(b, sizeof(ngx_buf_t));
+        b->file = file;
 
-    fcn->uses = 1;
-    fcn->count = 1;
-    fcn->updating = 0;
-    fcn->deleting = 0;
+        b->file_pos = c->length;
+        b->file_last = length;
+        b->in_file = (length - c->length) ? 1 : 0;
 
-renew:
+        if (done) {
+            b->last_buf = 1;
+            b->last_in_chain = 1;
 
-    rc = NGX_DECLINED;
+        } else {
+            b->flush = 1;
+        }
 
-    fcn->valid_msec = 0;
-    fcn->error = 0;
-    fcn->exists = 0;
-    fcn->valid_sec = 0;
-    fcn->uniq = 0;
-    fcn->body_start = 0;
-    fcn->fs_size = 0;
+        c->length = length;
 
-done:
+        out.buf = b;
+        out.next = NULL;
 
-    fcn->expire = ngx_time() + cache->inactive;
+        rc = ngx_http_output_filter(r, &out);
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        if (done) {
+            ngx_http_file_cache_fill_release(c);
+            return rc;
+        }
 
-    c->uniq = fcn->uniq;
-    c->error = fcn->error;
-    c->node = fcn;
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+}
 
-failed:
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+static void
+ngx_http_file_cache_fill_sleep(ngx_http_cache_t *c, ngx_msec_t timer)
+{
+    if (!c->queued) {
+        ngx_queue_insert_tail(&ngx_http_file_cache_waiters, &c->queue);
+        c->queued = 1;
+    }
 
-    return rc;
+    ngx_add_timer(&c->wait_event, timer);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+static void
+ngx_http_file_cache_fill_unqueue(ngx_http_cache_t *c)
 {
-    u_char            *p;
-    ngx_http_cache_t  *c;
+    ngx_event_t  *ev;
 
-    c = r->cache;
+    ev = &c->wait_event;
 
-    if (c->file.name.len) {
-        return NGX_OK;
+    if (c->queued) {
+        ngx_queue_remove(&c->queue);
+        c->queued = 0;
     }
 
-    c->file.name.len = path->name.len + 1 + path->len
-                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
 
-    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
-    if (c->file.name.data == NULL) {
-        return NGX_ERROR;
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
     }
+}
 
-    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
 
-    p = c->file.name.data + path->name.len + 1 + path->len;
-    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
-    *p = '\0';
+static void
+ngx_http_file_cache_fill_release(ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
 
-    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+    cache = c->file_cache;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "cache file: \"%s\"", c->file.name.data);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    return NGX_OK;
+    ngx_http_file_cache_fill_free_locked(cache, c->fill);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->fill = NULL;
 }
 
 
-static ngx_http_file_cache_node_t *
-ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+static uint64_t
+ngx_http_file_cache_fill_detach_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_temp_file_t *tf)
 {
-    ngx_int_t                    rc;
-    ngx_rbtree_key_t             node_key;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    uint64_t                     mask;
+    ngx_http_file_cache_fill_t  *fill;
 
-    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+    fill = fcn->fill;
 
-    node = cache->sh->rbtree.root;
-    sentinel = cache->sh->rbtree.sentinel;
+    if (fill == NULL) {
+        return 0;
+    }
 
-    while (node != sentinel) {
+    if (tf) {
+        fill->length = tf->offset;
+        fill->done = 1;
 
-        if (node_key < node->key) {
-            node = node->left;
-            continue;
-        }
+    } else {
+        fill->error = 1;
+    }
 
-        if (node_key > node->key) {
-            node = node->right;
-            continue;
-        }
+    mask = fill->waiting;
+    fill->waiting = 0;
 
-        /* node_key == node->key */
+    fcn->fill = NULL;
 
-        fcn = (ngx_http_file_cache_node_t *) node;
+    ngx_http_file_cache_fill_free_locked(cache, fill);
 
-        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
-                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    return mask;
+}
 
-        if (rc == 0) {
-            return fcn;
-        }
 
-        node = (rc < 0) ? node->left : node->right;
+static void
+ngx_http_file_cache_fill_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_fill_t *fill)
+{
+    if (--fill->count) {
+        return;
     }
 
-    /* not found */
+    if (fill->name) {
+        ngx_slab_free_locked(cache->shpool, fill->name);
+    }
 
-    return NULL;
+    ngx_slab_free_locked(cache->shpool, fill);
 }
 
 
 static void
-ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+ngx_http_file_cache_fill_notify(ngx_http_file_cache_node_t *fcn,
+    uint64_t mask, ngx_log_t *log)
 {
-    ngx_rbtree_node_t           **p;
-    ngx_http_file_cache_node_t   *cn, *cnt;
+    ngx_int_t          slot;
+    ngx_queue_t       *q;
+    ngx_event_t       *ev;
+    ngx_http_cache_t  *c;
 
-    for ( ;; ) {
+    for (slot = 0; mask; slot++, mask >>= 1) {
 
-        if (node->key < temp->key) {
+        if ((mask & 1) == 0) {
+            continue;
+        }
 
-            p = &temp->left;
+        if (slot != ngx_process_slot) {
+            ngx_channel_wakeup(slot, log);
+            continue;
+        }
 
-        } else if (node->key > temp->key) {
+        for (q = ngx_queue_head(&ngx_http_file_cache_waiters);
+             q != ngx_queue_sentinel(&ngx_http_file_cache_waiters);
+             q = ngx_queue_next(q))
+        {
+            c = ngx_queue_data(q, ngx_http_cache_t, queue);
 
-            p = &temp->right;
+            if (c->node == fcn) {
+                ev = &c->wait_event;
+                ngx_post_event(ev, &ngx_posted_events);
+            }
+        }
+    }
+}
 
-        } else { /* node->key == temp->key */
 
-            cn = (ngx_http_file_cache_node_t *) node;
-            cnt = (ngx_http_file_cache_node_t *) temp;
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_queue_t       *q;
+    ngx_event_t       *wev;
+    ngx_http_cache_t  *c;
 
-            p = (ngx_memcmp(cn->key, cnt->key,
-                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
-                 < 0)
-                    ? &temp->left : &temp->right;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache wakeup");
 
-        if (*p == sentinel) {
-            break;
-        }
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiters);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiters);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, queue);
 
-        temp = *p;
+        wev = &c->wait_event;
+        ngx_post_event(wev, &ngx_posted_events);
     }
-
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
 }
 
 
-void
-ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+static ngx_int_t
+ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+    time_t                         now;
+    ssize_t                        n;
+    ngx_int_t                      rc;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t  *h;
 
-    u_char            *p;
-    ngx_str_t         *key;
-    ngx_uint_t         i;
-    ngx_http_cache_t  *c;
+    if (c->memory && c->file.fd == NGX_INVALID_FILE) {
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache set header");
+        /* the object has been copied from the memory zone */
 
-    c = r->cache;
+        n = (ssize_t) c->length;
 
-    h->valid_sec = c->valid_sec;
-    h->last_modified = c->last_modified;
-    h->date = c->date;
-    h->crc32 = c->crc32;
-    h->valid_msec = (u_short) c->valid_msec;
-    h->header_start = (u_short) c->header_start;
-    h->body_start = (u_short) c->body_start;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
 
-    p = buf + sizeof(ngx_http_file_cache_header_t);
+        if (n == NGX_ERROR) {
+            ngx_http_file_cache_disk_error(c->file_cache, c->disk,
+                                           r->connection->log);
+        }
 
-    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+        if (n < 0) {
+            return n;
+        }
 
-    key = c->keys.elts;
-    for (i = 0; i < c->keys.nelts; i++) {
-        p = ngx_copy(p, key[i].data, key[i].len);
+        if (c->memory && (off_t) n != c->length) {
+            c->memory = 0;
+        }
     }
 
-    *p = LF;
-}
+    if ((size_t) n < c->header_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" is too small", c->file.name.data);
+        return NGX_DECLINED;
+    }
 
+    h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
-void
-ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->crc32 != c->crc32) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has md5 collision", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->body_start > c->body_start) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has too long header",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    if (!ngx_queue_empty(&cache->sh->purges)) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        rc = ngx_http_file_cache_purged_locked(cache, c, h->date);
+
+        if (rc == NGX_OK) {
+            ngx_http_file_cache_purge_node_locked(cache, c->node);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (rc == NGX_OK) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache purged: \"%s\"",
+                           c->file.name.data);
+            return NGX_DECLINED;
+        }
+    }
+
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
+    if (!c->counted) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (c->secondary) {
+            cache->sh->stat.variant_hit++;
+        }
+
+        cache->sh->stat.hit++;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        c->counted = 1;
+    }
+
+    c->buf->last += n;
+
+    c->valid_sec = h->valid_sec;
+    c->updating_sec = h->updating_sec;
+    c->error_sec = h->error_sec;
+    c->last_modified = h->last_modified;
+    c->date = h->date;
+    c->valid_msec = h->valid_msec;
+    c->header_start = h->header_start;
+    c->body_start = h->body_start;
+    c->etag.len = h->etag_len;
+    c->etag.data = h->etag;
+
+    r->cached = 1;
+
+    if (cache->sh->cold && !c->filling) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (!c->node->exists) {
+            c->node->uses = 1;
+            c->node->body_start = c->body_start;
+            c->node->exists = 1;
+            c->node->uniq = c->uniq;
+            c->node->fs_size = c->fs_size;
+            c->node->disk = c->disk;
+
+            cache->sh->size += c->fs_size;
+            cache->sh->disks[c->disk].size += c->fs_size;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    now = ngx_time();
+
+    if (c->valid_sec < now) {
+
+        c->stale_updating = (c->valid_sec + c->updating_sec >= now);
+        c->stale_error = (c->valid_sec + c->error_sec >= now);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        /*
+         * the background subrequest takes the update over
+         * from the request that has spawned it
+         */
+
+        if (c->node->updating && !r->background) {
+            rc = NGX_HTTP_CACHE_UPDATING;
+
+        } else {
+            c->node->updating = 1;
+            c->updating = 1;
+            rc = NGX_HTTP_CACHE_STALE;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache expired: %i %T %T",
+                       rc, c->valid_sec, now);
+
+        return rc;
+    }
+
+    if (c->memory && c->file.fd != NGX_INVALID_FILE) {
+        ngx_http_file_cache_mem_store(r, c);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    off_t                   fs_size;
-    ngx_int_t               rc;
-    ngx_file_uniq_t         uniq;
-    ngx_file_info_t         fi;
-    ngx_http_cache_t        *c;
-    ngx_ext_rename_file_t   ext;
     ngx_http_file_cache_t  *cache;
 
-    c = r->cache;
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
 
-    if (c->updated) {
-        return;
+    /* the primary entry names another variant, look it up by its own key */
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    /* the fill of the primary entry has nothing to do with the variant */
+
+    if (c->fill) {
+        ngx_http_file_cache_fill_release(c);
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update");
+    if (c->filling) {
+        ngx_pool_run_cleanup_file(r->pool, c->file.fd);
+        c->filling = 0;
+    }
 
-    c->updated = 1;
-    c->updating = 0;
+    c->secondary = 1;
+    c->exists = 0;
+    c->uses = 0;
+    c->buf = NULL;
+    c->memory = 0;
+    c->file.fd = NGX_INVALID_FILE;
+    c->file.name.len = 0;
+    c->body_start = c->buffer_size;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    uint64_t                     mask;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the response does not vary the way the primary entry said,
+     * so it is stored under the primary key
+     */
 
     cache = c->file_cache;
+    fcn = c->node;
+    mask = 0;
 
-    uniq = 0;
-    fs_size = 0;
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn->count--;
+
+    if (c->updating) {
+        fcn->updating = 0;
+
+        mask = ngx_http_file_cache_fill_detach_locked(cache, fcn, NULL);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (mask) {
+        ngx_http_file_cache_fill_notify(fcn, mask, r->connection->log);
+    }
+
+    c->node = NULL;
+    c->updating = 0;
+    c->secondary = 0;
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    if (ngx_http_file_cache_exists(cache, c) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return ngx_http_file_cache_name(r, cache->disks[c->disk].path);
+}
+
+
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache rename: \"%s\" to \"%s\"",
-                   tf->file.name.data, c->file.name.data);
+                   "http file cache vary: \"%*s\"", len, vary);
 
-    ext.access = NGX_FILE_OWNER_ACCESS;
-    ext.path_access = NGX_FILE_OWNER_ACCESS;
-    ext.time = -1;
-    ext.create_path = 1;
-    ext.delete_file = 1;
-    ext.log = r->connection->log;
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
 
-    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    ngx_strlow(buf, vary, len);
 
-    if (rc == NGX_OK) {
+    p = buf;
+    last = buf + len;
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+    for ( ;; ) {
 
-            rc = NGX_ERROR;
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
 
-        } else {
-            uniq = ngx_file_uniq(&fi);
-            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        name.data = p;
+
+        while (p < last && *p != ' ' && *p != ',') {
+            p++;
+        }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
         }
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, CRLF, sizeof(CRLF) - 1);
     }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    ngx_md5_final(hash, &md5);
+}
 
-    c->node->count--;
-    c->node->uniq = uniq;
-    c->node->body_start = c->body_start;
 
-    cache->sh->size += fs_size - c->node->fs_size;
-    c->node->fs_size = fs_size;
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    u_char           *p, *last;
+    ngx_uint_t        i, n;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    n = 0;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].key.len != name->len
+            || ngx_strncmp(header[i].lowcase_key, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        while (last > p && *(last - 1) == ' ') {
+            last--;
+        }
+
+        if (n++) {
+            ngx_md5_update(md5, ",", sizeof(",") - 1);
+        }
+
+        ngx_md5_update(md5, p, last - p);
+    }
+}
+
+
+ngx_int_t
+ngx_http_file_cache_vary_normalize(ngx_http_request_t *r)
+{
+    ngx_uint_t                              i;
+    ngx_list_part_t                        *part;
+    ngx_table_elt_t                        *header;
+    ngx_http_file_cache_vary_normalizer_t  *vn;
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        for (vn = ngx_http_file_cache_vary_normalizers; vn->handler; vn++) {
+
+            if (header[i].key.len != vn->name.len
+                || ngx_strncmp(header[i].lowcase_key, vn->name.data,
+                               vn->name.len)
+                   != 0)
+            {
+                continue;
+            }
+
+            if (vn->handler(r, &header[i].value) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_vary_accept_encoding(ngx_http_request_t *r,
+    ngx_str_t *value)
+{
+    u_char      *p, *last, *start, *end;
+    ngx_uint_t   gzip;
+
+    /* the clients are only told apart by whether they accept gzip */
+
+    gzip = 0;
+
+    p = value->data;
+    last = p + value->len;
+
+    while (p < last && !gzip) {
+
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ' ' && *p != ',' && *p != ';') {
+            p++;
+        }
+
+        end = p;
+
+        while (p < last && *p != ',') {
+            p++;
+        }
+
+        if (!((end - start == 4
+               && ngx_strncasecmp(start, (u_char *) "gzip", 4) == 0)
+              || (end - start == 6
+                  && ngx_strncasecmp(start, (u_char *) "x-gzip", 6) == 0)))
+        {
+            continue;
+        }
+
+        /* the "q=0" parameter refuses the coding */
+
+        gzip = 1;
+
+        for (start = end; start + 2 < p; start++) {
+
+            if (ngx_strncmp(start, "q=", 2) != 0) {
+                continue;
+            }
+
+            for (start += 2; start < p; start++) {
+                if (*start != '0' && *start != '.') {
+                    break;
+                }
+            }
+
+            if (start == p || *start == ' ' || *start == ';') {
+                gzip = 0;
+            }
+
+            break;
+        }
+    }
+
+    if (gzip) {
+        ngx_str_set(value, "gzip");
+
+    } else {
+        ngx_str_set(value, "identity");
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache accept encoding: \"%V\"", value);
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+#if (NGX_HAVE_FILE_AIO)
+    ssize_t                    n;
+#endif
+    size_t                     size;
+#if (NGX_HAVE_FILE_AIO || NGX_THREAD_POOL)
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+#endif
+
+    size = c->buf->end - c->buf->pos;
+
+#if (NGX_THREAD_POOL)
+
+    if (clcf->aio == NGX_HTTP_AIO_THREADS) {
+        c->file.thread_handler = ngx_http_cache_thread_handler;
+        c->file.thread_ctx = r;
+
+        return ngx_thread_read(&c->file, c->buf->pos, size, 0, r->pool);
+    }
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+
+    if (!ngx_file_aio) {
+        goto noaio;
+    }
+
+    if (clcf->aio != NGX_HTTP_AIO_ON && clcf->aio != NGX_HTTP_AIO_SENDFILE) {
+        goto noaio;
+    }
+
+    n = ngx_file_aio_read(&c->file, c->buf->pos, size, 0, r->pool);
+
+    if (n != NGX_AGAIN) {
+        return n;
+    }
+
+    c->file.aio->data = r;
+    c->file.aio->handler = ngx_http_cache_aio_event_handler;
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_AGAIN;
+
+noaio:
+
+#endif
+
+    return ngx_read_file(&c->file, c->buf->pos, size, 0);
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_http_cache_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_event_aio_t     *aio;
+    ngx_http_request_t  *r;
+
+    aio = ev->data;
+    r = aio->data;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->connection->write->handler(r->connection->write);
+}
+
+#endif
+
+
+#if (NGX_THREAD_POOL)
+
+static ngx_int_t
+ngx_http_cache_thread_handler(ngx_thread_task_t *task, ngx_file_t *file)
+{
+    ngx_str_t                  name;
+    ngx_thread_pool_t         *tp;
+    ngx_http_request_t        *r;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    r = file->thread_ctx;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    tp = clcf->thread_pool;
+
+    if (tp == NULL) {
+        ngx_str_set(&name, "default");
+
+        tp = ngx_thread_pool_get((ngx_cycle_t *) ngx_cycle, &name);
+
+        if (tp == NULL) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "thread pool \"%V\" not found", &name);
+            return NGX_ERROR;
+        }
+    }
+
+    task->event.data = r;
+    task->event.handler = ngx_http_cache_thread_event_handler;
+
+    if (ngx_thread_task_post(tp, task) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_cache_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->connection->write->handler(r->connection->write);
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_int_t                    rc;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn == NULL) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->tinylfu) {
+            ngx_http_file_cache_sketch_add(cache->sh->sketch, c->key);
+        }
+    }
+
+    if (fcn) {
+        ngx_queue_remove(&fcn->queue);
+
+        if (c->node == NULL) {
+            fcn->uses++;
+            fcn->count++;
+        }
+
+        if (fcn->error) {
+
+            if (fcn->valid_sec < ngx_time()) {
+                goto renew;
+            }
+
+            rc = NGX_OK;
+
+            goto done;
+        }
+
+        if (fcn->exists || fcn->uses >= c->min_uses) {
+
+            c->exists = fcn->exists && !fcn->purged;
+            if (fcn->body_start) {
+                c->body_start = fcn->body_start;
+            }
+
+            rc = NGX_OK;
+
+            if (!fcn->exists && !fcn->updating && c->node == NULL
+                && ngx_http_file_cache_admit_locked(cache, c->key) != NGX_OK)
+            {
+                rc = NGX_AGAIN;
+            }
+
+            goto done;
+        }
+
+        rc = NGX_AGAIN;
+
+        goto done;
+    }
+
+    fcn = ngx_slab_alloc_locked(cache->shpool,
+                                sizeof(ngx_http_file_cache_node_t));
+    if (fcn == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        (void) ngx_http_file_cache_forced_expire(cache, -1);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        fcn = ngx_slab_alloc_locked(cache->shpool,
+                                    sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            rc = NGX_ERROR;
+            goto failed;
+        }
+    }
+
+    ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+    fcn->uses = 1;
+    fcn->count = 1;
+    fcn->updating = 0;
+    fcn->deleting = 0;
+    fcn->hot = 0;
+    fcn->disk = 0;
+    fcn->purged = 0;
+    fcn->vary = 0;
+    fcn->fill = NULL;
+    fcn->tags = NULL;
+
+renew:
+
+    rc = NGX_DECLINED;
+
+    if (fcn->hot) {
+        cache->sh->hot_size -= fcn->fs_size;
+        fcn->hot = 0;
+    }
+
+    fcn->valid_msec = 0;
+    fcn->error = 0;
+    fcn->exists = 0;
+    fcn->valid_sec = 0;
+    fcn->uniq = 0;
+    fcn->body_start = 0;
+    fcn->fs_size = 0;
+
+    if (ngx_http_file_cache_admit_locked(cache, c->key) != NGX_OK) {
+        rc = NGX_AGAIN;
+    }
+
+done:
+
+    fcn->expire = ngx_time() + cache->inactive;
+
+    if (cache->ndisks > 1) {
+
+        if (!fcn->exists) {
+            c->disk = ngx_http_file_cache_disk_locked(cache, c->key);
+
+        } else if (cache->sh->disks[fcn->disk].down) {
+
+            /*
+             * the entry is on a disk out of rotation: it is not moved
+             * to another disk, as the file would be left there, so the
+             * response is not cached until the disk is back in rotation
+             */
+
+            c->exists = 0;
+            c->disk = fcn->disk;
+            rc = NGX_AGAIN;
+
+        } else {
+            c->disk = fcn->disk;
+        }
+    }
+
+    /* a hit of a varying entry is counted once its variant is checked */
+
+    if (c->node == NULL && !c->counted && !(c->exists && fcn->vary)) {
+
+        if (c->secondary) {
+            if (c->exists) {
+                cache->sh->stat.variant_hit++;
+
+            } else {
+                cache->sh->stat.variant_miss++;
+            }
+        }
+
+        if (c->exists) {
+            cache->sh->stat.hit++;
+
+        } else {
+            cache->sh->stat.miss++;
+        }
+
+        c->counted = 1;
+    }
+
+    ngx_http_file_cache_insert_locked(cache, fcn,
+                                      c->node == NULL && c->exists);
+
+    c->uniq = fcn->uniq;
+    c->uses = fcn->uses;
+    c->error = fcn->error;
+    c->node = fcn;
+
+failed:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_insert_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t hit)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *tail;
+
+    if (fcn->hot && !cache->slru) {
+        cache->sh->hot_size -= fcn->fs_size;
+        fcn->hot = 0;
+    }
+
+    if (fcn->hot) {
+        ngx_queue_insert_head(&cache->sh->hot, &fcn->queue);
+        return;
+    }
+
+    if (!hit || !cache->slru) {
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        return;
+    }
+
+    /*
+     * a hit moves an entry from the probationary queue to the protected
+     * one, the least recently used protected entries are moved back
+     */
+
+    fcn->hot = 1;
+    cache->sh->hot_size += fcn->fs_size;
+    cache->sh->stat.promoted++;
+
+    ngx_queue_insert_head(&cache->sh->hot, &fcn->queue);
+
+    while (cache->sh->hot_size > cache->hot_max_size) {
+
+        q = ngx_queue_last(&cache->sh->hot);
+
+        if (q == &fcn->queue) {
+            break;
+        }
+
+        tail = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        tail->hot = 0;
+        cache->sh->hot_size -= tail->fs_size;
+        cache->sh->stat.demoted++;
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&cache->sh->queue, q);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_admit_locked(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       victim[NGX_HTTP_CACHE_KEY_LEN];
+
+    if (!cache->tinylfu
+        || cache->sh->size < cache->max_size - cache->max_size / 16)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the cache is full, so a new entry is only admitted if it has been
+     * requested more often than the entry it is going to evict
+     */
+
+    if (!ngx_queue_empty(&cache->sh->queue)) {
+        q = ngx_queue_last(&cache->sh->queue);
+
+    } else if (!ngx_queue_empty(&cache->sh->hot)) {
+        q = ngx_queue_last(&cache->sh->hot);
+
+    } else {
+        return NGX_OK;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    ngx_memcpy(victim, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&victim[sizeof(ngx_rbtree_key_t)], fcn->key,
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    if (ngx_http_file_cache_sketch_estimate(cache->sh->sketch, key)
+        > ngx_http_file_cache_sketch_estimate(cache->sh->sketch, victim))
+    {
+        return NGX_OK;
+    }
+
+    cache->sh->stat.rejected++;
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_sketch_init(ngx_http_file_cache_t *cache, size_t size)
+{
+    ngx_uint_t                     n, width;
+    ngx_http_file_cache_sketch_t  *sketch;
+
+    /*
+     * four rows of 4-bit counters, each row has at least as many counters
+     * as there may be nodes in the zone
+     */
+
+    n = size / sizeof(ngx_http_file_cache_node_t);
+
+    for (width = 64; width < n; width <<= 1) { /* void */ }
+
+    sketch = ngx_slab_alloc(cache->shpool,
+                            sizeof(ngx_http_file_cache_sketch_t) + 2 * width);
+    if (sketch == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(sketch->counters, 2 * width);
+
+    sketch->mask = width - 1;
+    sketch->additions = 0;
+    sketch->sample = 10 * width;
+
+    cache->sh->sketch = sketch;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_sketch_add(ngx_http_file_cache_sketch_t *sketch,
+    u_char *key)
+{
+    u_char      *p;
+    uint32_t     hash[4];
+    ngx_uint_t   i, n, shift;
+
+    /* the md5 key gives four independent hashes */
+
+    ngx_memcpy(hash, key, sizeof(hash));
+
+    for (i = 0; i < 4; i++) {
+        n = i * (sketch->mask + 1) + (hash[i] & sketch->mask);
+
+        p = &sketch->counters[n / 2];
+        shift = (n & 1) * 4;
+
+        if (((*p >> shift) & 0x0f) != 0x0f) {
+            *p += 1 << shift;
+        }
+    }
+
+    if (++sketch->additions < sketch->sample) {
+        return;
+    }
+
+    /* halve all counters to let the past popularity fade */
+
+    n = 2 * (sketch->mask + 1);
+
+    for (i = 0; i < n; i++) {
+        sketch->counters[i] = (sketch->counters[i] >> 1) & 0x77;
+    }
+
+    sketch->additions /= 2;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_estimate(ngx_http_file_cache_sketch_t *sketch,
+    u_char *key)
+{
+    uint32_t     hash[4];
+    ngx_uint_t   i, n, count, min;
+
+    ngx_memcpy(hash, key, sizeof(hash));
+
+    min = 0x0f;
+
+    for (i = 0; i < 4; i++) {
+        n = i * (sketch->mask + 1) + (hash[i] & sketch->mask);
+
+        count = (sketch->counters[n / 2] >> ((n & 1) * 4)) & 0x0f;
+
+        if (count < min) {
+            min = count;
+        }
+    }
+
+    return min;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_disk_locked(ngx_http_file_cache_t *cache, u_char *key)
+{
+    uint32_t    hash;
+    uint64_t    total, w;
+    ngx_uint_t  i;
+
+    /* the disks in rotation are selected by the key hash and capacity */
+
+    total = 0;
+
+    for (i = 0; i < cache->ndisks; i++) {
+        if (!cache->sh->disks[i].down) {
+            total += cache->disks[i].weight;
+        }
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    ngx_memcpy(&hash, &key[NGX_HTTP_CACHE_KEY_LEN - sizeof(uint32_t)],
+               sizeof(uint32_t));
+
+    w = ((uint64_t) hash * total) >> 32;
+
+    for (i = 0; i < cache->ndisks; i++) {
+
+        if (cache->sh->disks[i].down) {
+            continue;
+        }
+
+        if (w < cache->disks[i].weight) {
+            return i;
+        }
+
+        w -= cache->disks[i].weight;
+    }
+
+    return 0;
+}
+
+
+static void
+ngx_http_file_cache_disk_error(ngx_http_file_cache_t *cache, ngx_uint_t disk,
+    ngx_log_t *log)
+{
+    ngx_uint_t  down;
+
+    if (cache->ndisks == 1) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    down = (cache->sh->disks[disk].down == 0);
+
+    if (down) {
+        cache->sh->disks[disk].down = ngx_time();
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (down) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      "cache disk \"%V\" is taken out of rotation",
+                      &cache->disks[disk].path->name);
+    }
+}
+
+
+static void
+ngx_http_file_cache_disk_probe(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name;
+    time_t                       now;
+    ngx_fd_t                     fd;
+    ngx_err_t                    err;
+    ngx_uint_t                   i;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_disk_t  *disk;
+
+    now = ngx_time();
+
+    for (i = 0; i < cache->ndisks; i++) {
+
+        if (cache->sh->disks[i].down == 0
+            || now - cache->sh->disks[i].down < NGX_HTTP_FILE_CACHE_DISK_RETRY)
+        {
+            continue;
+        }
+
+        /* a disk is back in rotation once a file can be written there */
+
+        disk = &cache->disks[i];
+        path = disk->temp_path;
+
+        name = ngx_alloc(path->name.len + sizeof("/probe"), ngx_cycle->log);
+        if (name == NULL) {
+            return;
+        }
+
+        ngx_sprintf(name, "%V/probe%Z", &path->name);
+
+        err = 0;
+
+        fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                           NGX_FILE_OWNER_ACCESS);
+
+        if (fd == NGX_INVALID_FILE) {
+            err = ngx_errno;
+
+        } else {
+
+            if (ngx_write_fd(fd, name, path->name.len) == -1) {
+                err = ngx_errno;
+            }
+
+            if (ngx_close_file(fd) == NGX_FILE_ERROR && err == 0) {
+                err = ngx_errno;
+            }
+
+            if (ngx_delete_file(name) == NGX_FILE_ERROR && err == 0) {
+                err = ngx_errno;
+            }
+        }
+
+        ngx_free(name);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        cache->sh->disks[i].down = err ? now : 0;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (err) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                          "cache disk \"%V\" is still failing",
+                          &disk->path->name);
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "cache disk \"%V\" is back in rotation",
+                      &disk->path->name);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
+{
+    u_char            *p;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    if (c->file.name.len) {
+        return NGX_OK;
+    }
+
+    c->file.name.len = path->name.len + 1 + path->len
+                       + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    c->file.name.data = ngx_pnalloc(r->pool, c->file.name.len + 1);
+    if (c->file.name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(c->file.name.data, path->name.data, path->name.len);
+
+    p = c->file.name.data + path->name.len + 1 + path->len;
+    p = ngx_hex_dump(p, c->key, NGX_HTTP_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, c->file.name.data, c->file.name.len);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "cache file: \"%s\"", c->file.name.data);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_file_cache_name_alloc(ngx_http_file_cache_t *cache)
+{
+    size_t       len, max;
+    ngx_uint_t   i;
+    ngx_path_t  *path;
+
+    max = 0;
+
+    for (i = 0; i < cache->ndisks; i++) {
+        path = cache->disks[i].path;
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+        if (len > max) {
+            max = len;
+        }
+    }
+
+    return ngx_alloc(max + 1, ngx_cycle->log);
+}
+
+
+static ngx_http_file_cache_node_t *
+ngx_http_file_cache_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_key_t             node_key;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        fcn = (ngx_http_file_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return fcn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    /* not found */
+
+    return NULL;
+}
+
+
+static void
+ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_file_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_file_cache_node_t *) node;
+            cnt = (ngx_http_file_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+ngx_int_t
+ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
+{
+    ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
+
+    u_char            *p;
+    ngx_str_t         *key;
+    ngx_uint_t         i;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache set header");
+
+    c = r->cache;
+
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
+    h->valid_sec = c->valid_sec;
+    h->updating_sec = c->updating_sec;
+    h->error_sec = c->error_sec;
+    h->last_modified = c->last_modified;
+    h->date = c->date;
+    h->crc32 = c->crc32;
+    h->valid_msec = (u_short) c->valid_msec;
+    h->header_start = (u_short) c->header_start;
+    h->body_start = (u_short) c->body_start;
+
+    if (c->etag.len <= NGX_HTTP_CACHE_ETAG_LEN) {
+        h->etag_len = (u_char) c->etag.len;
+        ngx_memcpy(h->etag, c->etag.data, c->etag.len);
+    }
+
+    if (c->vary.len) {
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    p = buf + sizeof(ngx_http_file_cache_header_t);
+
+    p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
+
+    key = c->keys.elts;
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_copy(p, key[i].data, key[i].len);
+    }
+
+    *p = LF;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_file_cache_fill(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    u_char                      *name;
+    uint64_t                     mask;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
+
+    c = r->cache;
+
+    /* the fill is created by the waiting requests only */
+
+    if (!c->updating
+        || c->node->fill == NULL
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
+
+    cache = c->file_cache;
+    mask = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fill = c->node->fill;
+
+    if (fill == NULL) {
+        goto done;
+    }
+
+    if (fill->name == NULL) {
+        name = ngx_slab_alloc_locked(cache->shpool, tf->file.name.len + 1);
+        if (name == NULL) {
+            goto done;
+        }
+
+        ngx_cpystrn(name, tf->file.name.data, tf->file.name.len + 1);
+
+        fill->name = name;
+        fill->length = -1;
+    }
+
+    if (fill->length != tf->offset) {
+        fill->length = tf->offset;
+
+        mask = fill->waiting;
+        fill->waiting = 0;
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: %O w:%uL", tf->offset, mask);
+
+    if (mask) {
+        ngx_http_file_cache_fill_notify(c->node, mask, r->connection->log);
+    }
+}
+
+
+void
+ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
+{
+    off_t                   fs_size;
+    uint64_t                mask;
+    ngx_int_t               rc;
+    ngx_file_uniq_t         uniq;
+    ngx_file_info_t         fi;
+    ngx_http_cache_t        *c;
+    ngx_ext_rename_file_t   ext;
+    ngx_http_file_cache_t  *cache;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update");
+
+    c->updated = 1;
+    c->updating = 0;
+
+    cache = c->file_cache;
+
+    uniq = 0;
+    fs_size = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache rename: \"%s\" to \"%s\"",
+                   tf->file.name.data, c->file.name.data);
+
+    ext.access = NGX_FILE_OWNER_ACCESS;
+    ext.path_access = NGX_FILE_OWNER_ACCESS;
+    ext.time = -1;
+    ext.create_path = 1;
+    ext.delete_file = 1;
+    ext.log = r->connection->log;
+
+    rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+
+    if (rc != NGX_OK) {
+        ngx_http_file_cache_disk_error(cache, c->disk, r->connection->log);
+
+    } else {
+
+        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+
+            rc = NGX_ERROR;
+
+        } else {
+            uniq = ngx_file_uniq(&fi);
+            fs_size = (ngx_file_fs_size(&fi) + cache->bsize - 1) / cache->bsize;
+        }
+    }
+
+    if (cache->mem_shpool) {
+        ngx_http_file_cache_mem_delete(cache, c->key);
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->uniq = uniq;
+    c->node->body_start = c->body_start;
+
+    cache->sh->size += fs_size - c->node->fs_size;
+
+    if (c->node->hot) {
+        cache->sh->hot_size += fs_size - c->node->fs_size;
+    }
+
+    cache->sh->disks[c->node->disk].size -= c->node->fs_size;
+    cache->sh->disks[c->disk].size += fs_size;
+
+    c->node->fs_size = fs_size;
+    c->node->disk = c->disk;
+
+    if (rc == NGX_OK) {
+        c->node->exists = 1;
+        c->node->purged = 0;
+        c->node->vary = c->vary.len ? 1 : 0;
+
+        ngx_http_file_cache_tags_free_locked(cache, c->node);
+
+        if (c->tags.len) {
+            ngx_http_file_cache_tags_add_locked(cache, c->node, &c->tags);
+        }
+    }
+
+    c->node->updating = 0;
+
+    /* the readers of the temp file already have it open */
+
+    mask = ngx_http_file_cache_fill_detach_locked(cache, c->node, tf);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (mask) {
+        ngx_http_file_cache_fill_notify(c->node, mask, r->connection->log);
+    }
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_uniq_t                uniq;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_header_t   h;
+
+    c = r->cache;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    uniq = c->node->uniq;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /* make sure cache file wasn't replaced */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (uniq != ngx_file_uniq(&fi)
+        || uniq != c->uniq
+        || c->length != ngx_file_size(&fi))
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" changed",
+                       file.name.data);
+        goto done;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto done;
+    }
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, sizeof(ngx_http_file_cache_header_t), file.name.data);
+        goto done;
+    }
+
+    if (h.version != NGX_HTTP_CACHE_VERSION
+        || h.last_modified != c->last_modified
+        || h.crc32 != c->crc32
+        || h.header_start != c->header_start
+        || h.body_start != c->body_start)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache \"%s\" content changed",
+                       file.name.data);
+        goto done;
+    }
+
+    /* update cache file header with new data, the body is kept as is */
+
+    h.valid_sec = c->valid_sec;
+    h.updating_sec = c->updating_sec;
+    h.error_sec = c->error_sec;
+    h.valid_msec = (u_short) c->valid_msec;
+    h.date = c->date;
+
+    (void) ngx_write_file(&file, (u_char *) &h,
+                          sizeof(ngx_http_file_cache_header_t), 0);
+
+    if (cache->mem_shpool) {
+        ngx_http_file_cache_mem_delete(cache, c->key);
+    }
+
+done:
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+}
+
+
+ngx_int_t
+ngx_http_cache_send(ngx_http_request_t *r)
+{
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_chain_t        out;
+    ngx_event_t       *ev;
+    ngx_http_cache_t  *c;
+
+    c = r->cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache send: %s", c->file.name.data);
+
+    if (r != r->main && c->length - c->body_start == 0) {
+        return ngx_http_send_header(r);
+    }
+
+    /* we need to allocate all before the header would be sent */
+
+    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!c->memory) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (c->filling) {
+
+        /* multipart ranges need the whole body in a single buffer */
+
+        r->single_range = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    if (c->filling) {
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->fill_buf = b;
+        c->length = c->body_start;
+
+        ev = &c->wait_event;
+
+        ev->handler = ngx_http_file_cache_fill_wait_handler;
+        ev->data = r;
+        ev->log = r->connection->log;
+
+        /* the write event handler is set after the upstream returns */
+
+        ngx_post_event(ev, &ngx_posted_events);
+
+        return NGX_DONE;
+    }
+
+    if (c->memory) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->last;
+
+        b->memory = (b->last - b->pos) ? 1 : 0;
+        b->last_buf = (r == r->main) ? 1: 0;
+        b->last_in_chain = 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
+    b->file_pos = c->body_start;
+    b->file_last = c->length;
+
+    b->in_file = (c->length - c->body_start) ? 1: 0;
+    b->last_buf = (r == r->main) ? 1: 0;
+    b->last_in_chain = 1;
+
+    b->file->fd = c->file.fd;
+    b->file->name = c->file.name;
+    b->file->log = r->connection->log;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    uint64_t                     mask;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_http_file_cache_fill_unqueue(c);
+
+    if (c->fill) {
+        ngx_http_file_cache_fill_release(c);
+    }
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    mask = 0;
+
+    if (c->updating) {
+        fcn->updating = 0;
+
+        mask = ngx_http_file_cache_fill_detach_locked(cache, fcn, NULL);
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (mask) {
+        ngx_http_file_cache_fill_notify(fcn, mask, c->file.log);
+    }
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+}
+
+
+ngx_int_t
+ngx_http_file_cache_purge(ngx_http_request_t *r, ngx_str_t *tags)
+{
+    u_char                         *p;
+    size_t                          len;
+    ngx_int_t                       rc;
+    ngx_str_t                       name, *key;
+    ngx_uint_t                      i, exact;
+    ngx_queue_t                    *q;
+    ngx_http_cache_t               *c;
+    ngx_http_file_cache_t          *cache;
+    ngx_http_file_cache_tag_t      *tag;
+    ngx_http_file_cache_node_t     *fcn;
+    ngx_http_file_cache_purge_t    *purge;
+    ngx_http_file_cache_tag_ref_t  *ref;
+
+    c = r->cache;
+    cache = c->file_cache;
+
+    rc = NGX_DECLINED;
+
+    if (tags) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        while (ngx_http_file_cache_tag_next(tags, &name) == NGX_OK) {
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache purge tag: \"%V\"", &name);
+
+            tag = (ngx_http_file_cache_tag_t *)
+                      ngx_str_rbtree_lookup(&cache->sh->tags, &name,
+                                            ngx_crc32_short(name.data,
+                                                            name.len));
+            if (tag == NULL) {
+                continue;
+            }
+
+            for (q = ngx_queue_head(&tag->refs);
+                 q != ngx_queue_sentinel(&tag->refs);
+                 q = ngx_queue_next(q))
+            {
+                ref = ngx_queue_data(q, ngx_http_file_cache_tag_ref_t, queue);
+                ngx_http_file_cache_purge_node_locked(cache, ref->node);
+            }
+
+            rc = NGX_OK;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return rc;
+    }
+
+    key = c->keys.elts;
+    len = 0;
+
+    for (i = 0; i < c->keys.nelts; i++) {
+        len += key[i].len;
+    }
+
+    i = c->keys.nelts - 1;
+    exact = !(key[i].len && key[i].data[key[i].len - 1] == '*');
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (exact) {
+        fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (fcn == NULL || !fcn->exists || fcn->purged) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_DECLINED;
+        }
+
+        ngx_http_file_cache_purge_node_locked(cache, fcn);
+
+        if (!fcn->vary) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_OK;
+        }
+
+        /* the variants of an entry are only found by its key */
+
+    } else {
+
+        /*
+         * a key ending with "*" purges all entries stored so far
+         * whose keys start with the rest of it
+         */
+
+        len--;
+    }
+
+    purge = ngx_slab_alloc_locked(cache->shpool,
+                                  sizeof(ngx_http_file_cache_purge_t) + len);
+    if (purge == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    p = purge->data;
+
+    for (i = 0; i < c->keys.nelts; i++) {
+        p = ngx_cpymem(p, key[i].data, key[i].len);
+    }
+
+    purge->time = ngx_time();
+    purge->len = len;
+    purge->exact = exact;
+
+    ngx_queue_insert_tail(&cache->sh->purges, &purge->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache purge key: \"%*s\" exact:%ui",
+                   purge->len, purge->data, purge->exact);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_purge_node_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    if (!fcn->exists || fcn->purged) {
+        return;
+    }
+
+    fcn->purged = 1;
+
+    if (fcn->count) {
+        return;
+    }
+
+    /* an unused entry is left for the cache manager to delete */
+
+    fcn->expire = 0;
+
+    ngx_queue_remove(&fcn->queue);
+    ngx_queue_insert_tail(fcn->hot ? &cache->sh->hot : &cache->sh->queue,
+                          &fcn->queue);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_purged_locked(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, time_t date)
+{
+    u_char                       *p;
+    size_t                        len, n, total;
+    ngx_str_t                    *key;
+    ngx_uint_t                    i;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_purge_t  *purge;
+
+    key = c->keys.elts;
+    total = 0;
+
+    for (i = 0; i < c->keys.nelts; i++) {
+        total += key[i].len;
+    }
+
+    for (q = ngx_queue_head(&cache->sh->purges);
+         q != ngx_queue_sentinel(&cache->sh->purges);
+         q = ngx_queue_next(q))
+    {
+        purge = ngx_queue_data(q, ngx_http_file_cache_purge_t, queue);
+
+        if (purge->time < date || (purge->exact && purge->len != total)) {
+            continue;
+        }
+
+        p = purge->data;
+        len = purge->len;
+
+        for (i = 0; i < c->keys.nelts && len; i++) {
+            n = ngx_min(len, key[i].len);
+
+            if (ngx_memcmp(p, key[i].data, n) != 0) {
+                break;
+            }
+
+            p += n;
+            len -= n;
+        }
+
+        if (len == 0) {
+            return NGX_OK;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_purge_expire(ngx_http_file_cache_t *cache)
+{
+    time_t                        now;
+    ngx_queue_t                  *q;
+    ngx_http_file_cache_purge_t  *purge;
+
+    /*
+     * the entries stored before a prefix purge are either requested
+     * and purged, or are expired within the inactive time
+     */
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    while (!ngx_queue_empty(&cache->sh->purges)) {
+
+        q = ngx_queue_head(&cache->sh->purges);
+        purge = ngx_queue_data(q, ngx_http_file_cache_purge_t, queue);
+
+        if (purge->time + cache->inactive >= now) {
+            break;
+        }
+
+        ngx_queue_remove(q);
+        ngx_slab_free_locked(cache->shpool, purge);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_tag_next(ngx_str_t *tags, ngx_str_t *name)
+{
+    u_char  *p, *last;
+
+    p = tags->data;
+    last = p + tags->len;
+
+    while (p < last && (*p == ' ' || *p == '\t')) {
+        p++;
+    }
+
+    name->data = p;
+
+    while (p < last && *p != ' ' && *p != '\t') {
+        p++;
+    }
+
+    name->len = p - name->data;
+
+    tags->len = last - p;
+    tags->data = p;
+
+    return name->len ? NGX_OK : NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_tags_add_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_str_t *tags)
+{
+    uint32_t                        hash;
+    ngx_str_t                       s, name;
+    ngx_http_file_cache_tag_t      *tag;
+    ngx_http_file_cache_tag_ref_t  *ref;
+
+    s = *tags;
+
+    while (ngx_http_file_cache_tag_next(&s, &name) == NGX_OK) {
+
+        hash = ngx_crc32_short(name.data, name.len);
+
+        tag = (ngx_http_file_cache_tag_t *)
+                  ngx_str_rbtree_lookup(&cache->sh->tags, &name, hash);
+
+        if (tag == NULL) {
+            tag = ngx_slab_alloc_locked(cache->shpool,
+                                        sizeof(ngx_http_file_cache_tag_t)
+                                        + name.len);
+            if (tag == NULL) {
+                return;
+            }
+
+            ngx_memcpy(tag->data, name.data, name.len);
+
+            tag->sn.node.key = hash;
+            tag->sn.str.len = name.len;
+            tag->sn.str.data = tag->data;
+
+            ngx_queue_init(&tag->refs);
+
+            ngx_rbtree_insert(&cache->sh->tags, &tag->sn.node);
+        }
+
+        ref = ngx_slab_alloc_locked(cache->shpool,
+                                    sizeof(ngx_http_file_cache_tag_ref_t));
+        if (ref == NULL) {
+
+            if (ngx_queue_empty(&tag->refs)) {
+                ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+                ngx_slab_free_locked(cache->shpool, tag);
+            }
+
+            return;
+        }
+
+        ref->tag = tag;
+        ref->node = fcn;
+        ref->next = fcn->tags;
+        fcn->tags = ref;
+
+        ngx_queue_insert_tail(&tag->refs, &ref->queue);
+    }
+}
+
+
+static void
+ngx_http_file_cache_tags_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_tag_t      *tag;
+    ngx_http_file_cache_tag_ref_t  *ref, *next;
+
+    for (ref = fcn->tags; ref; ref = next) {
+        next = ref->next;
+        tag = ref->tag;
+
+        ngx_queue_remove(&ref->queue);
+
+        if (ngx_queue_empty(&tag->refs)) {
+            ngx_rbtree_delete(&cache->sh->tags, &tag->sn.node);
+            ngx_slab_free_locked(cache->shpool, tag);
+        }
+
+        ngx_slab_free_locked(cache->shpool, ref);
+    }
+
+    fcn->tags = NULL;
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    ngx_int_t disk)
+{
+    u_char                      *name;
+    time_t                       wait;
+    ngx_uint_t                   i, tries;
+    ngx_queue_t                 *q, *queue;
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache forced expire: %i", disk);
+
+    name = ngx_http_file_cache_name_alloc(cache);
+    if (name == NULL) {
+        return 10;
+    }
+
+    wait = 10;
+    tries = 20;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    /* the probationary entries are evicted before the protected ones */
+
+    for (i = 0; i < 2; i++) {
+
+        queue = i ? &cache->sh->hot : &cache->sh->queue;
+
+        for (q = ngx_queue_last(queue);
+             q != ngx_queue_sentinel(queue);
+             q = ngx_queue_prev(q))
+        {
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+            if (disk != -1 && fcn->disk != (ngx_uint_t) disk) {
+                continue;
+            }
+
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+            if (fcn->count == 0) {
+                ngx_http_file_cache_delete(cache, q, name);
+                wait = 0;
+
+            } else {
+                if (--tries) {
+                    continue;
+                }
+
+                wait = 1;
+            }
+
+            goto done;
+        }
+    }
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_queue_t                 *q, *h;
+    ngx_http_file_cache_node_t  *fcn, *hcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    name = ngx_http_file_cache_name_alloc(cache);
+    if (name == NULL) {
+        return 10;
+    }
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        q = ngx_queue_last(&cache->sh->queue);
+        h = ngx_queue_last(&cache->sh->hot);
+
+        if (q == ngx_queue_sentinel(&cache->sh->queue)) {
+
+            if (h == ngx_queue_sentinel(&cache->sh->hot)) {
+                wait = 10;
+                break;
+            }
+
+            q = h;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (q != h && h != ngx_queue_sentinel(&cache->sh->hot)) {
+            hcn = ngx_queue_data(h, ngx_http_file_cache_node_t, queue);
+
+            if (hcn->expire < fcn->expire) {
+                q = h;
+                fcn = hcn;
+            }
+        }
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            continue;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_queue_remove(q);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_insert_locked(cache, fcn, 0);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+        cache->sh->disks[fcn->disk].size -= fcn->fs_size;
+
+        if (fcn->hot) {
+            cache->sh->hot_size -= fcn->fs_size;
+            fcn->hot = 0;
+        }
+
+        path = cache->disks[fcn->disk].path;
+        p = ngx_cpymem(name, path->name.data, path->name.len);
+        p += 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        if (cache->mem_shpool) {
+            ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_http_file_cache_mem_delete(cache, key);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_tags_free_locked(cache, fcn);
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+    }
+}
+
+
+static time_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size;
+    time_t      next, wait;
+    ngx_uint_t  i;
+
+    next = ngx_http_file_cache_expire(cache);
+
+    ngx_http_file_cache_purge_expire(cache);
+
+    if (cache->ndisks > 1) {
+        ngx_http_file_cache_disk_probe(cache);
+    }
+
+    if (cache->snapshot.len
+        && ngx_time() >= cache->snapshot_next
+        && !cache->sh->cold
+        && !cache->sh->snapshot)
+    {
+        ngx_http_file_cache_snapshot_save(cache);
+
+        ngx_time_update();
+        cache->snapshot_next = ngx_time() + cache->snapshot_interval;
+    }
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O", size);
+
+        if (size < cache->max_size) {
+            break;
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache, -1);
+
+        if (wait > 0) {
+            return wait;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            return next;
+        }
+    }
+
+    if (cache->ndisks == 1) {
+        return next;
+    }
+
+    for (i = 0; i < cache->ndisks; i++) {
+
+        for ( ;; ) {
+            ngx_shmtx_lock(&cache->shpool->mutex);
+
+            size = cache->sh->disks[i].size;
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache disk %ui size: %O", i, size);
+
+            if (size < cache->disks[i].max_size) {
+                break;
+            }
+
+            wait = ngx_http_file_cache_forced_expire(cache, i);
+
+            if (wait > 0) {
+                next = ngx_min(next, wait);
+                break;
+            }
+
+            if (ngx_quit || ngx_terminate) {
+                return next;
+            }
+        }
+    }
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_uint_t      i;
+    ngx_tree_ctx_t  tree;
+
+    /*
+     * after a snapshot is loaded the zone is not cold, and the loader
+     * only adds the files stored after the snapshot
+     */
+
+    if ((!cache->sh->cold && !cache->sh->snapshot) || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    for (i = 0; i < cache->ndisks; i++) {
+        cache->loader_disk = i;
+
+        if (ngx_walk_tree(&tree, &cache->disks[i].path->name) == NGX_ABORT) {
+            cache->sh->loading = 0;
+            return;
+        }
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->snapshot = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    u_char                 *p;
+    ngx_uint_t              n, depth;
+    ngx_path_t             *temp;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    /* the temporary files of a disk are not cache entries */
+
+    temp = cache->disks[cache->loader_disk].temp_path;
+
+    if (temp
+        && path->len == temp->name.len
+        && ngx_strncmp(path->data, temp->name.data, path->len) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (cache->sh->snapshot == 0 || ctx->mtime >= cache->sh->snapshot) {
+        return NGX_OK;
+    }
+
+    /*
+     * storing or deleting a file changes the modification time of its
+     * directory, so the last level directories not changed since the
+     * snapshot are skipped
+     */
+
+    for (n = 0; n < 3 && cache->path->level[n]; n++) { /* void */ }
+
+    depth = 0;
+
+    for (p = path->data + cache->disks[cache->loader_disk].path->name.len;
+         p < path->data + path->len;
+         p++)
+    {
+        if (*p == '/') {
+            depth++;
+        }
+    }
+
+    return (depth == n) ? NGX_DECLINED : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static void
+ngx_http_file_cache_snapshot_save(ngx_http_file_cache_t *cache)
+{
+    off_t                                   offset;
+    size_t                                  size;
+    uint32_t                                crc;
+    uint64_t                                number;
+    ngx_uint_t                              n;
+    ngx_file_t                              file;
+    ngx_rbtree_node_t                      *node;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_node_t    *sn, *nodes;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot save: \"%V\"", &cache->snapshot);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.len = cache->snapshot.len + sizeof(".tmp") - 1;
+    file.log = ngx_cycle->log;
+
+    file.name.data = ngx_alloc(file.name.len + 1, ngx_cycle->log);
+    if (file.name.data == NULL) {
+        return;
+    }
+
+    ngx_sprintf(file.name.data, "%V.tmp%Z", &cache->snapshot);
+
+    nodes = ngx_alloc(NGX_HTTP_FILE_CACHE_SNAPSHOT_NODES
+                      * sizeof(ngx_http_file_cache_snapshot_node_t),
+                      ngx_cycle->log);
+    if (nodes == NULL) {
+        ngx_free(file.name.data);
+        return;
+    }
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    ngx_memzero(&header, sizeof(ngx_http_file_cache_snapshot_header_t));
+
+    header.time = ngx_time();
+
+    offset = sizeof(ngx_http_file_cache_snapshot_header_t);
+    number = 0;
+
+    ngx_crc32_init(crc);
+
+    /*
+     * the tree is walked in batches to not block the workers,
+     * the node to continue from is locked in between by its count
+     */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = cache->sh->rbtree.root;
+
+    if (node == cache->sh->rbtree.sentinel) {
+        node = NULL;
+
+    } else {
+        node = ngx_rbtree_min(node, cache->sh->rbtree.sentinel);
+    }
+
+    for ( ;; ) {
+
+        for (n = 0;
+             node && n < NGX_HTTP_FILE_CACHE_SNAPSHOT_NODES;
+             node = ngx_rbtree_next(&cache->sh->rbtree, node))
+        {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            if (!fcn->exists || fcn->deleting) {
+                continue;
+            }
+
+            sn = &nodes[n++];
+
+            ngx_memcpy(sn->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(&sn->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            sn->uniq = fcn->uniq;
+            sn->expire = fcn->expire;
+            sn->valid_sec = fcn->valid_sec;
+            sn->fs_size = fcn->fs_size;
+            sn->body_start = (uint32_t) fcn->body_start;
+            sn->uses = (uint16_t) fcn->uses;
+            sn->valid_msec = (uint16_t) fcn->valid_msec;
+            sn->disk = fcn->disk;
+            sn->purged = fcn->purged;
+        }
+
+        if (node) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+            fcn->count++;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        size = n * sizeof(ngx_http_file_cache_snapshot_node_t);
+
+        if (n && ngx_write_file(&file, (u_char *) nodes, size, offset)
+                 == NGX_ERROR)
+        {
+            break;
+        }
+
+        ngx_crc32_update(&crc, (u_char *) nodes, size);
+
+        offset += size;
+        number += n;
+
+        if (node == NULL) {
+            break;
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (rc == NGX_OK) {
-        c->node->exists = 1;
+        fcn = (ngx_http_file_cache_node_t *) node;
+        fcn->count--;
     }
 
-    c->node->updating = 0;
+    if (node) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-}
+        fcn = (ngx_http_file_cache_node_t *) node;
+        fcn->count--;
 
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-ngx_int_t
-ngx_http_cache_send(ngx_http_request_t *r)
-{
-    ngx_int_t          rc;
-    ngx_buf_t         *b;
-    ngx_chain_t        out;
-    ngx_http_cache_t  *c;
+        goto failed;
+    }
 
-    c = r->cache;
+    ngx_crc32_final(crc);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache send: %s", c->file.name.data);
+    ngx_memcpy(header.signature, "NGXCACHE", 8);
+    header.node_size = sizeof(ngx_http_file_cache_snapshot_node_t);
+    header.crc32 = crc;
+    header.number = number;
+    header.bsize = cache->bsize;
+    header.disks = (uint32_t) cache->ndisks;
 
-    if (r != r->main && c->length - c->body_start == 0) {
-        return ngx_http_send_header(r);
+    for (n = 0; n < 3; n++) {
+        header.level[n] = (uint32_t) cache->path->level[n];
     }
 
-    /* we need to allocate all before the header would be sent */
-
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
     }
 
-    rc = ngx_http_send_header(r);
+    file.fd = NGX_INVALID_FILE;
 
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
-        return rc;
+    if (ngx_rename_file(file.name.data, cache->snapshot.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%V\" failed",
+                      file.name.data, &cache->snapshot);
+        goto failed;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache snapshot saved: %uL", number);
 
-    b->in_file = (c->length - c->body_start) ? 1: 0;
-    b->last_buf = (r == r->main) ? 1: 0;
-    b->last_in_chain = 1;
+    goto done;
 
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+failed:
 
-    out.buf = b;
-    out.next = NULL;
+    if (ngx_delete_file(file.name.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", file.name.data);
+    }
 
-    return ngx_http_output_filter(r, &out);
+done:
+
+    if (file.fd != NGX_INVALID_FILE
+        && ngx_close_file(file.fd) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", file.name.data);
+    }
+
+    ngx_free(nodes);
+    ngx_free(file.name.data);
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static ngx_int_t
+ngx_http_file_cache_snapshot_load(ngx_http_file_cache_t *cache, ngx_log_t *log)
 {
-    ngx_http_file_cache_t       *cache;
-    ngx_http_file_cache_node_t  *fcn;
+    off_t                                   offset;
+    size_t                                  size;
+    time_t                                  now, expire;
+    ssize_t                                 n;
+    uint32_t                                crc;
+    uint64_t                                number;
+    ngx_err_t                               err;
+    ngx_uint_t                              i, k;
+    ngx_file_t                              file;
+    ngx_http_file_cache_node_t             *fcn;
+    ngx_http_file_cache_snapshot_node_t    *sn, *nodes;
+    ngx_http_file_cache_snapshot_header_t   header;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = cache->snapshot;
+    file.log = log;
+
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, log, err,
+                          ngx_open_file_n " \"%V\" failed", &file.name);
+        }
 
-    if (c->updated || c->node == NULL) {
-        return;
+        return NGX_DECLINED;
     }
 
-    cache = c->file_cache;
+    nodes = ngx_alloc(NGX_HTTP_FILE_CACHE_SNAPSHOT_NODES
+                      * sizeof(ngx_http_file_cache_snapshot_node_t), log);
+    if (nodes == NULL) {
+        goto failed;
+    }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
+    n = ngx_read_file(&file, (u_char *) &header, sizeof(header), 0);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (n != (ssize_t) sizeof(header)
+        || ngx_memcmp(header.signature, "NGXCACHE", 8) != 0
+        || header.node_size != sizeof(ngx_http_file_cache_snapshot_node_t)
+        || header.bsize != cache->bsize
+        || header.disks != cache->ndisks
+        || header.level[0] != cache->path->level[0]
+        || header.level[1] != cache->path->level[1]
+        || header.level[2] != cache->path->level[2])
+    {
+        goto invalid;
+    }
 
-    fcn = c->node;
-    fcn->count--;
+    now = ngx_time();
+    offset = sizeof(header);
+    number = 0;
 
-    if (c->updating) {
-        fcn->updating = 0;
-    }
+    ngx_crc32_init(crc);
 
-    if (c->error) {
-        fcn->error = c->error;
+    while (number < header.number) {
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
+        k = NGX_HTTP_FILE_CACHE_SNAPSHOT_NODES;
+
+        if (header.number - number < k) {
+            k = (ngx_uint_t) (header.number - number);
         }
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        c->node = NULL;
-    }
+        size = k * sizeof(ngx_http_file_cache_snapshot_node_t);
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        n = ngx_read_file(&file, (u_char *) nodes, size, offset);
 
-    c->updated = 1;
-    c->updating = 0;
+        if (n != (ssize_t) size) {
+            goto invalid;
+        }
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+        ngx_crc32_update(&crc, (u_char *) nodes, size);
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
+        for (i = 0; i < k; i++) {
+            sn = &nodes[i];
+
+            if (sn->disk >= cache->ndisks) {
+                goto invalid;
             }
-        }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
-}
+            fcn = ngx_slab_alloc_locked(cache->shpool,
+                                        sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                goto failed;
+            }
 
+            ngx_memcpy((u_char *) &fcn->node.key, sn->key,
+                       sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(fcn->key, &sn->key[sizeof(ngx_rbtree_key_t)],
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+            fcn->uses = sn->uses;
+            fcn->count = 0;
+            fcn->valid_msec = sn->valid_msec;
+            fcn->error = 0;
+            fcn->exists = 1;
+            fcn->updating = 0;
+            fcn->deleting = 0;
+            fcn->hot = 0;
+            fcn->uniq = sn->uniq;
+            fcn->valid_sec = sn->valid_sec;
+            fcn->body_start = sn->body_start;
+            fcn->fs_size = sn->fs_size;
+            fcn->disk = sn->disk;
+            fcn->purged = sn->purged ? 1 : 0;
+            fcn->vary = 0;
+            fcn->fill = NULL;
+            fcn->tags = NULL;
+
+            /* the time spent while nginx was not running is not counted */
+
+            expire = sn->expire - header.time;
+
+            if (expire < 0) {
+                expire = 0;
+
+            } else if (expire > cache->inactive) {
+                expire = cache->inactive;
+            }
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+            fcn->expire = now + expire;
 
-    if (c->updated) {
-        return;
-    }
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+            cache->sh->size += sn->fs_size;
+            cache->sh->disks[sn->disk].size += sn->fs_size;
+        }
 
-    if (c->updating) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
+        offset += size;
+        number += k;
     }
 
-    ngx_http_file_cache_free(c, NULL);
-}
-
-
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_crc32_final(crc);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+    if (crc != header.crc32) {
+        goto invalid;
+    }
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    /* the entries are served at once, the loader only adds the newer files */
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+    cache->sh->snapshot = header.time;
+    cache->sh->cold = 0;
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "http file cache: %V %uL entries loaded from \"%V\"",
+                  &cache->path->name, number, &file.name);
 
-    wait = 10;
-    tries = 20;
+    ngx_free(nodes);
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
 
-    for (q = ngx_queue_last(&cache->sh->queue);
-         q != ngx_queue_sentinel(&cache->sh->queue);
-         q = ngx_queue_prev(q))
-    {
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    return NGX_OK;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+invalid:
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "cache snapshot \"%V\" is invalid, ignored", &file.name);
 
-        } else {
-            if (--tries) {
-                continue;
-            }
+failed:
 
-            wait = 1;
-        }
+    ngx_http_file_cache_snapshot_drop(cache);
 
-        break;
+    if (nodes) {
+        ngx_free(nodes);
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
-
-    ngx_free(name);
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &file.name);
+    }
 
-    return wait;
+    return NGX_DECLINED;
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static void
+ngx_http_file_cache_snapshot_drop(ngx_http_file_cache_t *cache)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q;
+    ngx_rbtree_node_t           *node;
     ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+    while (cache->sh->rbtree.root != cache->sh->rbtree.sentinel) {
+        node = cache->sh->rbtree.root;
+        fcn = (ngx_http_file_cache_node_t *) node;
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
+        ngx_rbtree_delete(&cache->sh->rbtree, node);
+        ngx_queue_remove(&fcn->queue);
+        ngx_slab_free_locked(cache->shpool, fcn);
     }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
-
-    now = ngx_time();
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    cache->sh->size = 0;
+    cache->sh->snapshot = 0;
+    cache->sh->cold = 1;
 
-    for ( ;; ) {
+    ngx_memzero(cache->sh->disks, sizeof(cache->sh->disks));
+}
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
 
-        q = ngx_queue_last(&cache->sh->queue);
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
 
-        wait = fcn->expire - now;
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+    cache = ctx->data;
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+    /* the files older than the loaded snapshot are already in the zone */
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            continue;
-        }
+    if (ctx->mtime < cache->sh->snapshot) {
+        return NGX_OK;
+    }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    c.disk = cache->loader_disk;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
-    }
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        p += 2;
 
-    ngx_free(name);
+        c.key[i] = (u_char) n;
+    }
 
-    return wait;
+    return ngx_http_file_cache_add(cache, &c);
 }
 
 
-static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
     ngx_http_file_cache_node_t  *fcn;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_shmtx_lock(&cache->shpool->mutex);
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+    if (fcn == NULL) {
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+        fcn = ngx_slab_alloc_locked(cache->shpool,
+                                    sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
+        fcn->uses = 1;
+        fcn->count = 0;
+        fcn->valid_msec = 0;
+        fcn->error = 0;
+        fcn->exists = 1;
+        fcn->updating = 0;
         fcn->deleting = 0;
-    }
+        fcn->hot = 0;
+        fcn->uniq = 0;
+        fcn->valid_sec = 0;
+        fcn->body_start = 0;
+        fcn->fs_size = c->fs_size;
+        fcn->disk = c->disk;
+        fcn->purged = 0;
+        fcn->vary = 0;
+        fcn->fill = NULL;
+        fcn->tags = NULL;
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->size += c->fs_size;
+        cache->sh->disks[c->disk].size += c->fs_size;
+
+    } else {
+        ngx_queue_remove(&fcn->queue);
     }
-}
 
+    fcn->expire = ngx_time() + cache->inactive;
 
-static time_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    ngx_http_file_cache_insert_locked(cache, fcn, 0);
 
-    off_t   size;
-    time_t  next, wait;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    next = ngx_http_file_cache_expire(cache);
+    return NGX_OK;
+}
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-        size = cache->sh->size;
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_OK;
+}
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O", size);
 
-        if (size < cache->max_size) {
-            return next;
-        }
+static ngx_int_t
+ngx_http_file_cache_mem_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+    size_t                  len;
+    ngx_http_file_cache_t  *cache;
 
-        if (wait > 0) {
-            return wait;
-        }
+    cache = shm_zone->data;
 
-        if (ngx_quit || ngx_terminate) {
-            return next;
-        }
-    }
-}
+    if (ocache && ocache->mem_sh) {
+        cache->mem_sh = ocache->mem_sh;
+        cache->mem_shpool = ocache->mem_shpool;
 
+        return NGX_OK;
+    }
 
-static void
-ngx_http_file_cache_loader(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    cache->mem_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    ngx_tree_ctx_t  tree;
+    if (shm_zone->shm.exists) {
+        cache->mem_sh = cache->mem_shpool->data;
 
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
+        return NGX_OK;
     }
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
+    cache->mem_sh = ngx_slab_alloc(cache->mem_shpool,
+                                   sizeof(ngx_http_file_cache_mem_sh_t));
+    if (cache->mem_sh == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    cache->mem_shpool->data = cache->mem_sh;
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_noop;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    ngx_rbtree_init(&cache->mem_sh->rbtree, &cache->mem_sh->sentinel,
+                    ngx_http_file_cache_mem_rbtree_insert_value);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_queue_init(&cache->mem_sh->queue);
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+    len = sizeof(" in cache memory zone \"\"") + shm_zone->shm.name.len;
+
+    cache->mem_shpool->log_ctx = ngx_slab_alloc(cache->mem_shpool, len);
+    if (cache->mem_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    ngx_sprintf(cache->mem_shpool->log_ctx, " in cache memory zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
+    return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+ngx_http_file_cache_mem_open(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    return NGX_OK;
-}
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_mem_node_t  *mn;
 
+    cache = c->file_cache;
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
 
-    cache = ctx->data;
+    mn = ngx_http_file_cache_mem_lookup(cache, c->key);
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+    /* the file may have been replaced since the object was stored */
+
+    if (mn == NULL || (c->uniq && mn->uniq != c->uniq)) {
+        ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+        return NGX_DECLINED;
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    c->buf = ngx_create_temp_buf(r->pool, mn->len);
+    if (c->buf == NULL) {
+        ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+        return NGX_ERROR;
+    }
 
-    } else {
-        ngx_time_update();
+    ngx_memcpy(c->buf->pos, mn->data, mn->len);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    c->length = mn->len;
+    c->memory = 1;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    ngx_queue_remove(&mn->queue);
+    ngx_queue_insert_head(&cache->mem_sh->queue, &mn->queue);
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
-    }
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory hit: %uz", mn->len);
+
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_mem_store(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msleep(cache->loader_sleep);
+    size_t                           len;
+    ngx_uint_t                       n;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_mem_node_t  *mn, *old;
 
-    ngx_time_update();
+    cache = c->file_cache;
+    len = c->buf->last - c->buf->pos;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
-}
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
 
+    mn = ngx_http_file_cache_mem_lookup(cache, c->key);
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
-{
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    if (mn) {
+        ngx_queue_remove(&mn->queue);
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+        if (mn->uniq == c->uniq && mn->len == len) {
+            ngx_queue_insert_head(&cache->mem_sh->queue, &mn->queue);
+            ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+            return;
+        }
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
+        ngx_rbtree_delete(&cache->mem_sh->rbtree, &mn->node);
+        ngx_slab_free_locked(cache->mem_shpool, mn);
     }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+    len += offsetof(ngx_http_file_cache_mem_node_t, data);
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+    mn = ngx_slab_alloc_locked(cache->mem_shpool, len);
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+    /* free the least recently used objects */
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+    for (n = 0; mn == NULL && n < 16; n++) {
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        if (ngx_queue_empty(&cache->mem_sh->queue)) {
+            break;
         }
 
-        p += 2;
+        q = ngx_queue_last(&cache->mem_sh->queue);
+        old = ngx_queue_data(q, ngx_http_file_cache_mem_node_t, queue);
 
-        c.key[i] = (u_char) n;
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&cache->mem_sh->rbtree, &old->node);
+        ngx_slab_free_locked(cache->mem_shpool, old);
+
+        mn = ngx_slab_alloc_locked(cache->mem_shpool, len);
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    if (mn == NULL) {
+        ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+        return;
+    }
+
+    ngx_memcpy((u_char *) &mn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+
+    ngx_memcpy(mn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    mn->uniq = c->uniq;
+    mn->len = c->buf->last - c->buf->pos;
+    ngx_memcpy(mn->data, c->buf->pos, mn->len);
+
+    ngx_rbtree_insert(&cache->mem_sh->rbtree, &mn->node);
+    ngx_queue_insert_head(&cache->mem_sh->queue, &mn->queue);
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache memory store: %uz", mn->len);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_mem_delete(ngx_http_file_cache_t *cache, u_char *key)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_mem_node_t  *mn;
+
+    ngx_shmtx_lock(&cache->mem_shpool->mutex);
+
+    mn = ngx_http_file_cache_mem_lookup(cache, key);
+
+    if (mn) {
+        ngx_queue_remove(&mn->queue);
+        ngx_rbtree_delete(&cache->mem_sh->rbtree, &mn->node);
+        ngx_slab_free_locked(cache->mem_shpool, mn);
+    }
+
+    ngx_shmtx_unlock(&cache->mem_shpool->mutex);
+}
+
+
+static ngx_http_file_cache_mem_node_t *
+ngx_http_file_cache_mem_lookup(ngx_http_file_cache_t *cache, u_char *key)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_key_t                 node_key;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_file_cache_mem_node_t  *mn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->mem_sh->rbtree.root;
+    sentinel = cache->mem_sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+        /* node_key == node->key */
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        mn = (ngx_http_file_cache_mem_node_t *) node;
 
-    if (fcn == NULL) {
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], mn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        fcn = ngx_slab_alloc_locked(cache->shpool,
-                                    sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+        if (rc == 0) {
+            return mn;
         }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        node = (rc < 0) ? node->left : node->right;
+    }
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    /* not found */
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+    return NULL;
+}
 
-        fcn->uses = 1;
-        fcn->count = 0;
-        fcn->valid_msec = 0;
-        fcn->error = 0;
-        fcn->exists = 1;
-        fcn->updating = 0;
-        fcn->deleting = 0;
-        fcn->uniq = 0;
-        fcn->valid_sec = 0;
-        fcn->body_start = 0;
-        fcn->fs_size = c->fs_size;
 
-        cache->sh->size += c->fs_size;
+static void
+ngx_http_file_cache_mem_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t               **p;
+    ngx_http_file_cache_mem_node_t   *mn, *mnt;
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+    for ( ;; ) {
 
-    fcn->expire = ngx_time() + cache->inactive;
+        if (node->key < temp->key) {
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+            p = &temp->left;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        } else if (node->key > temp->key) {
 
-    return NGX_OK;
-}
+            p = &temp->right;
 
+        } else { /* node->key == temp->key */
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+            mn = (ngx_http_file_cache_mem_node_t *) node;
+            mnt = (ngx_http_file_cache_mem_node_t *) temp;
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+            p = (ngx_memcmp(mn->key, mnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
     }
 
-    return NGX_OK;
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
 }
 
 
@@ -1587,15 +4850,21 @@ ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 char *
 ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    off_t                   max_size;
-    u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
-    ngx_int_t               loader_files;
-    ngx_msec_t              loader_sleep, loader_threshold;
-    ngx_uint_t              i, n;
-    ngx_http_file_cache_t  *cache;
+    off_t                           max_size;
+    u_char                         *last, *p;
+    time_t                          inactive;
+    time_t                          snapshot_interval;
+    ssize_t                         size, mem_size, mem_max_object;
+    ngx_str_t                       s, name, mem_name, snapshot, *value;
+    ngx_int_t                       loader_files, mem_min_uses;
+    ngx_msec_t                      loader_sleep, loader_threshold;
+    ngx_uint_t                      i, n;
+    ngx_flag_t                      slru, tinylfu;
+    ngx_path_t                     *path;
+    ngx_array_t                    *disks;
+    ngx_http_file_cache_t          *cache, **ce;
+    ngx_http_file_cache_disk_t     *disk;
+    ngx_http_upstream_main_conf_t  *umcf;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -1616,6 +4885,18 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
 
+    mem_size = 0;
+    mem_max_object = 16384;
+    mem_min_uses = 2;
+
+    ngx_str_null(&snapshot);
+    snapshot_interval = 300;
+
+    slru = 0;
+    tinylfu = 0;
+
+    disks = NULL;
+
     value = cf->args->elts;
 
     cache->path->name = value[1];
@@ -1764,6 +5045,183 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "memory=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            mem_size = ngx_parse_size(&s);
+            if (mem_size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid memory value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_max_object=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            mem_max_object = ngx_parse_size(&s);
+            if (mem_max_object == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_max_object value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "memory_min_uses=", 16) == 0) {
+
+            mem_min_uses = ngx_atoi(value[i].data + 16, value[i].len - 16);
+            if (mem_min_uses == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid memory_min_uses value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+
+            snapshot.len = value[i].len - 9;
+            snapshot.data = value[i].data + 9;
+
+            if (ngx_conf_full_name(cf->cycle, &snapshot, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot_interval=", 18) == 0) {
+
+            s.len = value[i].len - 18;
+            s.data = value[i].data + 18;
+
+            snapshot_interval = ngx_parse_time(&s, 1);
+            if (snapshot_interval == (time_t) NGX_ERROR
+                || snapshot_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid snapshot_interval value \"%V\"",
+                           &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                slru = 0;
+                continue;
+            }
+
+            if (ngx_strcmp(&value[i].data[9], "slru") == 0) {
+                slru = 1;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid eviction value \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "admission=", 10) == 0) {
+
+            if (ngx_strcmp(&value[i].data[10], "all") == 0) {
+                tinylfu = 0;
+                continue;
+            }
+
+            if (ngx_strcmp(&value[i].data[10], "tinylfu") == 0) {
+                tinylfu = 1;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid admission value \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "disk=", 5) == 0) {
+
+            if (disks == NULL) {
+                disks = ngx_array_create(cf->pool, 4,
+                                         sizeof(ngx_http_file_cache_disk_t));
+                if (disks == NULL) {
+                    return NGX_CONF_ERROR;
+                }
+            }
+
+            disk = ngx_array_push(disks);
+            if (disk == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_memzero(disk, sizeof(ngx_http_file_cache_disk_t));
+
+            disk->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+            if (disk->path == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            p = value[i].data + 5;
+            last = value[i].data + value[i].len;
+
+            while (last > p && *(last - 1) != ':') {
+                last--;
+            }
+
+            if (last - p < 2) {
+                goto invalid_disk;
+            }
+
+            s.len = value[i].data + value[i].len - last;
+            s.data = last;
+
+            disk->max_size = ngx_parse_offset(&s);
+            if (disk->max_size <= 0) {
+                goto invalid_disk;
+            }
+
+            n = last - 1 - p;
+
+            if (p[n - 1] == '/') {
+                n--;
+            }
+
+            disk->path->name.len = n;
+            disk->path->name.data = ngx_pnalloc(cf->pool, n + 1);
+            if (disk->path->name.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_cpystrn(disk->path->name.data, p, n + 1);
+
+            if (ngx_conf_full_name(cf->cycle, &disk->path->name, 0)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+
+        invalid_disk:
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid disk \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -1776,6 +5234,12 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (tinylfu && max_size == NGX_MAX_OFF_T_VALUE) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"admission=tinylfu\" requires \"max_size\"");
+        return NGX_CONF_ERROR;
+    }
+
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
@@ -1784,11 +5248,99 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_files = loader_files;
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
+    cache->snapshot = snapshot;
+    cache->snapshot_interval = snapshot_interval;
+    cache->slru = slru;
+    cache->tinylfu = tinylfu;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
 
+    if (disks) {
+
+        if (max_size == NGX_MAX_OFF_T_VALUE) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"disk\" requires \"max_size\"");
+            return NGX_CONF_ERROR;
+        }
+
+        if (disks->nelts >= NGX_HTTP_CACHE_DISKS) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "too many disks, the maximum is %d",
+                               NGX_HTTP_CACHE_DISKS);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    cache->ndisks = disks ? disks->nelts + 1 : 1;
+
+    cache->disks = ngx_pcalloc(cf->pool,
+                       cache->ndisks * sizeof(ngx_http_file_cache_disk_t));
+    if (cache->disks == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->disks[0].path = cache->path;
+    cache->disks[0].max_size = max_size;
+
+    if (disks) {
+        ngx_memcpy(&cache->disks[1], disks->elts,
+                   disks->nelts * sizeof(ngx_http_file_cache_disk_t));
+    }
+
+    for (i = 0; i < cache->ndisks; i++) {
+        disk = &cache->disks[i];
+
+        if (cache->ndisks == 1) {
+            disk->weight = 1;
+            break;
+        }
+
+        disk->weight = ngx_max(disk->max_size >> 20, 1);
+
+        if (i > 0) {
+            max_size += disk->max_size;
+
+            ngx_memcpy(disk->path->level, cache->path->level,
+                       sizeof(cache->path->level));
+            disk->path->len = cache->path->len;
+            disk->path->conf_file = cf->conf_file->file.name.data;
+            disk->path->line = cf->conf_file->line;
+
+            if (ngx_add_path(cf, &disk->path) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        /* the temporary files are kept on the disk the entry goes to */
+
+        path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+        if (path == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        path->name.len = disk->path->name.len + sizeof("/temp") - 1;
+        path->name.data = ngx_pnalloc(cf->pool, path->name.len + 1);
+        if (path->name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(path->name.data, "%V/temp%Z", &disk->path->name);
+
+        path->level[0] = 1;
+        path->level[1] = 2;
+        path->len = 1 + 1 + 2 + 1;
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
+
+        if (ngx_add_path(cf, &path) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+
+        disk->temp_path = path;
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -1802,11 +5354,65 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 
     cache->shm_zone->init = ngx_http_file_cache_init;
+    cache->shm_zone->copy = ngx_http_file_cache_copy;
     cache->shm_zone->data = cache;
 
+    if (ngx_http_file_cache_waiters.prev == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiters);
+    }
+
+    ngx_channel_wakeup_handler = ngx_http_file_cache_wakeup_handler;
+
     cache->inactive = inactive;
     cache->max_size = max_size;
 
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    ce = ngx_array_push(&umcf->caches);
+    if (ce == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    *ce = cache;
+
+    if (mem_size == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if ((size_t) mem_max_object > (size_t) mem_size / 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"memory_max_object\" is too big for "
+                           "the memory zone size %uz", mem_size);
+        return NGX_CONF_ERROR;
+    }
+
+    mem_name.len = name.len + sizeof(":memory") - 1;
+
+    mem_name.data = ngx_pnalloc(cf->pool, mem_name.len);
+    if (mem_name.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(mem_name.data, "%V:memory", &name);
+
+    cache->mem_zone = ngx_shared_memory_add(cf, &mem_name, mem_size,
+                                            cmd->post);
+    if (cache->mem_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->mem_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &mem_name);
+        return NGX_CONF_ERROR;
+    }
+
+    cache->mem_zone->init = ngx_http_file_cache_mem_init;
+    cache->mem_zone->data = cache;
+
+    cache->mem_max_object = mem_max_object;
+    cache->mem_min_uses = mem_min_uses;
+
     return NGX_CONF_OK;
 }
 
@@ -2273,6 +2273,30 @@ ngx_http_finalize_request(ngx_http_request_t *r, ngx_int_t rc)
 
     if (r != r->main) {
 
+        if (r->background) {
+            if (!r->logged) {
+
+                clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+                if (clcf->log_subrequest) {
+                    ngx_http_log_request(r);
+                }
+
+                r->logged = 1;
+
+            } else {
+                ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                              "subrequest: \"%V?%V\" logged again",
+                              &r->uri, &r->args);
+            }
+
+            r->done = 1;
+            r->main->subrequests++;
+
+            ngx_http_finalize_connection(r);
+            return;
+        }
+
         if (r->buffered || r->postponed) {
 
             if (ngx_http_set_write_handler(r) != NGX_OK) {
@@ -2474,6 +2498,13 @@ ngx_http_finalize_connection(ngx_http_request_t *r)
         return;
     }
 
+    r = r->main;
+
+    if (r->connection->read->eof) {
+        ngx_http_close_request(r, 0);
+        return;
+    }
+
     if (!ngx_terminate
          && !ngx_exiting
          && r->keepalive
@@ -27,8 +27,9 @@ ngx_int_t
 ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
+    size_t                         size;
     ngx_url_t                      u;
-    ngx_uint_t                     i, j, n, w;
+    ngx_uint_t                     i, j, m, n, w;
     ngx_http_upstream_server_t    *server;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
 
@@ -56,15 +57,46 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             return NGX_ERROR;
         }
 
+        m = n;
+
+        if (us->shm_zone) {
+
+            /* the rest of the zone is left to the peers added at run time */
+
+            size = 8 * ngx_pagesize + 2 * sizeof(ngx_http_upstream_rr_peers_t);
+
+            for (i = 0; i < us->servers->nelts; i++) {
+                if (server[i].backup) {
+                    size += server[i].naddrs * NGX_HTTP_UPSTREAM_RR_SLOT_SIZE;
+                }
+            }
+
+            if (us->shm_zone->shm.size > size) {
+                m = (us->shm_zone->shm.size - size)
+                    / NGX_HTTP_UPSTREAM_RR_SLOT_SIZE;
+
+            } else {
+                m = 0;
+            }
+
+            if (m < n) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "zone \"%V\" is too small for upstream \"%V\" "
+                              "in %s:%ui", &us->shm_zone->shm.name,
+                              &us->host, us->file_name, us->line);
+                return NGX_ERROR;
+            }
+        }
+
         peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_rr_peers_t)
-                              + sizeof(ngx_http_upstream_rr_peer_t) * (n - 1));
+                              + sizeof(ngx_http_upstream_rr_peer_t) * (m - 1));
         if (peers == NULL) {
             return NGX_ERROR;
         }
 
-        peers->single = (n == 1);
-        peers->number = n;
-        peers->weighted = (w != n);
+        peers->single = (m == 1);
+        peers->number = m;
+        peers->weighted = (w != n || m != n);
         peers->total_weight = w;
         peers->name = &us->host;
 
@@ -89,6 +121,11 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
             }
         }
 
+        for ( /* void */ ; n < m; n++) {
+            peers->peer[n].down = 1;
+            peers->peer[n].removed = 1;
+        }
+
         us->peer.data = peers;
 
         /* backup servers */
@@ -379,7 +416,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get rr peer, try: %ui", pc->tries);
 
-    /* ngx_lock_mutex(rrp->peers->mutex); */
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
 
     pc->cached = 0;
     pc->connection = NULL;
@@ -387,7 +424,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     if (rrp->peers->single) {
         peer = &rrp->peers->peer[0];
 
-        if (peer->down) {
+        if (ngx_http_upstream_rr_peer_down(peer)) {
             goto failed;
         }
 
@@ -410,7 +447,9 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
+    peer->refs++;
+
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
     if (pc->tries == 1 && rrp->peers->next) {
         pc->tries += rrp->peers->next->number;
@@ -424,7 +463,7 @@ failed:
 
     if (peers->next) {
 
-        /* ngx_unlock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(peers);
 
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "backup servers");
 
@@ -444,7 +483,7 @@ failed:
             return rc;
         }
 
-        /* ngx_lock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(peers);
     }
 
     /* all peers failed, mark them as live for quick recovery */
@@ -453,7 +492,7 @@ failed:
         peers->peer[i].fails = 0;
     }
 
-    /* ngx_unlock_mutex(peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
 
@@ -486,7 +525,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
 
         peer = &rrp->peers->peer[i];
 
-        if (peer->down) {
+        if (ngx_http_upstream_rr_peer_down(peer)) {
             continue;
         }
 
@@ -546,18 +585,21 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     /* TODO: NGX_PEER_KEEPALIVE */
 
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
+
+    peer = &rrp->peers->peer[rrp->current];
+
+    peer->refs--;
+
     if (rrp->peers->single) {
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
         pc->tries = 0;
         return;
     }
 
-    peer = &rrp->peers->peer[rrp->current];
-
     if (state & NGX_PEER_FAILED) {
         now = ngx_time();
 
-        /* ngx_lock_mutex(rrp->peers->mutex); */
-
         peer->fails++;
         peer->accessed = now;
         peer->checked = now;
@@ -574,8 +616,6 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
             peer->effective_weight = 0;
         }
 
-        /* ngx_unlock_mutex(rrp->peers->mutex); */
-
     } else {
 
         /* mark peer live if check passed */
@@ -585,11 +625,11 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         }
     }
 
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
     if (pc->tries) {
         pc->tries--;
     }
-
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
 }
 
 
@@ -605,6 +645,10 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_ssl_session_t            *ssl_session;
     ngx_http_upstream_rr_peer_t  *peer;
 
+    if (rrp->peers->shpool) {
+        return NGX_OK;
+    }
+
     peer = &rrp->peers->peer[rrp->current];
 
     /* TODO: threads only mutex */
@@ -633,6 +677,13 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_ssl_session_t            *old_ssl_session, *ssl_session;
     ngx_http_upstream_rr_peer_t  *peer;
 
+    if (rrp->peers->shpool) {
+
+        /* the sessions are local to a process, the zone peers are not */
+
+        return;
+    }
+
     ssl_session = ngx_ssl_get_session(pc->connection);
 
     if (ssl_session == NULL) {
@@ -14,6 +14,17 @@
 #include <ngx_http.h>
 
 
+/* the peer state shared by the active health checks */
+
+typedef struct {
+    ngx_atomic_t                    down;
+    ngx_uint_t                      fails;
+    ngx_uint_t                      passes;
+    time_t                          checked;
+    ngx_uint_t                      status;
+} ngx_http_upstream_rr_health_t;
+
+
 typedef struct {
     struct sockaddr                *sockaddr;
     socklen_t                       socklen;
@@ -32,6 +43,16 @@ typedef struct {
 
     ngx_uint_t                      down;          /* unsigned  down:1; */
 
+    unsigned                        drain:1;
+    unsigned                        removed:1;
+
+    ngx_http_upstream_rr_health_t  *health;
+
+    ngx_uint_t                      conns;
+    ngx_msec_t                      response_time; /* EWMA, microseconds */
+
+    ngx_uint_t                      refs;          /* requests in progress */
+
 #if (NGX_HTTP_SSL)
     ngx_ssl_session_t              *ssl_session;   /* local to a process */
 #endif
@@ -43,7 +64,8 @@ typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 struct ngx_http_upstream_rr_peers_s {
     ngx_uint_t                      number;
 
- /* ngx_mutex_t                    *mutex; */
+    ngx_slab_pool_t                *shpool;
+    ngx_uint_t                      config;
 
     ngx_uint_t                      total_weight;
 
@@ -58,6 +80,38 @@ struct ngx_http_upstream_rr_peers_s {
 };
 
 
+#define ngx_http_upstream_rr_peer_down(peer)                                 \
+    ((peer)->down || (peer)->drain                                           \
+     || ((peer)->health && (peer)->health->down))
+
+
+/* the peers kept in an upstream zone are shared by all worker processes */
+
+#define ngx_http_upstream_rr_peers_lock(peers)                               \
+                                                                             \
+    if ((peers)->shpool) {                                                   \
+        ngx_shmtx_lock(&(peers)->shpool->mutex);                             \
+    }
+
+#define ngx_http_upstream_rr_peers_unlock(peers)                             \
+                                                                             \
+    if ((peers)->shpool) {                                                   \
+        ngx_shmtx_unlock(&(peers)->shpool->mutex);                           \
+    }
+
+
+/* the storage of a peer address in an upstream zone */
+
+typedef struct {
+    u_char                          sockaddr[NGX_SOCKADDRLEN];
+    u_char                          name[NGX_SOCKADDR_STRLEN];
+} ngx_http_upstream_rr_addr_t;
+
+
+#define NGX_HTTP_UPSTREAM_RR_SLOT_SIZE                                       \
+    (sizeof(ngx_http_upstream_rr_peer_t) + sizeof(ngx_http_upstream_rr_addr_t))
+
+
 typedef struct {
     ngx_http_upstream_rr_peers_t   *peers;
     ngx_uint_t                      current;
@@ -474,6 +474,7 @@ ngx_mail_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
 
             scf->shm_zone->init = ngx_ssl_session_cache_init;
+            scf->shm_zone->copy = ngx_ssl_session_cache_copy;
 
             continue;
         }
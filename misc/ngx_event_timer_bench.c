@@ -0,0 +1,251 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * The microbenchmark of the event timer backends: the rbtree and
+ * the timer wheel ("timer_wheel on").  It runs the same keepalive-like
+ * workload against both backends: a large number of long timers is added,
+ * then re-armed randomly while the clock goes on, then all of them expire.
+ *
+ * It is not built by default.  After nginx has been built without threads,
+ * it may be built from the source root directory as
+ *
+ *     cc -O2 -I src/core -I src/event -I src/event/modules -I src/os/unix \
+ *        -I objs -o objs/ngx_event_timer_bench \
+ *        src/misc/ngx_event_timer_bench.c \
+ *        objs/src/event/ngx_event_timer.o objs/src/core/ngx_rbtree.o
+ *
+ * and run as "objs/ngx_event_timer_bench [timers [rounds]]".
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+#define NGX_BENCH_TIMERS   500000
+#define NGX_BENCH_ROUNDS   10
+#define NGX_BENCH_TIMEOUT  60000
+
+
+typedef struct {
+    ngx_msec_t   add;
+    ngx_msec_t   rearm;
+    ngx_msec_t   expire;
+    ngx_msec_t   del;
+    ngx_uint_t   expired;
+} ngx_bench_result_t;
+
+
+static void ngx_bench_run(ngx_uint_t wheel, ngx_event_t *events,
+    ngx_uint_t n, ngx_uint_t rounds, ngx_bench_result_t *res);
+static void ngx_bench_handler(ngx_event_t *ev);
+static ngx_msec_t ngx_bench_msec(void);
+static ngx_uint_t ngx_bench_random(void);
+static void ngx_bench_report(char *name, ngx_bench_result_t *res,
+    ngx_uint_t n, ngx_uint_t rounds);
+
+
+/*
+ * the timer code needs only ngx_current_msec and ngx_log_error_core()
+ * from the rest of nginx
+ */
+
+volatile ngx_msec_t  ngx_current_msec;
+
+
+static ngx_log_t         ngx_bench_log;
+static ngx_connection_t  ngx_bench_connection;
+static ngx_uint_t        ngx_bench_expired;
+static uint32_t          ngx_bench_seed;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_uint_t          n, rounds;
+    ngx_event_t        *events;
+    ngx_bench_result_t  rbtree, wheel;
+
+    n = (argc > 1) ? (ngx_uint_t) atoi(argv[1]) : NGX_BENCH_TIMERS;
+    rounds = (argc > 2) ? (ngx_uint_t) atoi(argv[2]) : NGX_BENCH_ROUNDS;
+
+    if (n == 0 || rounds == 0) {
+        fprintf(stderr, "usage: %s [timers [rounds]]\n", argv[0]);
+        return 1;
+    }
+
+    events = malloc(n * sizeof(ngx_event_t));
+    if (events == NULL) {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+
+    ngx_bench_connection.fd = (ngx_socket_t) -1;
+
+    ngx_bench_run(0, events, n, rounds, &rbtree);
+    ngx_bench_run(1, events, n, rounds, &wheel);
+
+    printf("%u timers, %u re-arms per timer\n\n",
+           (unsigned) n, (unsigned) rounds);
+    printf("%-8s %12s %12s %12s %12s\n",
+           "backend", "add ns/op", "re-arm ns/op", "expire ns/op",
+           "del ns/op");
+
+    ngx_bench_report("rbtree", &rbtree, n, rounds);
+    ngx_bench_report("wheel", &wheel, n, rounds);
+
+    if (rbtree.expired != n || wheel.expired != n) {
+        fprintf(stderr, "expired %u and %u timers instead of %u\n",
+                (unsigned) rbtree.expired, (unsigned) wheel.expired,
+                (unsigned) n);
+        return 1;
+    }
+
+    free(events);
+
+    return 0;
+}
+
+
+static void
+ngx_bench_run(ngx_uint_t wheel, ngx_event_t *events, ngx_uint_t n,
+    ngx_uint_t rounds, ngx_bench_result_t *res)
+{
+    ngx_uint_t    i, tick;
+    ngx_msec_t    start;
+    ngx_event_t  *ev;
+
+    ngx_memzero(events, n * sizeof(ngx_event_t));
+
+    for (i = 0; i < n; i++) {
+        events[i].data = &ngx_bench_connection;
+        events[i].log = &ngx_bench_log;
+        events[i].handler = ngx_bench_handler;
+    }
+
+    ngx_event_timer_wheel = wheel;
+    ngx_current_msec = 1000;
+    ngx_bench_expired = 0;
+    ngx_bench_seed = 1;
+
+    if (ngx_event_timer_init(&ngx_bench_log) != NGX_OK) {
+        fprintf(stderr, "ngx_event_timer_init() failed\n");
+        exit(1);
+    }
+
+    /* the timers are added as for new keepalive connections */
+
+    start = ngx_bench_msec();
+
+    for (i = 0; i < n; i++) {
+        ngx_add_timer(&events[i],
+                      NGX_BENCH_TIMEOUT + ngx_bench_random() % 5000);
+    }
+
+    res->add = ngx_bench_msec() - start;
+
+    /*
+     * the random timers are re-armed as the requests come in,
+     * the clock goes on by 1 ms for every n / 1000 requests
+     */
+
+    tick = ngx_max(n / 1000, 1);
+
+    start = ngx_bench_msec();
+
+    for (i = 0; i < n * rounds; i++) {
+        ev = &events[ngx_bench_random() % n];
+
+        ngx_add_timer(ev, NGX_BENCH_TIMEOUT + ngx_bench_random() % 5000);
+
+        if (i % tick == 0) {
+            ngx_current_msec++;
+            (void) ngx_event_find_timer();
+            ngx_event_expire_timers();
+        }
+    }
+
+    res->rearm = ngx_bench_msec() - start;
+
+    /* the clock goes on until all timers expire */
+
+    start = ngx_bench_msec();
+
+    while (ngx_bench_expired < n) {
+        ngx_current_msec++;
+        (void) ngx_event_find_timer();
+        ngx_event_expire_timers();
+    }
+
+    res->expire = ngx_bench_msec() - start;
+    res->expired = ngx_bench_expired;
+
+    /* the timers are added and deleted as for short requests */
+
+    for (i = 0; i < n; i++) {
+        ngx_add_timer(&events[i],
+                      NGX_BENCH_TIMEOUT + ngx_bench_random() % 5000);
+    }
+
+    start = ngx_bench_msec();
+
+    for (i = 0; i < n; i++) {
+        ngx_del_timer(&events[i]);
+    }
+
+    res->del = ngx_bench_msec() - start;
+}
+
+
+static void
+ngx_bench_handler(ngx_event_t *ev)
+{
+    ngx_bench_expired++;
+}
+
+
+static ngx_msec_t
+ngx_bench_msec(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static ngx_uint_t
+ngx_bench_random(void)
+{
+    /* the same sequence for both backends */
+
+    ngx_bench_seed = ngx_bench_seed * 1103515245 + 12345;
+
+    return ngx_bench_seed >> 8;
+}
+
+
+static void
+ngx_bench_report(char *name, ngx_bench_result_t *res, ngx_uint_t n,
+    ngx_uint_t rounds)
+{
+    printf("%-8s %12.1f %12.1f %12.1f %12.1f\n", name,
+           (double) res->add * 1000000 / n,
+           (double) res->rearm * 1000000 / (n * rounds),
+           (double) res->expire * 1000000 / n,
+           (double) res->del * 1000000 / n);
+}
+
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+{
+}
@@ -228,7 +228,9 @@ ngx_add_channel_event(ngx_cycle_t *cycle, ngx_fd_t fd, ngx_int_t event,
 
     ev->handler = handler;
 
-    if (ngx_add_conn && (ngx_event_flags & NGX_USE_EPOLL_EVENT) == 0) {
+    if (ngx_add_conn
+        && (ngx_event_flags & (NGX_USE_EPOLL_EVENT|NGX_USE_URING_EVENT)) == 0)
+    {
         if (ngx_add_conn(c) == NGX_ERROR) {
             ngx_free_connection(c);
             return NGX_ERROR;
@@ -55,6 +55,10 @@ typedef int               ngx_err_t;
 #define NGX_EMLINK        EMLINK
 #endif
 
+#if (NGX_HAVE_IO_URING)
+#define NGX_ETIME         ETIME
+#endif
+
 #if (__hpux__)
 #define NGX_EAGAIN        EWOULDBLOCK
 #else
@@ -8,6 +8,9 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#if (NGX_THREAD_POOL)
+#include <ngx_thread_pool.h>
+#endif
 
 
 /*
@@ -34,6 +37,25 @@
 #endif
 
 
+#if (NGX_THREAD_POOL)
+
+typedef struct {
+    ngx_buf_t     *file;
+    ngx_socket_t   socket;
+    size_t         size;
+
+    size_t         sent;
+    ngx_err_t      err;
+} ngx_linux_sendfile_ctx_t;
+
+
+static ngx_int_t ngx_linux_sendfile_thread(ngx_connection_t *c,
+    ngx_buf_t *file, size_t size, off_t *sent);
+static void ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log);
+
+#endif
+
+
 ngx_chain_t *
 ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
 {
@@ -261,6 +283,36 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
                            "sendfile: @%O %uz", file->file_pos, file_size);
 
+#if (NGX_THREAD_POOL)
+
+            if (file->file->thread_handler) {
+                switch (ngx_linux_sendfile_thread(c, file, file_size, &sent)) {
+
+                case NGX_OK:
+                    break;
+
+                case NGX_DONE:
+                    return in;
+
+                case NGX_AGAIN:
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, NGX_EAGAIN,
+                                   "sendfile() is not ready");
+                    break;
+
+                default:
+                    wev->error = 1;
+                    return NGX_CHAIN_ERROR;
+                }
+
+                ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                               "sendfile thread: @%O %O:%uz",
+                               file->file_pos, sent, file_size);
+
+                goto update;
+            }
+
+#endif
+
             rc = sendfile(c->fd, file->file->fd, &offset, file_size);
 
             if (rc == -1) {
@@ -319,6 +371,10 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
             ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "writev: %O", sent);
         }
 
+#if (NGX_THREAD_POOL)
+    update:
+#endif
+
         if (send - prev_send == sent) {
             complete = 1;
         }
@@ -378,3 +434,112 @@ ngx_linux_sendfile_chain(ngx_connection_t *c, ngx_chain_t *in, off_t limit)
         in = cl;
     }
 }
+
+
+#if (NGX_THREAD_POOL)
+
+static ngx_int_t
+ngx_linux_sendfile_thread(ngx_connection_t *c, ngx_buf_t *file, size_t size,
+    off_t *sent)
+{
+    ngx_event_t               *wev;
+    ngx_thread_task_t         *task;
+    ngx_linux_sendfile_ctx_t  *ctx;
+
+    task = c->sendfile_task;
+
+    if (task == NULL) {
+        task = ngx_thread_task_alloc(c->pool, sizeof(ngx_linux_sendfile_ctx_t));
+        if (task == NULL) {
+            return NGX_ERROR;
+        }
+
+        task->handler = ngx_linux_sendfile_thread_handler;
+
+        c->sendfile_task = task;
+    }
+
+    ctx = task->ctx;
+    wev = c->write;
+
+    if (task->event.complete) {
+        task->event.complete = 0;
+
+        if (ctx->err == NGX_EAGAIN) {
+            *sent = 0;
+
+            /*
+             * the socket could become writable while the task was
+             * running, the edge-triggered event is lost then
+             */
+
+            if (!wev->complete) {
+                return NGX_AGAIN;
+            }
+
+        } else if (ctx->err) {
+            ngx_connection_error(c, ctx->err, "sendfile() failed");
+            return NGX_ERROR;
+
+        } else {
+            *sent = ctx->sent;
+            return NGX_OK;
+        }
+    }
+
+    ctx->file = file;
+    ctx->socket = c->fd;
+    ctx->size = size;
+
+    wev->complete = 0;
+
+    if (file->file->thread_handler(task, file->file) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_linux_sendfile_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_linux_sendfile_ctx_t *ctx = data;
+
+    ssize_t     n;
+    ngx_buf_t  *file;
+#if (NGX_HAVE_SENDFILE64)
+    off_t       offset;
+#else
+    int32_t     offset;
+#endif
+
+    ngx_log_debug0(NGX_LOG_DEBUG_CORE, log, 0, "linux sendfile thread");
+
+    file = ctx->file;
+
+#if (NGX_HAVE_SENDFILE64)
+    offset = file->file_pos;
+#else
+    offset = (int32_t) file->file_pos;
+#endif
+
+    do {
+        n = sendfile(ctx->socket, file->file->fd, &offset, ctx->size);
+
+        if (n == -1) {
+            ctx->err = ngx_errno;
+
+        } else {
+            ctx->sent = n;
+            ctx->err = 0;
+        }
+
+    } while (ctx->err == NGX_EINTR);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_CORE, log, 0,
+                   "sendfile: %z (err: %i) of %uz @%O",
+                   n, ctx->err, ctx->size, file->file_pos);
+}
+
+#endif
@@ -582,6 +582,17 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        /* the nested pools of ngx_slab_split() have their own mutexes */
+
+        for (sp = sp->nested; sp; sp = sp->next) {
+
+            if (ngx_shmtx_force_unlock(&sp->mutex, pid)) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "shared memory zone \"%V\" part was locked "
+                              "by %P", &shm_zone[i].shm.name, pid);
+            }
+        }
     }
 }
 
@@ -33,6 +33,7 @@ static void ngx_cache_loader_process_handler(ngx_event_t *ev);
 
 
 ngx_uint_t    ngx_process;
+ngx_uint_t    ngx_worker;
 ngx_pid_t     ngx_pid;
 ngx_uint_t    ngx_threaded;
 
@@ -55,6 +56,8 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_event_handler_pt  ngx_channel_wakeup_handler;
+
 
 #if (NGX_THREADS)
 volatile ngx_thread_t  ngx_threads[NGX_MAX_THREADS];
@@ -735,6 +738,7 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data) /* worker
     ngx_connection_t  *c;
 
     ngx_process = NGX_PROCESS_WORKER;
+    ngx_worker = worker;
 
     ngx_worker_process_init(cycle, worker);
 
@@ -802,8 +806,7 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data) /* worker
                 }
             }
 
-            if (ngx_event_timer_rbtree.root == ngx_event_timer_rbtree.sentinel)
-            {
+            if (ngx_event_no_timers_left()) {
                 ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0, "exiting");
 
                 ngx_worker_process_exit(cycle);
@@ -1166,11 +1169,45 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_WAKEUP:
+
+            if (ngx_channel_wakeup_handler) {
+                ngx_channel_wakeup_handler(ev);
+            }
+
+            break;
         }
     }
 }
 
 
+void
+ngx_channel_wakeup(ngx_int_t slot, ngx_log_t *log)
+{
+    ngx_channel_t  ch;
+
+    if (slot == ngx_process_slot
+        || ngx_processes[slot].pid == -1
+        || ngx_processes[slot].channel[0] == -1)
+    {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                   "wakeup channel s:%i pid:%P",
+                   slot, ngx_processes[slot].pid);
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    (void) ngx_write_channel(ngx_processes[slot].channel[0], &ch,
+                             sizeof(ngx_channel_t), log);
+}
+
+
 #if (NGX_THREADS)
 
 static void
@@ -18,6 +18,7 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_WAKEUP         6
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -36,9 +37,11 @@ typedef struct {
 
 void ngx_master_process_cycle(ngx_cycle_t *cycle);
 void ngx_single_process_cycle(ngx_cycle_t *cycle);
+void ngx_channel_wakeup(ngx_int_t slot, ngx_log_t *log);
 
 
 extern ngx_uint_t      ngx_process;
+extern ngx_uint_t      ngx_worker;
 extern ngx_pid_t       ngx_pid;
 extern ngx_pid_t       ngx_new_binary;
 extern ngx_uint_t      ngx_inherited;
@@ -46,6 +49,8 @@ extern ngx_uint_t      ngx_daemonized;
 extern ngx_uint_t      ngx_threaded;
 extern ngx_uint_t      ngx_exiting;
 
+extern ngx_event_handler_pt  ngx_channel_wakeup_handler;
+
 extern sig_atomic_t    ngx_reap;
 extern sig_atomic_t    ngx_sigio;
 extern sig_atomic_t    ngx_sigalrm;